@@ -0,0 +1,140 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "crc16.h"
+#include "tf_bytes.h"
+
+/* Compares each crc16_ansi() implementation, and the fused swap and CRC
+ * kernels against swapping and then checksumming in two passes, as every
+ * received and sent packet needs.
+ */
+
+static int size = 0xFFF0;
+static int loops = 2000;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, __u16 crc)
+{
+	double secs = now() - start;
+
+	printf("%-28s %8.1f MB/s  (crc=%04X)\n", name, (double)size * loops / secs / 1e6, crc);
+}
+
+int main(int argc, char *argv[])
+{
+	__u8 *buf;
+	const char *impl;
+	char name[64];
+	double start;
+	__u16 crc;
+	int c;
+	int i;
+	int n;
+
+	while ((c = getopt(argc, argv, "s:n:")) != -1) {
+		switch (c) {
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 'n':
+				loops = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-s packet-size] [-n loops]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	buf = malloc(size + 1);
+	for (i = 0; i <= size; i++) {
+		buf[i] = i * 7;
+	}
+
+	printf("Swap and CRC of a %d byte packet, %d times\n", size, loops);
+
+	/* The CRC alone */
+	for (n = 0; (impl = crc16_ansi_impl(n)) != NULL; n++) {
+		crc16_ansi_use(impl);
+		start = now();
+		for (i = 0, crc = 0; i < loops; i++) {
+			crc = crc16_ansi(crc, buf, size);
+		}
+		snprintf(name, sizeof(name), "crc16_ansi (%s)", impl);
+		report(name, start, crc);
+	}
+	crc16_ansi_use(NULL);
+
+	/* Received packets: swap, then CRC */
+	start = now();
+	for (i = 0, crc = 0; i < loops; i++) {
+		byte_swap(buf, size + size % 2);
+		crc = crc16_ansi(0, buf, size);
+	}
+	report("receive, two passes", start, crc);
+
+	for (n = 0; (impl = crc16_swab_impl(n)) != NULL; n++) {
+		crc16_swab_use(impl);
+		start = now();
+		for (i = 0, crc = 0; i < loops; i++) {
+			crc = crc16_ansi_unswab(0, buf, size);
+		}
+		snprintf(name, sizeof(name), "receive, fused (%s)", impl);
+		report(name, start, crc);
+	}
+
+	/* Sent packets: CRC, then swap */
+	start = now();
+	for (i = 0, crc = 0; i < loops; i++) {
+		crc = crc16_ansi(0, buf, size);
+		byte_swap(buf, size + size % 2);
+	}
+	report("send, two passes", start, crc);
+
+	for (n = 0; (impl = crc16_swab_impl(n)) != NULL; n++) {
+		crc16_swab_use(impl);
+		start = now();
+		for (i = 0, crc = 0; i < loops; i++) {
+			crc = crc16_ansi_swab(0, buf, size);
+		}
+		snprintf(name, sizeof(name), "send, fused (%s)", impl);
+		report(name, start, crc);
+	}
+
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,259 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "tf_io.h"
+#include "tf_proto.h"
+#include "tf_sim.h"
+#include "tf_timing.h"
+#include "tf_fault.h"
+
+/* Measures how long each recovery path takes to make the link usable again,
+ * with a simulated device which runs at about the speed of a real one.
+ */
+
+static char root[64];
+static int timeout = TF_DEFAULT_TIMEOUT;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static tf_transport *bench_open(tf_handle *tf)
+{
+	tf_timing timing;
+
+	tf_timing_defaults(&timing);
+	timing.idle = 0;
+	if (topfield_open_transport(tf, tf_transport_fault(tf_transport_timed(tf_transport_sim(root), &timing))) != 0) {
+		fprintf(stderr, "Failed to open the simulator\n");
+		exit(1);
+	}
+	tf->timeout = timeout;
+	tf_init(tf);
+
+	return tf->transport;
+}
+
+static void add_rule(tf_transport *t, int dir, __u32 cmd, int skip, int count, tf_fault_action action)
+{
+	tf_fault_rule rule;
+
+	rule.dir = dir;
+	rule.cmd = cmd;
+	rule.skip = skip;
+	rule.count = count;
+	rule.action = action;
+	rule.arg = 0;
+	tf_fault_add(t, &rule);
+}
+
+/**
+ * Runs tf_init() until the device answers.
+ * Returns the number of times needed.
+ */
+static int make_usable(tf_handle *tf)
+{
+	tf_size_result size;
+	int tries = 0;
+
+	while (tf_cmd_size(tf, &size) != 0 && tries < 10) {
+		tries++;
+		tf_init(tf);
+	}
+	return tries;
+}
+
+static void report(const char *name, double start, int tries)
+{
+	printf("%-44s %8.3fs", name, now() - start);
+	if (tries) {
+		printf("  (needed tf_init() x%d)", tries);
+	}
+	printf("\n");
+}
+
+static void start_get(tf_handle *tf)
+{
+	tf_dirent dirent;
+	tf_buffer buf;
+
+	tf_cmd_get(tf, "/test.rec", 0, &dirent);
+	tf_cmd_get_next(tf, &buf);
+	tf_cmd_get_next(tf, &buf);
+}
+
+static void bench_get_cancel(const char *name, int lose_cancel)
+{
+	tf_handle tf;
+	tf_transport *t = bench_open(&tf);
+	double start;
+
+	if (lose_cancel) {
+		add_rule(t, TF_FAULT_RECV, TF_MSG_SUCCESS, 0, 1, TF_FAULT_DROP);
+	}
+	start_get(&tf);
+
+	start = now();
+	tf_cmd_get_cancel(&tf);
+	report(name, start, make_usable(&tf));
+	topfield_close(&tf);
+}
+
+static void bench_get_corrupt(const char *name)
+{
+	tf_handle tf;
+	tf_transport *t = bench_open(&tf);
+	tf_buffer buf;
+	double start;
+
+	add_rule(t, TF_FAULT_RECV, TF_MSG_HDD_FILE_DATA, 2, 1, TF_FAULT_CORRUPT);
+	start_get(&tf);
+
+	start = now();
+	while (tf_cmd_get_next(&tf, &buf) == 0) {
+	}
+	tf_cmd_get_cancel(&tf);
+	report(name, start, make_usable(&tf));
+	topfield_close(&tf);
+}
+
+static void bench_put_cancel(const char *name)
+{
+	static __u8 data[MAX_PUT_SIZE];
+	tf_handle tf;
+	double start;
+
+	bench_open(&tf);
+	tf_cmd_put(&tf, "/put.rec", sizeof(data) * 4, time(0), 0);
+	tf_cmd_put_data(&tf, 0, data, sizeof(data));
+
+	start = now();
+	tf_cmd_put_cancel(&tf);
+	report(name, start, make_usable(&tf));
+	topfield_close(&tf);
+}
+
+static void bench_init(const char *name, tf_fault_action action, int count)
+{
+	tf_handle tf;
+	tf_transport *t = bench_open(&tf);
+	double start;
+
+	if (count) {
+		add_rule(t, TF_FAULT_RECV, 0, 0, count, action);
+	}
+
+	start = now();
+	tf_init(&tf);
+	report(name, start, make_usable(&tf));
+	topfield_close(&tf);
+}
+
+static void bench_random(const char *name, int permille, int ops)
+{
+	tf_handle tf;
+	tf_transport *t = bench_open(&tf);
+	tf_size_result size;
+	tf_fault_stats stats;
+	double start;
+	int tries = 0;
+	int i;
+
+	tf_fault_random(t, permille, timeout * 2, 1);
+
+	start = now();
+	for (i = 0; i < ops; i++) {
+		if (tf_cmd_size(&tf, &size) != 0) {
+			tries += make_usable(&tf);
+		}
+	}
+	tf_fault_clear(t);
+	tries += make_usable(&tf);
+	report(name, start, tries);
+
+	tf_fault_get_stats(t, &stats);
+	printf("%44s dropped=%d truncated=%d corrupted=%d delayed=%d\n", "",
+		stats.dropped, stats.truncated, stats.corrupted, stats.delayed);
+	topfield_close(&tf);
+}
+
+int main(int argc, char *argv[])
+{
+	char path[128];
+	FILE *fh;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+			case 't':
+				timeout = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-t timeout-ms]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	strcpy(root, "/tmp/bench_recoveryXXXXXX");
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/test.rec", root);
+	fh = fopen(path, "w");
+	for (i = 0; i < 1024 * 1024; i++) {
+		fputc(i, fh);
+	}
+	fclose(fh);
+
+	printf("Recovery time until the link is usable, timeout=%dms\n", timeout);
+
+	bench_init("tf_init()", 0, 0);
+	bench_init("tf_init(), first reply corrupt", TF_FAULT_CORRUPT, 1);
+	bench_init("tf_init(), first two replies lost", TF_FAULT_DROP, 2);
+	bench_get_cancel("tf_cmd_get_cancel()", 0);
+	bench_get_cancel("tf_cmd_get_cancel(), reply lost", 1);
+	bench_get_corrupt("corrupt FILE_DATA, then tf_cmd_get_cancel()");
+	bench_put_cancel("tf_cmd_put_cancel()");
+	bench_random("100 commands, 5% random faults", 50, 100);
+
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/put.rec", root);
+	unlink(path);
+	rmdir(root);
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "tf_io.h"
+#include "tf_util.h"
+#include "tf_sim.h"
+#include "tf_timing.h"
+
+/* Compares tf_stat() by listing the parent directory with tf_stat()
+ * by FILE_SEND probe, as the directory grows.
+ * Times are on the clock of the timing model, so the run itself is quick.
+ */
+
+#define REPEAT 8
+
+static char root[64];
+
+static void make_files(int from, int to)
+{
+	char path[128];
+	int i;
+
+	for (i = from; i < to; i++) {
+		snprintf(path, sizeof(path), "%s/DataFiles/file%05d.rec", root, i);
+		close(creat(path, 0666));
+	}
+}
+
+/**
+ * Returns the average model time in ms for tf_stat() of files spread
+ * through a directory of 'count'. A listing stops at the file, so
+ * this is about half a listing on average.
+ */
+static double time_stat(int count, int fast_stat)
+{
+	tf_handle tf;
+	tf_timing timing;
+	tf_dirent dirent;
+	char path[64];
+	__u64 start;
+	int i;
+
+	tf_timing_defaults(&timing);
+	timing.idle = 0;
+	timing.realtime = 0;
+	if (topfield_open_transport(&tf, tf_transport_timed(tf_transport_sim(root), &timing)) != 0) {
+		fprintf(stderr, "Failed to open the simulator\n");
+		exit(1);
+	}
+	tf_init(&tf);
+	tf.fast_stat = fast_stat;
+
+	start = tf_timed_clock(tf.transport);
+	for (i = 0; i < REPEAT; i++) {
+		snprintf(path, sizeof(path), "/DataFiles/file%05d.rec", (2 * i + 1) * count / (2 * REPEAT));
+		if (tf_stat(&tf, path, &dirent) != 0) {
+			fprintf(stderr, "Failed to stat %s\n", path);
+			exit(1);
+		}
+	}
+	start = tf_timed_clock(tf.transport) - start;
+
+	topfield_close(&tf);
+	return start / 1000.0 / REPEAT;
+}
+
+int main(void)
+{
+	static const int counts[] = { 10, 100, 595, 1000, 2000, 5000 };
+	char path[128];
+	int made = 0;
+	int i;
+
+	strcpy(root, "/tmp/bench_statXXXXXX");
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/DataFiles", root);
+	mkdir(path, 0777);
+
+	printf("tf_stat() of a file, average model time per call\n");
+	printf("%8s %12s %12s\n", "entries", "listing", "probe");
+
+	for (i = 0; i < sizeof(counts) / sizeof(*counts); i++) {
+		make_files(made, counts[i]);
+		made = counts[i];
+		printf("%8d %10.2fms %10.2fms\n", counts[i], time_stat(counts[i], 0), time_stat(counts[i], 1));
+	}
+
+	for (i = 0; i < made; i++) {
+		snprintf(path, sizeof(path), "%s/DataFiles/file%05d.rec", root, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/DataFiles", root);
+	rmdir(path);
+	rmdir(root);
+
+	return 0;
+}
@@ -6,5 +6,6 @@ ifeq ($(SYSTEM),Darwin)
 USE_LIBUSB = 1
 LFLAGS += -framework IOKit -framework CoreFoundation
 CFLAGS += -I/usr/local/include
-LIBUSB := /usr/local/lib/libusb.a
+LIBUSB_CFLAGS := -I/usr/local/include/libusb-1.0
+LIBUSB := /usr/local/lib/libusb-1.0.a
 endif
@@ -31,4 +31,57 @@
 
 __u16 crc16_ansi(__u16 crc, const void *data, size_t size);
 
+/**
+ * crc16_ansi() has a table driven reference implementation, a portable
+ * slice-by-8 one and carry-less multiply ones (PCLMULQDQ, PMULL).
+ * They all give identical results. The best one which the CPU supports
+ * is chosen when it is first used.
+ *
+ * Returns the name of the n'th implementation which the CPU supports,
+ * best first, or NULL if there are fewer than n + 1.
+ */
+const char *crc16_ansi_impl(int n);
+
+/**
+ * Uses the named crc16_ansi() implementation, or the best one if 'name'
+ * is NULL.
+ * Returns 0 if OK or -1 if there is no such implementation or the CPU
+ * doesn't support it.
+ */
+int crc16_ansi_use(const char *name);
+
+/**
+ * Computes the CRC of 'size' bytes as crc16_ansi() does, and byte swaps
+ * them in place in the same pass, as byte_swap() does.
+ * If 'size' is odd, the last byte is swapped with the byte which follows it,
+ * which is not included in the CRC.
+ */
+__u16 crc16_ansi_swab(__u16 crc, void *data, size_t size);
+
+/**
+ * The reverse of crc16_ansi_swab(), for received packets.
+ * Byte swaps 'size' bytes in place as byte_swap() does, and computes the
+ * CRC of the swapped bytes as crc16_ansi() does, in the same pass.
+ * If 'size' is odd, the last byte is swapped with the byte which follows it,
+ * and only the byte which ends up first is included in the CRC.
+ */
+__u16 crc16_ansi_unswab(__u16 crc, void *data, size_t size);
+
+/**
+ * crc16_ansi_swab() and crc16_ansi_unswab() have scalar and SIMD
+ * implementations. The best one which the CPU supports is chosen
+ * when they are first used.
+ *
+ * Returns the name of the n'th implementation which the CPU supports,
+ * best first, or NULL if there are fewer than n + 1.
+ */
+const char *crc16_swab_impl(int n);
+
+/**
+ * Uses the named implementation, or the best one if 'name' is NULL.
+ * Returns 0 if OK or -1 if there is no such implementation or the CPU
+ * doesn't support it.
+ */
+int crc16_swab_use(const char *name);
+
 #endif
@@ -25,23 +25,68 @@
 
 /* MJD conversions as per Annex C of ETSI EN 300 468 */
 
+#include <pthread.h>
+#include <stdlib.h>
+
 #include "mjd.h"
 #include "tf_bytes.h"
 
-/* Convert Topfield MJD date and time structure to time_t */
-time_t tfdt_to_time(const struct tf_datetime * dt)
+/* The ETSI formulae are only valid from 1900-03-01 to 2100-02-28,
+ * and a 16 bit MJD runs out in 2038. Within this range the integer
+ * conversions give the same dates, and outside it the original
+ * conversions are used so that the results don't change.
+ */
+#define MJD_MIN 15079       /* 1900-03-01 */
+#define MJD_MAX 65535       /* 2038-04-22 */
+#define MJD_EPOCH 40587     /* 1970-01-01 */
+#define DAY 86400LL
+
+/* Local times are converted using a cache of the UTC offset, built with
+ * localtime_r() the first time each span of about a year is needed.
+ * Each span records the offset at its start and each change within it.
+ * Changes are found by looking at the offset once a day, so two changes
+ * less than a day apart would be missed.
+ */
+#define SPAN_SHIFT 25       /* 2^25 seconds is about 388 days */
+#define SPAN_CHANGES 8      /* More changes than this in a span fall back to libc */
+#define SPAN_START (((MJD_MIN - MJD_EPOCH) - 2) * DAY)
+#define SPAN_END (((MJD_MAX + 1 - MJD_EPOCH) + 2) * DAY)
+#define NUM_SPANS (int)(((SPAN_END - SPAN_START) >> SPAN_SHIFT) + 1)
+
+struct utc_span
+{
+    struct utc_span *retired;       /* Next span forgotten by tfdt_reset() */
+    int changes;                    /* Number of changes, or -1 if too many */
+    long offset;                    /* Offset at the start of the span */
+    long long when[SPAN_CHANGES];   /* Time of each change */
+    long after[SPAN_CHANGES];       /* and the offset from then on */
+};
+
+/* Spans are never freed, since another thread may be using one while
+ * tfdt_reset() forgets it. A forgotten span goes on the retired list.
+ */
+static struct utc_span *spans[NUM_SPANS];
+static struct utc_span *retired_spans;
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The span used last by a conversion, so that runs of times in the
+ * same span only look it up once
+ */
+struct span_cache
+{
+    int n;                          /* Span number, or -1 if none yet */
+    struct utc_span *span;
+};
+
+/* The original conversions, using floating point and libc */
+
+static time_t tfdt_to_time_libc(const struct tf_datetime *dt)
 {
     int mjd = get_u16(&dt->mjd);
     int y, m, d, k;
     struct tm tm;
     time_t result;
 
-	/* If mjd is all ones (0xffffffffff) then there is no date, so return 0 */
-
-	if (mjd == 0xffff && dt->second == 0xff && dt->minute == 0xff && dt->hour == 0xff) {
-		return 0;
-	}
-
     y = (int) ((mjd - 15078.2) / 365.25);
     m = (int) ((mjd - 14956.1 - ((int) (y * 365.25))) / 30.6001);
     d = mjd - 14956 - ((int) (y * 365.25)) - ((int) (m * 30.6001));
@@ -70,11 +115,11 @@ time_t tfdt_to_time(const struct tf_datetime * dt)
     return result;
 }
 
-/* Convert itime_t to Topfield MJD date and time structure */
-void time_to_tfdt(time_t t, struct tf_datetime *dt)
+static void time_to_tfdt_libc(time_t t, struct tf_datetime *dt)
 {
     int y, m, d, k, mjd;
-    struct tm *tm = localtime(&t);
+    struct tm tmbuf;
+    struct tm *tm = localtime_r(&t, &tmbuf);
 
     y = tm->tm_year;
     m = tm->tm_mon + 1;
@@ -96,3 +141,272 @@ void time_to_tfdt(time_t t, struct tf_datetime *dt)
     dt->minute = tm->tm_min;
     dt->second = tm->tm_sec;
 }
+
+static long libc_offset(long long t)
+{
+    time_t tt = t;
+    struct tm tm;
+
+    localtime_r(&tt, &tm);
+
+    return tm.tm_gmtoff;
+}
+
+static struct utc_span *span_build(int n)
+{
+    struct utc_span *span = malloc(sizeof(*span));
+    long long t = SPAN_START + ((long long)n << SPAN_SHIFT);
+    long long end = t + (1LL << SPAN_SHIFT);
+    long offset;
+
+    if (!span)
+    {
+        return 0;
+    }
+    /* localtime_r() need not notice a change of TZ by itself */
+    tzset();
+    span->retired = 0;
+    span->changes = 0;
+    span->offset = offset = libc_offset(t);
+
+    for (; t < end; t += DAY)
+    {
+        long long next = t + DAY < end ? t + DAY : end - 1;
+        long o = libc_offset(next);
+
+        if (o != offset)
+        {
+            /* Find the second where it changed */
+            long long lo = t;
+            long long hi = next;
+
+            while (hi - lo > 1)
+            {
+                long long mid = lo + (hi - lo) / 2;
+
+                if (libc_offset(mid) == offset)
+                {
+                    lo = mid;
+                }
+                else
+                {
+                    hi = mid;
+                }
+            }
+            if (span->changes == SPAN_CHANGES)
+            {
+                span->changes = -1;
+                break;
+            }
+            span->when[span->changes] = hi;
+            span->after[span->changes] = o;
+            span->changes++;
+            offset = o;
+        }
+    }
+    return span;
+}
+
+/**
+ * Returns span 'n', building it if need be, or 0 if out of memory.
+ */
+static struct utc_span *get_span(struct span_cache *cache, int n)
+{
+    struct utc_span *span;
+
+    if (cache->n == n)
+    {
+        return cache->span;
+    }
+
+    span = __atomic_load_n(&spans[n], __ATOMIC_ACQUIRE);
+    if (!span)
+    {
+        pthread_mutex_lock(&span_lock);
+        if (!spans[n])
+        {
+            __atomic_store_n(&spans[n], span_build(n), __ATOMIC_RELEASE);
+        }
+        span = spans[n];
+        pthread_mutex_unlock(&span_lock);
+        if (!span)
+        {
+            return 0;
+        }
+    }
+    cache->n = n;
+    cache->span = span;
+    return span;
+}
+
+/**
+ * Finds the UTC offset in effect at time 't'.
+ * Returns 0 if OK, or -1 if libc has to be asked instead.
+ */
+static int utc_offset(struct span_cache *cache, long long t, long *offset)
+{
+    struct utc_span *span;
+    int i;
+
+    if (t < SPAN_START || t >= SPAN_END || (time_t)t != t)
+    {
+        return -1;
+    }
+    span = get_span(cache, (t - SPAN_START) >> SPAN_SHIFT);
+    if (!span || span->changes < 0)
+    {
+        return -1;
+    }
+
+    *offset = span->offset;
+    for (i = 0; i < span->changes && t >= span->when[i]; i++)
+    {
+        *offset = span->after[i];
+    }
+    return 0;
+}
+
+/**
+ * Converts a local time to UTC, if it corresponds to exactly one UTC time.
+ * Local times which are skipped or repeated when the offset changes are
+ * left to mktime(), since it is what decides which one they mean.
+ * Returns 0 if OK, or -1 if libc has to be asked instead.
+ */
+static int local_to_utc(struct span_cache *cache, long long local, long long *utc)
+{
+    long long result = 0;
+    int found = 0;
+    int i;
+
+    /* Usually every time near the local time is in one span with no changes */
+    if (local - 2 * DAY >= SPAN_START && local + 2 * DAY < SPAN_END &&
+        (local - 2 * DAY - SPAN_START) >> SPAN_SHIFT == (local + 2 * DAY - SPAN_START) >> SPAN_SHIFT)
+    {
+        struct utc_span *span = get_span(cache, (local - SPAN_START) >> SPAN_SHIFT);
+
+        if (span && span->changes == 0)
+        {
+            *utc = local - span->offset;
+            return 0;
+        }
+    }
+
+    /* Any offset which might apply is in effect within two days of the local time */
+    for (i = -1; i <= 1; i++)
+    {
+        long o;
+        long check;
+
+        if (utc_offset(cache, local + i * 2 * DAY, &o) != 0 || utc_offset(cache, local - o, &check) != 0)
+        {
+            return -1;
+        }
+        if (check == o && (!found || result != local - o))
+        {
+            result = local - o;
+            found++;
+        }
+    }
+    if (found != 1)
+    {
+        return -1;
+    }
+    *utc = result;
+    return 0;
+}
+
+static time_t tfdt_to_time_cached(const struct tf_datetime *dt, struct span_cache *cache)
+{
+    int mjd = get_u16(&dt->mjd);
+    long long utc;
+
+	/* If mjd is all ones (0xffffffffff) then there is no date, so return 0 */
+
+	if (mjd == 0xffff && dt->second == 0xff && dt->minute == 0xff && dt->hour == 0xff) {
+		return 0;
+	}
+
+    if (mjd >= MJD_MIN)
+    {
+        /* An MJD is already a day number, so the local time is easy */
+        long long local = (mjd - MJD_EPOCH) * DAY + dt->hour * 3600 + dt->minute * 60 + dt->second;
+
+        if (local_to_utc(cache, local, &utc) == 0)
+        {
+            return utc;
+        }
+    }
+    return tfdt_to_time_libc(dt);
+}
+
+/* Convert Topfield MJD date and time structure to time_t */
+time_t tfdt_to_time(const struct tf_datetime * dt)
+{
+    struct span_cache cache = { -1, 0 };
+
+    return tfdt_to_time_cached(dt, &cache);
+}
+
+void tfdt_to_time_batch(const struct tf_datetime *dt, size_t dt_stride, time_t *t, size_t t_stride, int count)
+{
+    struct span_cache cache = { -1, 0 };
+    const char *from = (const char *)dt;
+    char *to = (char *)t;
+    int i;
+
+    /* Listings are mostly of recent files, so the span is usually the same */
+    for (i = 0; i < count; i++, from += dt_stride, to += t_stride)
+    {
+        *(time_t *)to = tfdt_to_time_cached((const struct tf_datetime *)from, &cache);
+    }
+}
+
+/* Convert itime_t to Topfield MJD date and time structure */
+void time_to_tfdt(time_t t, struct tf_datetime *dt)
+{
+    struct span_cache cache = { -1, 0 };
+    long offset;
+
+    if (utc_offset(&cache, t, &offset) == 0)
+    {
+        long long local = (long long)t + offset;
+        long long days = local / DAY;
+        int secs;
+
+        if (local % DAY < 0)
+        {
+            days--;
+        }
+        secs = local - days * DAY;
+
+        if (days + MJD_EPOCH >= MJD_MIN && days + MJD_EPOCH <= MJD_MAX)
+        {
+            put_u16(&dt->mjd, days + MJD_EPOCH);
+            dt->hour = secs / 3600;
+            dt->minute = secs / 60 % 60;
+            dt->second = secs % 60;
+            return;
+        }
+    }
+    time_to_tfdt_libc(t, dt);
+}
+
+void tfdt_reset(void)
+{
+    int i;
+
+    pthread_mutex_lock(&span_lock);
+    tzset();
+    for (i = 0; i < NUM_SPANS; i++)
+    {
+        struct utc_span *span = spans[i];
+
+        if (span)
+        {
+            __atomic_store_n(&spans[i], 0, __ATOMIC_RELEASE);
+            span->retired = retired_spans;
+            retired_spans = span;
+        }
+    }
+    pthread_mutex_unlock(&span_lock);
+}
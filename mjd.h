@@ -25,6 +25,7 @@
 #ifndef _MJD_H
 #define _MJD_H 1
 
+#include <stddef.h>
 #include <time.h>
 #include "tf_types.h"
 
@@ -49,4 +50,23 @@ time_t tfdt_to_time(const struct tf_datetime *dt);
  */
 void time_to_tfdt(time_t t, struct tf_datetime *dt);
 
+/**
+ * Converts 'count' tf_datetimes to time_t.
+ * Successive inputs are 'dt_stride' bytes apart and successive
+ * results 't_stride' bytes apart, so that the fields of an array
+ * of structures can be converted in place.
+ * This is quicker than converting them one at a time when many are
+ * in the same year.
+ */
+void tfdt_to_time_batch(const struct tf_datetime *dt, size_t dt_stride, time_t *t, size_t t_stride, int count);
+
+/**
+ * The conversions remember the local UTC offset, so that they
+ * need not call mktime() or localtime() each time. Call this after
+ * changing TZ to forget it.
+ * It is safe to call while other threads are converting, but the
+ * memory used by what is forgotten is not freed.
+ */
+void tfdt_reset(void);
+
 #endif /* _MJD_H */
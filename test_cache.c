@@ -0,0 +1,207 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include "tf_util.h"
+#include "tf_cache.h"
+#include "tf_sim.h"
+
+static char root[64];
+
+static void put_file(tf_handle *tf, const char *path, size_t size)
+{
+	static __u8 data[1000];
+
+	assert(tf_cmd_put(tf, path, size, 1136073600, 0) == 0);
+	assert(tf_cmd_put_data(tf, 0, data, size) == 0);
+	assert(tf_cmd_put_done(tf) == 0);
+}
+
+/* Makes a file behind the handle's back, as a recording would */
+static void local_file(const char *name)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	assert(fd >= 0);
+	close(fd);
+}
+
+static void check_stats(tf_handle *tf, unsigned long hits, unsigned long misses)
+{
+	tf_cache_stats stats;
+
+	tf_cache_get_stats(tf, &stats);
+	if (stats.hits != hits || stats.misses != misses) {
+		printf("test_cache: %lu hits %lu misses, expected %lu hits %lu misses\n", stats.hits, stats.misses, hits, misses);
+		exit(1);
+	}
+}
+
+static int count_callback(const tf_dirent *dirent, void *arg)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+static int count_entries(tf_handle *tf, const char *path)
+{
+	int count = 0;
+
+	assert(tf_dir_foreach(tf, path, count_callback, &count) == 0);
+	return count;
+}
+
+int main(void)
+{
+	tf_handle tf;
+	tf_dirent dirent;
+	tf_dir_entries entries;
+	tf_cache_stats stats;
+
+	strcpy(root, "/tmp/test_cacheXXXXXX");
+	assert(mkdtemp(root));
+
+	assert(topfield_open_transport(&tf, tf_transport_sim(root)) == 0);
+	assert(tf_init(&tf) == 0);
+
+	assert(tf_cmd_mkdir(&tf, "/DataFiles") == 0);
+	put_file(&tf, "/DataFiles/a.rec", 100);
+	put_file(&tf, "/DataFiles/b.rec", 200);
+
+	/* Nothing is counted until the cache is on */
+	check_stats(&tf, 0, 0);
+	assert(tf_cache_enable(&tf, 0) == 0);
+
+	/* The first stat lists the directory, and the rest use the listing */
+	assert(tf_stat(&tf, "/DataFiles/a.rec", &dirent) == 0);
+	assert(dirent.size == 100 && dirent.type == 'f');
+	check_stats(&tf, 0, 1);
+	assert(tf_stat(&tf, "/DataFiles/b.rec", &dirent) == 0);
+	assert(dirent.size == 200 && strcmp(dirent.name, "b.rec") == 0);
+	assert(tf_stat(&tf, "/DataFiles//./b.rec", &dirent) == 0);
+	assert(tf_stat(&tf, "/ProgramFiles/../DataFiles/b.rec", &dirent) == 0);
+	assert(tf_stat(&tf, "/DataFiles/missing.rec", &dirent) == 1);
+	assert(tf_stat(&tf, "/DataFiles", &dirent) == 0);
+	check_stats(&tf, 4, 2);
+	assert(dirent.type == 'd');
+
+	assert(count_entries(&tf, "/DataFiles/") == 2);
+	check_stats(&tf, 5, 2);
+	printf("test_cache: stat and list OK\n");
+
+	/* With no TTL, changes on the device are not seen */
+	local_file("DataFiles/c.rec");
+	assert(tf_stat(&tf, "/DataFiles/c.rec", &dirent) == 1);
+	check_stats(&tf, 6, 2);
+
+	/* But changes through the handle are, without listing again */
+	assert(tf_cmd_delete(&tf, "/DataFiles/a.rec") == 0);
+	assert(tf_stat(&tf, "/DataFiles/a.rec", &dirent) == 1);
+	assert(tf_cmd_rename(&tf, "/DataFiles/b.rec", "/DataFiles/d.rec") == 0);
+	assert(tf_stat(&tf, "/DataFiles/b.rec", &dirent) == 1);
+	assert(tf_stat(&tf, "/DataFiles/d.rec", &dirent) == 0);
+	assert(dirent.size == 200 && strcmp(dirent.name, "d.rec") == 0);
+	check_stats(&tf, 9, 2);
+
+	/* A new directory means listing the parent again, which finds c.rec too */
+	assert(tf_cmd_mkdir(&tf, "/DataFiles/sub") == 0);
+	assert(tf_stat(&tf, "/DataFiles/sub", &dirent) == 0);
+	assert(dirent.type == 'd');
+	assert(tf_stat(&tf, "/DataFiles/c.rec", &dirent) == 0);
+	check_stats(&tf, 10, 3);
+
+	/* And so does a put */
+	put_file(&tf, "/DataFiles/e.rec", 300);
+	assert(tf_stat(&tf, "/DataFiles/e.rec", &dirent) == 0);
+	assert(dirent.size == 300);
+	check_stats(&tf, 10, 4);
+
+	/* Moving a file between cached directories */
+	assert(count_entries(&tf, "/DataFiles/sub") == 0);
+	assert(tf_cmd_rename(&tf, "/DataFiles/e.rec", "/DataFiles/sub/e.rec") == 0);
+	assert(count_entries(&tf, "/DataFiles/sub") == 1);
+	assert(count_entries(&tf, "/DataFiles") == 3);
+	check_stats(&tf, 12, 5);
+
+	/* Deleting a directory forgets its listing */
+	assert(tf_cmd_delete(&tf, "/DataFiles/sub/e.rec") == 0);
+	assert(tf_cmd_delete(&tf, "/DataFiles/sub") == 0);
+	assert(tf_cmd_mkdir(&tf, "/DataFiles/sub") == 0);
+	assert(count_entries(&tf, "/DataFiles/sub") == 0);
+	check_stats(&tf, 12, 6);
+	assert(tf_cmd_delete(&tf, "/DataFiles/sub") == 0);
+	printf("test_cache: changes through the handle OK\n");
+
+	/* The old listing API always goes to the device, but fills the cache */
+	local_file("DataFiles/f.rec");
+	assert(tf_cmd_dir_first(&tf, "/DataFiles", &entries) == 0);
+	assert(entries.count == 3);
+	assert(tf_cmd_dir_next(&tf, &entries) == TF_ERR_DONE);
+	assert(tf_stat(&tf, "/DataFiles/f.rec", &dirent) == 0);
+	check_stats(&tf, 13, 6);
+
+	/* A listing which is cancelled is not remembered */
+	tf_cache_flush(&tf);
+	assert(tf_cmd_dir_first(&tf, "/DataFiles", &entries) == 0);
+	assert(tf_cmd_dir_cancel(&tf) == 0);
+	assert(tf_stat(&tf, "/DataFiles/f.rec", &dirent) == 0);
+	check_stats(&tf, 13, 7);
+
+	/* With a TTL, changes on the device are seen once the listing expires */
+	assert(tf_cache_enable(&tf, 50) == 0);
+	local_file("DataFiles/g.rec");
+	assert(tf_stat(&tf, "/DataFiles/g.rec", &dirent) == 1);
+	usleep(100000);
+	assert(tf_stat(&tf, "/DataFiles/g.rec", &dirent) == 0);
+	tf_cache_get_stats(&tf, &stats);
+	assert(stats.expired == 1);
+	check_stats(&tf, 14, 8);
+	printf("test_cache: TTL OK\n");
+
+	/* And everything still works once it is off */
+	tf_cache_disable(&tf);
+	assert(tf_stat(&tf, "/DataFiles/g.rec", &dirent) == 0);
+	check_stats(&tf, 0, 0);
+
+	assert(tf_cmd_delete(&tf, "/DataFiles/c.rec") == 0);
+	assert(tf_cmd_delete(&tf, "/DataFiles/d.rec") == 0);
+	assert(tf_cmd_delete(&tf, "/DataFiles/f.rec") == 0);
+	assert(tf_cmd_delete(&tf, "/DataFiles/g.rec") == 0);
+	assert(tf_cmd_delete(&tf, "/DataFiles") == 0);
+
+	topfield_close(&tf);
+	rmdir(root);
+
+	printf("test_cache: OK\n");
+
+	return 0;
+}
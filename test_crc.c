@@ -5,13 +5,93 @@
 #include <assert.h>
 
 #include "crc16.h"
+#include "tf_bytes.h"
+
+/**
+ * Every implementation must give the same result as the table,
+ * for every length, alignment and starting value.
+ */
+static void test_crc(const char *impl)
+{
+	__u8 buf[2100];
+	__u16 expect;
+	int len;
+	int off;
+	int i;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = rand();
+	}
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len < sizeof(buf) - off; len += len < 300 ? 1 : 61) {
+			__u16 init = rand();
+
+			assert(crc16_ansi_use("table") == 0);
+			expect = crc16_ansi(init, buf + off, len);
+			assert(crc16_ansi_use(impl) == 0);
+			assert(crc16_ansi(init, buf + off, len) == expect);
+		}
+	}
+	printf("test_crc: crc16_ansi (%s) OK\n", impl);
+}
+
+/**
+ * The fused CRC and swap must match doing them separately,
+ * for every length and alignment.
+ */
+static void test_swab(const char *impl)
+{
+	__u16 c;
+	__u8 buf[1001];
+	__u8 swapped[1001];
+	int len;
+	int off;
+	int i;
+
+	assert(crc16_swab_use(impl) == 0);
+
+	for (off = 0; off < 4; off++) {
+		for (len = 0; len < 1000 - off; len += len < 100 ? 1 : 37) {
+			for (i = 0; i < sizeof(buf); i++) {
+				buf[i] = swapped[i] = i * 7 + len;
+			}
+			c = crc16_ansi_swab(0x1234, buf + off, len);
+			assert(c == crc16_ansi(0x1234, swapped + off, len));
+			byte_swap(swapped + off, len + len % 2);
+			assert(memcmp(buf, swapped, sizeof(buf)) == 0);
+
+			c = crc16_ansi_unswab(0x1234, buf + off, len);
+			byte_swap(swapped + off, len + len % 2);
+			assert(c == crc16_ansi(0x1234, swapped + off, len));
+			assert(memcmp(buf, swapped, sizeof(buf)) == 0);
+		}
+	}
+	printf("test_crc: crc16_ansi_swab/unswab (%s) OK\n", impl);
+}
 
 int main(void)
 {
 	__u16 c;
+	const char *impl;
+	int i;
 
 	c = crc16_ansi(0, "\x00\x01\x7f\xfa", 4);
 
 	printf("crc=%04X\n", c);
+
+	for (i = 0; (impl = crc16_ansi_impl(i)) != NULL; i++) {
+		test_crc(impl);
+	}
+	assert(i > 1);
+	assert(crc16_ansi_use("nonexistent") != 0);
+
+	/* Check the fused versions against the reference */
+	crc16_ansi_use("table");
+	for (i = 0; (impl = crc16_swab_impl(i)) != NULL; i++) {
+		test_swab(impl);
+	}
+	assert(i > 0);
+	assert(crc16_swab_use("nonexistent") != 0);
+
 	return 0;
 }
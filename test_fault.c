@@ -0,0 +1,196 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "tf_io.h"
+#include "tf_util.h"
+#include "tf_proto.h"
+#include "tf_sim.h"
+#include "tf_fault.h"
+
+static tf_transport *open_fault(tf_handle *tf, const char *root)
+{
+	assert(topfield_open_transport(tf, tf_transport_fault(tf_transport_sim(root))) == 0);
+	tf->timeout = 200;
+
+	return tf->transport;
+}
+
+static void add_rule(tf_transport *t, int dir, __u32 cmd, int skip, int count, tf_fault_action action, int arg)
+{
+	tf_fault_rule rule;
+
+	rule.dir = dir;
+	rule.cmd = cmd;
+	rule.skip = skip;
+	rule.count = count;
+	rule.action = action;
+	rule.arg = arg;
+	assert(tf_fault_add(t, &rule) == 0);
+}
+
+/**
+ * Tests that each kind of fault is seen by tf_io.c as it should be.
+ */
+int main(void)
+{
+	char root[64];
+	char path[128];
+	tf_handle tf;
+	tf_transport *t;
+	tf_size_result size;
+	tf_fault_stats stats;
+	tf_dirent dirent;
+	tf_buffer buf;
+	__u8 data[20000];
+	__u8 check[sizeof(data) + 1];
+	FILE *fh;
+	int rc = 0;
+	int i;
+
+	strcpy(root, "/tmp/test_faultXXXXXX");
+	assert(mkdtemp(root));
+	snprintf(path, sizeof(path), "%s/test.rec", root);
+	fh = fopen(path, "w");
+	for (i = 0; i < 300000; i++) {
+		fputc(i, fh);
+	}
+	fclose(fh);
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = i * 11;
+	}
+
+	t = open_fault(&tf, root);
+	assert(tf_init(&tf) == 0);
+
+	/* A corrupt reply */
+	add_rule(t, TF_FAULT_RECV, TF_MSG_HDD_SIZE_RESULT, 0, 1, TF_FAULT_CORRUPT, 0);
+	assert(tf_cmd_size(&tf, &size) == TF_ERR_CRC);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	/* A corrupt request is rejected by the device */
+	add_rule(t, TF_FAULT_SEND, TF_MSG_READY, 0, 1, TF_FAULT_CORRUPT, 0);
+	assert(tf_cmd_ready(&tf) == TF_ERR_CRC);
+	assert(tf_cmd_ready(&tf) == 0);
+
+	/* A lost reply times out */
+	add_rule(t, TF_FAULT_RECV, TF_MSG_SUCCESS, 0, 1, TF_FAULT_DROP, 0);
+	assert(tf_cmd_ready(&tf) == TF_ERR_IO);
+	assert(tf_cmd_ready(&tf) == 0);
+
+	/* A lost request too */
+	add_rule(t, TF_FAULT_SEND, TF_MSG_READY, 0, 1, TF_FAULT_DROP, 0);
+	assert(tf_cmd_ready(&tf) == TF_ERR_IO);
+	assert(tf_cmd_ready(&tf) == 0);
+
+	/* A short reply */
+	add_rule(t, TF_FAULT_RECV, TF_MSG_HDD_SIZE_RESULT, 0, 1, TF_FAULT_TRUNCATE, 4);
+	assert(tf_cmd_size(&tf, &size) == TF_ERR_IO);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	/* A late reply, but not too late */
+	add_rule(t, TF_FAULT_RECV, TF_MSG_HDD_SIZE_RESULT, 0, 1, TF_FAULT_DELAY, 50);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	tf_fault_get_stats(t, &stats);
+	assert(stats.corrupted == 2);
+	assert(stats.dropped == 2);
+	assert(stats.truncated == 1);
+	assert(stats.delayed == 1);
+
+	/* With no timeout the late reply is waited for, as by every other transport */
+	i = tf.timeout;
+	tf.timeout = 0;
+	add_rule(t, TF_FAULT_RECV, TF_MSG_HDD_SIZE_RESULT, 0, 1, TF_FAULT_DELAY, 50);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	tf.timeout = i;
+
+	/* A corrupt packet part way through a get can be cancelled */
+	tf_fault_clear(t);
+	add_rule(t, TF_FAULT_RECV, TF_MSG_HDD_FILE_DATA, 2, 1, TF_FAULT_CORRUPT, 0);
+	assert(tf_cmd_get(&tf, "/test.rec", 0, &dirent) == 0);
+	assert(tf_cmd_get_next(&tf, &buf) == 0);
+	assert(tf_cmd_get_next(&tf, &buf) == 0);
+	assert(tf_cmd_get_next(&tf, &buf) == TF_ERR_CRC);
+	assert(tf_cmd_get_cancel(&tf) == 0);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	/* A corrupt FILE_START is an error for a stat probe, not "not found",
+	 * and the device is not left part way through the get
+	 */
+	tf_fault_clear(t);
+	add_rule(t, TF_FAULT_RECV, TF_MSG_HDD_FILE_START, 0, 1, TF_FAULT_CORRUPT, 0);
+	assert(tf_stat_probe(&tf, "/test.rec", &dirent) == TF_ERR_CRC);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	assert(tf_stat_probe(&tf, "/test.rec", &dirent) == 0);
+	assert(dirent.size == 300000);
+	assert(tf_stat_probe(&tf, "/missing.rec", &dirent) == 1);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	/* An error reported by the device during a windowed put is returned,
+	 * not taken as a sign that the device can't cope with the window
+	 */
+	tf_fault_clear(t);
+	add_rule(t, TF_FAULT_SEND, TF_MSG_HDD_FILE_DATA, 5, 1, TF_FAULT_CORRUPT, 0);
+	tf.put_window = 4;
+	assert(tf_cmd_put(&tf, "/put.rec", sizeof(data), 0, 0) == 0);
+	for (i = 0; i < sizeof(data) && (rc = tf_cmd_put_data(&tf, i, data + i, 1000)) == 0; i += 1000) {
+	}
+	assert(rc == TF_ERR_CRC);
+	assert(tf.put_window == 4);
+	tf_cmd_put_cancel(&tf);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	/* A windowed put falls back to stop-and-wait when a packet isn't acknowledged.
+	 * The first SUCCESS is for FILE_START.
+	 */
+	tf_fault_clear(t);
+	add_rule(t, TF_FAULT_RECV, TF_MSG_SUCCESS, 6, 1, TF_FAULT_DROP, 0);
+	assert(tf_cmd_put(&tf, "/put.rec", sizeof(data), 0, 0) == 0);
+	for (i = 0; i < sizeof(data); i += 1000) {
+		assert(tf_cmd_put_data(&tf, i, data + i, 1000) == 0);
+	}
+	assert(tf_cmd_put_done(&tf) == 0);
+	assert(tf.put_window == 1);
+	snprintf(path, sizeof(path), "%s/put.rec", root);
+	fh = fopen(path, "r");
+	assert(fread(check, 1, sizeof(check), fh) == sizeof(data));
+	fclose(fh);
+	assert(memcmp(check, data, sizeof(data)) == 0);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/test.rec", root);
+
+	topfield_close(&tf);
+	unlink(path);
+	rmdir(root);
+
+	printf("test_fault: OK\n");
+
+	return 0;
+}
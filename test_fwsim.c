@@ -0,0 +1,131 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tf_fwio.h"
+#include "tf_fwsim.h"
+#include "tf_timing.h"
+
+#define IMAGE_SIZE (1024 * 1024 + 777)
+
+static __u8 image[IMAGE_SIZE];
+
+/**
+ * Uploads the image with tf_fw_upload()/tf_fw_upload_next() and
+ * checks that the emulator received it intact.
+ */
+static void upload(tf_transport *t, tf_fwsim_stats *stats)
+{
+	tf_handle tf;
+	tf_fw_data_t fw_data;
+	int ret;
+
+	assert(topfield_open_transport(&tf, t) == 0);
+
+	for (ret = tf_fw_upload(&tf, &fw_data); ret == 0; ret = tf_fw_upload_next(&tf, image + fw_data.offset, fw_data.len, &fw_data)) {
+		assert(fw_data.offset + fw_data.len <= IMAGE_SIZE);
+	}
+	assert(ret == 1);
+	assert(tf_fw_reboot(&tf) == 0);
+
+	tf_fwsim_get_stats(t, stats);
+	assert(stats->complete);
+	assert(stats->rebooted);
+	assert(stats->checksum_errors == 0);
+	assert(stats->seq_errors == 0);
+
+	assert(memcmp(tf_fwsim_image(t), image, IMAGE_SIZE) == 0);
+
+	topfield_close(&tf);
+}
+
+int main(void)
+{
+	tf_fwsim_options opts;
+	tf_fwsim_stats stats;
+	tf_timing timing;
+	tf_transport *t;
+	tf_handle tf;
+	tf_fw_data_t fw_data;
+	__u8 packet[64];
+	__u8 reply[64];
+	int i;
+
+	for (i = 0; i < IMAGE_SIZE; i++) {
+		image[i] = i * 13 + (i >> 9);
+	}
+
+	/* In order, in the largest blocks */
+	upload(tf_transport_fwsim(IMAGE_SIZE, 0), &stats);
+	printf("test_fwsim: sequential: %d packets in %d transfers\n", stats.packets, stats.transfers);
+	assert(stats.repeats == 0);
+
+	/* Out of order, with some blocks requested twice */
+	memset(&opts, 0, sizeof(opts));
+	opts.block = 0x5000;
+	opts.shuffle = 1;
+	opts.repeat = 7;
+	opts.seed = 1;
+	upload(tf_transport_fwsim(IMAGE_SIZE, &opts), &stats);
+	printf("test_fwsim: shuffled: %d packets in %d transfers, %d repeats\n", stats.packets, stats.transfers, stats.repeats);
+	assert(stats.repeats > 0);
+
+	/* A corrupt packet is requested again */
+	t = tf_transport_fwsim(IMAGE_SIZE, 0);
+	assert(topfield_open_transport(&tf, t) == 0);
+	assert(tf_fw_upload(&tf, &fw_data) == 0);
+	memcpy(packet, "ToFi", 4);
+	packet[4] = fw_data.seq;
+	packet[5] = TF_FW_DATA;
+	packet[6] = 0;
+	packet[7] = 4;
+	memcpy(packet + 8, image, 4);
+	packet[12] = 0x55;
+	assert(t->send(t, packet, 14, tf.timeout) == 14);
+	assert(t->recv(t, reply, sizeof(reply), 0, tf.timeout) >= 13);
+	assert(reply[5] == TF_FW_REQ_DATA);
+	assert((reply[10] << 16 | reply[11] << 8 | reply[12]) == fw_data.offset);
+	tf_fwsim_get_stats(t, &stats);
+	assert(stats.checksum_errors == 1);
+	topfield_close(&tf);
+
+	/* How long would a real upload take? */
+	tf_timing_defaults(&timing);
+	timing.idle = 0;
+	timing.realtime = 0;
+	t = tf_transport_timed(tf_transport_fwsim(IMAGE_SIZE, 0), &timing);
+	assert(topfield_open_transport(&tf, t) == 0);
+	for (i = tf_fw_upload(&tf, &fw_data); i == 0; i = tf_fw_upload_next(&tf, image + fw_data.offset, fw_data.len, &fw_data)) {
+	}
+	assert(i == 1);
+	printf("test_fwsim: modelled upload time %dms\n", (int)(tf_timed_clock(t) / 1000));
+	topfield_close(&tf);
+
+	printf("test_fwsim: OK\n");
+
+	return 0;
+}
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mjd.h"
+#include "tf_bytes.h"
+
+/* The conversions as they were before the offset cache, to compare against */
+
+static time_t ref_tfdt_to_time(const struct tf_datetime *dt)
+{
+	int mjd = get_u16(&dt->mjd);
+	int y, m, d, k;
+	struct tm tm;
+
+	if (mjd == 0xffff && dt->second == 0xff && dt->minute == 0xff && dt->hour == 0xff) {
+		return 0;
+	}
+
+	y = (int) ((mjd - 15078.2) / 365.25);
+	m = (int) ((mjd - 14956.1 - ((int) (y * 365.25))) / 30.6001);
+	d = mjd - 14956 - ((int) (y * 365.25)) - ((int) (m * 30.6001));
+	k = (m == 14) || (m == 15);
+	y += k;
+	m = m - 1 - k * 12;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_sec = dt->second;
+	tm.tm_min = dt->minute;
+	tm.tm_hour = dt->hour;
+	tm.tm_mday = d;
+	tm.tm_mon = m - 1;
+	tm.tm_year = y;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+static void ref_time_to_tfdt(time_t t, struct tf_datetime *dt)
+{
+	int y, m, d, k, mjd;
+	struct tm *tm = localtime(&t);
+
+	y = tm->tm_year;
+	m = tm->tm_mon + 1;
+	d = tm->tm_mday;
+	k = (m == 1) || (m == 2);
+
+	mjd = 14956 + d +
+		((int) ((y - k) * 365.25)) + ((int) ((m + 1 + k * 12) * 30.6001));
+	put_u16(&dt->mjd, mjd);
+	dt->hour = tm->tm_hour;
+	dt->minute = tm->tm_min;
+	dt->second = tm->tm_sec;
+}
+
+/* Times of day to try on every date, including the usual DST changes */
+static const int times[][3] = {
+	{ 0, 0, 0 }, { 0, 30, 0 }, { 1, 0, 0 }, { 1, 59, 59 }, { 2, 0, 0 }, { 2, 30, 15 },
+	{ 3, 0, 0 }, { 3, 30, 0 }, { 12, 0, 0 }, { 23, 59, 59 },
+};
+#define NUM_TIMES (sizeof(times) / sizeof(*times))
+
+static void set_dt(struct tf_datetime *dt, int mjd, int i)
+{
+	put_u16(&dt->mjd, mjd);
+	dt->hour = times[i][0];
+	dt->minute = times[i][1];
+	dt->second = times[i][2];
+}
+
+static void test_zone(const char *tz)
+{
+	struct tf_datetime dt;
+	struct tf_datetime ref;
+	time_t start;
+	time_t end;
+	time_t t;
+	int mjd;
+	int i;
+
+	setenv("TZ", tz, 1);
+	tfdt_reset();
+
+	for (mjd = 15079; mjd <= 65535; mjd++) {
+		for (i = 0; i < NUM_TIMES; i++) {
+			set_dt(&dt, mjd, i);
+			if (tfdt_to_time(&dt) != ref_tfdt_to_time(&dt)) {
+				printf("test_mjd: %s: mjd %d %02d:%02d:%02d gives %ld, expected %ld\n", tz, mjd,
+					dt.hour, dt.minute, dt.second, (long)tfdt_to_time(&dt), (long)ref_tfdt_to_time(&dt));
+				exit(1);
+			}
+		}
+	}
+
+	/* Every quarter hour plus a bit, over the whole range */
+	set_dt(&dt, 15079, 0);
+	start = ref_tfdt_to_time(&dt);
+	set_dt(&dt, 65535, NUM_TIMES - 1);
+	end = ref_tfdt_to_time(&dt);
+	for (t = start - 86400; t <= end + 86400; t += 907) {
+		time_to_tfdt(t, &dt);
+		ref_time_to_tfdt(t, &ref);
+		if (memcmp(&dt, &ref, sizeof(dt)) != 0) {
+			printf("test_mjd: %s: %ld gives mjd %d %02d:%02d:%02d, expected mjd %d %02d:%02d:%02d\n", tz, (long)t,
+				get_u16(&dt.mjd), dt.hour, dt.minute, dt.second,
+				get_u16(&ref.mjd), ref.hour, ref.minute, ref.second);
+			exit(1);
+		}
+	}
+
+	/* And every second either side of the transitions */
+	for (t = start; t <= end; t += 3600) {
+		struct tm before;
+		struct tm after;
+		time_t s = t;
+		time_t n = t + 3600;
+
+		localtime_r(&s, &before);
+		localtime_r(&n, &after);
+		if (before.tm_gmtoff != after.tm_gmtoff) {
+			for (s = t; s <= n; s++) {
+				time_to_tfdt(s, &dt);
+				ref_time_to_tfdt(s, &ref);
+				assert(memcmp(&dt, &ref, sizeof(dt)) == 0);
+				assert(tfdt_to_time(&dt) == ref_tfdt_to_time(&dt));
+			}
+		}
+	}
+	printf("test_mjd: %s OK\n", tz);
+}
+
+static void test_sentinel(void)
+{
+	struct tf_datetime dt;
+
+	memset(&dt, 0xff, sizeof(dt));
+	assert(tfdt_to_time(&dt) == 0);
+
+	/* Only all ones is special */
+	dt.second = 0;
+	assert(tfdt_to_time(&dt) == ref_tfdt_to_time(&dt));
+
+	printf("test_mjd: sentinel OK\n");
+}
+
+struct entry {
+	char name[3];
+	struct tf_datetime stamp;
+};
+
+struct result {
+	int other;
+	time_t stamp;
+};
+
+static void test_batch(void)
+{
+	struct entry in[1000];
+	struct result out[1000];
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		set_dt(&in[i].stamp, 15079 + rand() % (65536 - 15079), i % NUM_TIMES);
+		out[i].other = i;
+	}
+	memset(&in[10].stamp, 0xff, sizeof(in[10].stamp));
+
+	tfdt_to_time_batch(&in->stamp, sizeof(*in), &out->stamp, sizeof(*out), 1000);
+	for (i = 0; i < 1000; i++) {
+		assert(out[i].other == i);
+		assert(out[i].stamp == ref_tfdt_to_time(&in[i].stamp));
+	}
+	printf("test_mjd: batch OK\n");
+}
+
+#define THREADS 4
+#define THREAD_COUNT 20000
+
+static struct tf_datetime thread_dt[THREAD_COUNT];
+static time_t thread_expect[THREAD_COUNT];
+
+static void *thread_main(void *arg)
+{
+	long bad = 0;
+	int i;
+
+	for (i = 0; i < THREAD_COUNT; i++) {
+		struct tf_datetime dt;
+
+		if (tfdt_to_time(&thread_dt[i]) != thread_expect[i]) {
+			bad++;
+		}
+		time_to_tfdt(thread_expect[i], &dt);
+		if (tfdt_to_time(&dt) != thread_expect[i]) {
+			bad++;
+		}
+	}
+	return (void *)bad;
+}
+
+static void test_threads(void)
+{
+	pthread_t thread[THREADS];
+	int i;
+
+	setenv("TZ", "AEST-10AEDT,M10.1.0,M4.1.0/3", 1);
+	tfdt_reset();
+
+	for (i = 0; i < THREAD_COUNT; i++) {
+		/* Avoid the repeated hour, which can't round trip */
+		set_dt(&thread_dt[i], 15079 + rand() % (65536 - 15079), 8);
+		thread_expect[i] = ref_tfdt_to_time(&thread_dt[i]);
+	}
+	/* Start with nothing cached, so that the threads race to fill it */
+	tfdt_reset();
+
+	for (i = 0; i < THREADS; i++) {
+		assert(pthread_create(&thread[i], 0, thread_main, 0) == 0);
+	}
+	/* Forgetting while the threads are converting is safe */
+	for (i = 0; i < 20; i++) {
+		tfdt_reset();
+		usleep(100);
+	}
+	for (i = 0; i < THREADS; i++) {
+		void *bad;
+
+		assert(pthread_join(thread[i], &bad) == 0);
+		assert(bad == 0);
+	}
+	printf("test_mjd: threads OK\n");
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void test_speed(void)
+{
+	struct tf_datetime dt[1000];
+	time_t t[1000];
+	double start;
+	double fast;
+	double libc;
+	int n;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		set_dt(&dt[i], 50000 + rand() % 15000, 8);
+	}
+
+	start = now();
+	for (n = 0; n < 100; n++) {
+		tfdt_to_time_batch(dt, sizeof(*dt), t, sizeof(*t), 1000);
+	}
+	fast = now() - start;
+
+	start = now();
+	for (n = 0; n < 100; n++) {
+		for (i = 0; i < 1000; i++) {
+			t[i] = ref_tfdt_to_time(&dt[i]);
+		}
+	}
+	libc = now() - start;
+
+	printf("test_mjd: %.0f ns per conversion, was %.0f ns\n", fast * 1e4, libc * 1e4);
+}
+
+int main(void)
+{
+	test_sentinel();
+	test_zone("UTC0");
+	test_zone("AEST-10AEDT,M10.1.0,M4.1.0/3");
+	test_zone("GMT0BST,M3.5.0/1,M10.5.0");
+	test_zone("EST5EDT,M3.2.0,M11.1.0");
+	test_zone("NPT-5:45");
+	test_zone("Europe/London");
+	test_batch();
+	test_threads();
+	test_speed();
+
+	return 0;
+}
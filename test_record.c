@@ -0,0 +1,127 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "tf_record.h"
+#include "tf_sim.h"
+#include "tf_timing.h"
+
+#define FILE_SIZE 300000
+
+/**
+ * Runs a short session and returns a checksum of everything received.
+ */
+static unsigned session(tf_handle *tf)
+{
+	tf_size_result size;
+	tf_dir_entries entries;
+	tf_dirent dirent;
+	tf_buffer buf;
+	unsigned sum = 0;
+	int ret;
+	int i;
+
+	assert(tf_init(tf) == 0);
+	assert(tf_cmd_size(tf, &size) == 0);
+	sum += size.totalk;
+
+	assert(tf_cmd_dir_first(tf, "/", &entries) == 0);
+	assert(entries.count == 1);
+	assert(strcmp(entries.entry[0].name, "test.rec") == 0);
+	assert(tf_cmd_dir_next(tf, &entries) == TF_ERR_DONE);
+
+	assert(tf_cmd_get(tf, "/test.rec", 0, &dirent) == 0);
+	while ((ret = tf_cmd_get_next(tf, &buf)) == 0) {
+		for (i = 0; i < buf.size; i++) {
+			sum = sum * 31 + buf.data[i];
+		}
+	}
+	assert(ret == TF_ERR_DONE);
+
+	return sum;
+}
+
+int main(void)
+{
+	char root[64];
+	char path[128];
+	char recording[128];
+	tf_handle tf;
+	tf_timing timing;
+	tf_replay_stats stats;
+	tf_size_result size;
+	unsigned sum;
+	FILE *fh;
+	int i;
+
+	strcpy(root, "/tmp/test_recordXXXXXX");
+	assert(mkdtemp(root));
+	snprintf(path, sizeof(path), "%s/test.rec", root);
+	fh = fopen(path, "w");
+	for (i = 0; i < FILE_SIZE; i++) {
+		fputc(i * 3 + (i >> 10), fh);
+	}
+	fclose(fh);
+	snprintf(recording, sizeof(recording), "%s.tfrc", root);
+
+	/* Record a session with a simulated device which takes some time */
+	tf_timing_defaults(&timing);
+	timing.bandwidth = 30000000;
+	assert(topfield_open_transport(&tf, tf_transport_timed(tf_transport_sim(root), &timing)) == 0);
+	assert(tf_record_start(&tf, recording) == 0);
+	sum = session(&tf);
+	tf_record_stop(&tf);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	topfield_close(&tf);
+
+	unlink(path);
+	rmdir(root);
+
+	/* Replaying gives exactly the same results, with the device gone */
+	assert(topfield_open_transport(&tf, tf_transport_replay(recording, 0)) == 0);
+	assert(session(&tf) == sum);
+	tf_replay_get_stats(tf.transport, &stats);
+	printf("test_record: replayed %d events, device time %dms\n", stats.events, (int)(stats.device_time / 1000));
+	assert(stats.mismatches == 0);
+	assert(stats.device_time >= FILE_SIZE / 30);
+	topfield_close(&tf);
+
+	/* Different requests are noticed */
+	assert(topfield_open_transport(&tf, tf_transport_replay(recording, 0)) == 0);
+	assert(tf_init(&tf) == 0);
+	assert(tf_cmd_mkdir(&tf, "/DataFiles") == TF_ERR_UNEXPECTED);
+	tf_replay_get_stats(tf.transport, &stats);
+	assert(stats.mismatches == 1);
+	topfield_close(&tf);
+
+	unlink(recording);
+
+	printf("test_record: OK\n");
+
+	return 0;
+}
@@ -0,0 +1,503 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "tf_util.h"
+#include "tf_sim.h"
+#include "tf_cache.h"
+
+#define FILE_SIZE (3 * MAX_PUT_SIZE + 1234)
+
+static char root[64];
+
+static void check_local_size(const char *name, off_t size)
+{
+	char path[256];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	assert(stat(path, &st) == 0);
+	assert(st.st_size == size);
+}
+
+static void test_put(tf_handle *tf, const char *path, const __u8 *data, size_t size, time_t stamp)
+{
+	size_t offset;
+
+	assert(tf_cmd_put(tf, path, size, stamp, 0) == 0);
+	for (offset = 0; offset < size; offset += MAX_PUT_SIZE) {
+		size_t len = size - offset < MAX_PUT_SIZE ? size - offset : MAX_PUT_SIZE;
+
+		assert(tf_cmd_put_data(tf, offset, (void *)(data + offset), len) == 0);
+	}
+	assert(tf_cmd_put_done(tf) == 0);
+}
+
+static void test_get(tf_handle *tf, const char *path, const __u8 *data, size_t size, time_t stamp)
+{
+	tf_dirent dirent;
+	tf_buffer buf;
+	size_t total = 0;
+	int ret;
+
+	assert(tf_cmd_get(tf, path, 0, &dirent) == 0);
+	assert(dirent.size == size);
+	assert(dirent.stamp == stamp);
+
+	while ((ret = tf_cmd_get_next(tf, &buf)) == 0) {
+		assert(buf.offset == total);
+		assert(buf.offset + buf.size <= size);
+		assert(memcmp(buf.data, data + buf.offset, buf.size) == 0);
+		total += buf.size;
+	}
+	assert(ret == TF_ERR_DONE);
+	assert(total == size);
+}
+
+static int count_entries(tf_handle *tf, const char *path)
+{
+	tf_dir_entries entries;
+	int count = 0;
+	int ret;
+
+	for (ret = tf_cmd_dir_first(tf, path, &entries); ret == 0; ret = tf_cmd_dir_next(tf, &entries)) {
+		count += entries.count;
+	}
+	assert(ret == TF_ERR_DONE);
+
+	return count;
+}
+
+/**
+ * Checks that a view decodes the same as tf_dir_read() for the single
+ * entry in 'path'.
+ */
+static void test_view(tf_handle *tf, const char *path, const char *name, __u64 size, time_t stamp)
+{
+	tf_dir_iter it;
+	const tf_dirent_view *view;
+	tf_dirent dirent;
+
+	assert(tf_dir_open(tf, path, &it) == 0);
+	assert(tf_dir_read_view(&it, &view) == 0);
+	assert(strcmp(tf_dirent_view_name(view), name) == 0);
+	assert(tf_dirent_view_type(view) == 'f');
+	assert(tf_dirent_view_size(view) == size);
+	assert(tf_dirent_view_stamp(view) == stamp);
+	tf_dirent_view_unpack(view, &dirent);
+	assert(strcmp(dirent.name, name) == 0);
+	assert(dirent.size == size && dirent.stamp == stamp && dirent.type == 'f');
+	assert(dirent.attrib == tf_dirent_view_attrib(view));
+	assert(tf_dir_read_view(&it, &view) == TF_ERR_DONE);
+	assert(tf_dir_close(&it) == 0);
+}
+
+/**
+ * Checks that tf_sort_listing() sorts a batch of entries into the
+ * same order as tf_sort_dirents().
+ */
+static void test_sort_listing(void)
+{
+	static const int sort_types[] = {
+		TF_SORT_NAME, TF_SORT_SIZE, TF_SORT_TIME, -TF_SORT_NAME, -TF_SORT_SIZE, -TF_SORT_TIME
+	};
+	static tf_dir_entries entries;
+	tf_dir_listing listing;
+	int t;
+	int i;
+
+	listing.entry = malloc(MAX_DIR_ENTRIES * sizeof(*listing.entry));
+	listing.size = MAX_DIR_ENTRIES;
+
+	for (t = 0; t < sizeof(sort_types) / sizeof(*sort_types); t++) {
+		entries.count = MAX_DIR_ENTRIES;
+		for (i = 0; i < MAX_DIR_ENTRIES; i++) {
+			tf_dirent *dirent = &entries.entry[i];
+			int n = i * 337 % MAX_DIR_ENTRIES;
+
+			/* Mixed case, shared prefixes longer than 8 and some short names */
+			snprintf(dirent->name, sizeof(dirent->name), n % 3 ? "%s%d" : "%sFiles%d",
+				n % 2 ? "Recording" : "recordinG", n);
+			if (n % 50 == 0) {
+				snprintf(dirent->name, sizeof(dirent->name), "%c", 'A' + n / 50);
+			}
+			dirent->type = n % 7 ? 'f' : 'd';
+			dirent->size = (__u64)(n % 41) << 32;
+			dirent->stamp = 1136073600 + n % 53 * 60;
+			dirent->attrib = 0;
+		}
+		memcpy(listing.entry, entries.entry, sizeof(entries.entry));
+		listing.count = MAX_DIR_ENTRIES;
+
+		tf_sort_dirents(&entries, sort_types[t]);
+		assert(tf_sort_listing(&listing, sort_types[t]) == 0);
+
+		for (i = 0; i < MAX_DIR_ENTRIES; i++) {
+			const tf_dirent *de1 = &entries.entry[i];
+			const tf_dirent *de2 = &listing.entry[i];
+
+			assert(de1->type == de2->type);
+			switch (abs(sort_types[t])) {
+				case TF_SORT_NAME:
+					assert(strcasecmp(de1->name, de2->name) == 0);
+					break;
+				case TF_SORT_SIZE:
+					assert(de1->size == de2->size);
+					break;
+				case TF_SORT_TIME:
+					assert(de1->stamp == de2->stamp);
+					break;
+			}
+		}
+	}
+	tf_dir_listing_free(&listing);
+
+	printf("test_sim: sorted listings\n");
+}
+
+#define BIG_DIR_FILES 1000
+
+static int count_callback(const tf_dirent *dirent, void *arg)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+static int stop_callback(const tf_dirent *dirent, void *arg)
+{
+	static int seen;
+
+	if (++seen == *(int *)arg) {
+		seen = 0;
+		return 42;
+	}
+	return 0;
+}
+
+#define STAT_MANY 310
+
+/**
+ * Looks up many paths in /Big and elsewhere at once, and checks that
+ * the answers are the same as from tf_stat(), with and without the cache.
+ */
+static void test_stat_many(tf_handle *tf)
+{
+	static char names[STAT_MANY][32];
+	const char *paths[STAT_MANY];
+	tf_dirent dirents[STAT_MANY];
+	int results[STAT_MANY];
+	tf_size_result size;
+	tf_cache_stats before;
+	tf_cache_stats after;
+	tf_dirent dirent;
+	int cached;
+	int i;
+
+	for (i = 0; i < STAT_MANY - 10; i++) {
+		/* Spread over every batch, with some missing */
+		snprintf(names[i], sizeof(names[i]), "/Big/file%04d.rec", i * 7 % 1100);
+		paths[i] = names[i];
+	}
+	paths[i++] = "/Big/file0005.rec";
+	paths[i++] = "/Big/file0005.rec";
+	paths[i++] = "/";
+	paths[i++] = "/Big";
+	paths[i++] = "Big";
+	paths[i++] = "/DataFiles/test.rec";
+	paths[i++] = "/DataFiles/missing.rec";
+	paths[i++] = "/Missing/file.rec";
+	paths[i++] = "/Big/";
+	paths[i++] = "/Big/file0999.rec";
+
+	for (cached = 0; cached <= 1; cached++) {
+		if (cached) {
+			assert(tf_cache_enable(tf, 0) == 0);
+		}
+		assert(tf_stat_many(tf, paths, STAT_MANY, dirents, results) == 0);
+		for (i = 0; i < STAT_MANY; i++) {
+			int rc = tf_stat(tf, paths[i], &dirent);
+
+			assert(results[i] == rc || (results[i] < 0 && rc == 1));
+			if (rc == 0) {
+				assert(strcmp(dirents[i].name, dirent.name) == 0);
+				assert(dirents[i].size == dirent.size && dirents[i].type == dirent.type);
+			}
+		}
+		assert(results[0] == 0 && strcmp(dirents[0].name, "file0000.rec") == 0);
+		assert(results[STAT_MANY - 10] == 0 && results[STAT_MANY - 9] == 0);
+		assert(results[STAT_MANY - 3] != 0);
+	}
+
+	/* Everything was listed once, so the second time is all hits,
+	 * except for /Missing, which could not be listed
+	 */
+	tf_cache_flush(tf);
+	assert(tf_stat_many(tf, paths, STAT_MANY, dirents, results) == 0);
+	tf_cache_get_stats(tf, &before);
+	assert(tf_stat_many(tf, paths, STAT_MANY, dirents, results) == 0);
+	tf_cache_get_stats(tf, &after);
+	assert(after.misses == before.misses + 1 && after.hits > before.hits);
+	tf_cache_disable(tf);
+
+	/* Nothing to look up */
+	assert(tf_stat_many(tf, paths, 0, dirents, results) == 0);
+
+	/* Stopping early when everything has been found */
+	assert(tf_stat_many(tf, paths, 2, dirents, results) == 0);
+	assert(results[0] == 0 && results[1] == 0);
+	assert(tf_cmd_size(tf, &size) == 0);
+
+	printf("test_sim: stat %d paths at once\n", STAT_MANY);
+}
+
+/**
+ * Lists a directory which needs more than one DIRENT batch,
+ * with and without asking for the next batch early,
+ * and cancels listings part way through and at the very end.
+ * Then reads it an entry at a time, stopping early in each batch.
+ */
+static void test_big_dir(tf_handle *tf)
+{
+	tf_dir_entries entries;
+	tf_size_result size;
+	tf_dir_iter it;
+	tf_dirent dirent;
+	const tf_dirent_view *view;
+	tf_dir_listing listing;
+	char path[128];
+	int pipeline;
+	int stop;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/Big", root);
+	assert(mkdir(path, 0777) == 0);
+	for (i = 0; i < BIG_DIR_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/Big/file%04d.rec", root, i);
+		close(creat(path, 0666));
+	}
+
+	for (pipeline = 0; pipeline <= 1; pipeline++) {
+		tf->dir_pipeline = pipeline;
+		assert(count_entries(tf, "/Big") == BIG_DIR_FILES);
+
+		/* Stop after the first batch */
+		assert(tf_cmd_dir_first(tf, "/Big", &entries) == 0);
+		assert(entries.count == TF_SIM_DIR_BATCH);
+		assert(tf_cmd_dir_cancel(tf) == 0);
+		assert(tf_cmd_size(tf, &size) == 0);
+
+		/* Stop after the last batch, before seeing the end */
+		assert(tf_cmd_dir_first(tf, "/Big", &entries) == 0);
+		assert(tf_cmd_dir_next(tf, &entries) == 0);
+		assert(entries.count == BIG_DIR_FILES - TF_SIM_DIR_BATCH);
+		assert(tf_cmd_dir_cancel(tf) == 0);
+		assert(tf_cmd_size(tf, &size) == 0);
+	}
+	tf->dir_pipeline = TF_DEFAULT_DIR_PIPELINE;
+
+	/* One entry at a time */
+	assert(tf_dir_open(tf, "/Big", &it) == 0);
+	for (i = 0; tf_dir_read(&it, &dirent) == 0; i++) {
+		assert(strncmp(dirent.name, "file", 4) == 0 && dirent.type == 'f');
+	}
+	assert(i == BIG_DIR_FILES);
+	assert(tf_dir_close(&it) == 0);
+	assert(tf_dir_foreach(tf, "/Big", count_callback, &i) == 0);
+	assert(i == 2 * BIG_DIR_FILES);
+
+	/* And as views, decoding only the name */
+	assert(tf_dir_open(tf, "/Big", &it) == 0);
+	for (i = 0; tf_dir_read_view(&it, &view) == 0; i++) {
+		assert(strncmp(tf_dirent_view_name(view), "file", 4) == 0);
+	}
+	assert(tf_dir_close(&it) == 0);
+	assert(i == BIG_DIR_FILES);
+
+	/* Stop early from the callback, in each batch */
+	for (stop = 10; stop < BIG_DIR_FILES; stop += TF_SIM_DIR_BATCH) {
+		assert(tf_dir_foreach(tf, "/Big", stop_callback, &stop) == 42);
+		assert(tf_cmd_size(tf, &size) == 0);
+	}
+	assert(tf_stat(tf, "/Big/file0999.rec", &dirent) == 0);
+	assert(tf_stat(tf, "/Big/file1000.rec", &dirent) == 1);
+	assert(tf_cmd_size(tf, &size) == 0);
+
+	test_stat_many(tf);
+
+	/* The whole directory, sorted across batches */
+	assert(tf_dir_list(tf, "/Big", &listing, TF_SORT_NAME) == 0);
+	assert(listing.count == BIG_DIR_FILES);
+	for (i = 0; i < BIG_DIR_FILES; i++) {
+		snprintf(path, sizeof(path), "file%04d.rec", i);
+		assert(strcmp(listing.entry[i].name, path) == 0);
+	}
+	assert(tf_sort_listing(&listing, -TF_SORT_NAME) == 0);
+	assert(strcmp(listing.entry[0].name, "file0999.rec") == 0);
+	tf_dir_listing_free(&listing);
+	assert(tf_dir_list(tf, "/Missing", &listing, TF_SORT_NAME) < 0);
+	tf_dir_listing_free(&listing);
+	assert(tf_cmd_size(tf, &size) == 0);
+
+	for (i = 0; i < BIG_DIR_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/Big/file%04d.rec", root, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/Big", root);
+	rmdir(path);
+
+	printf("test_sim: listed and cancelled %d entries\n", BIG_DIR_FILES);
+}
+
+/**
+ * Tests the simulated device with the normal tf_cmd_... functions.
+ */
+int main(void)
+{
+	tf_handle tf;
+	tf_size_result size;
+	tf_dirent dirent;
+	tf_buffer buf;
+	time_t stamp = 1136073600;	/* 2006-01-01 00:00:00 UTC */
+	__u8 *data;
+	int i;
+
+	strcpy(root, "/tmp/test_simXXXXXX");
+	assert(mkdtemp(root));
+
+	data = malloc(FILE_SIZE);
+	for (i = 0; i < FILE_SIZE; i++) {
+		data[i] = i * 7 + (i >> 8);
+	}
+
+	assert(topfield_open_transport(&tf, tf_transport_sim(root)) == 0);
+	assert(tf_init(&tf) == 0);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	assert(size.totalk > 0);
+	printf("test_sim: size total=%uK free=%uK\n", size.totalk, size.freek);
+
+	assert(tf_cmd_mkdir(&tf, "/DataFiles") == 0);
+	assert(tf_cmd_mkdir(&tf, "/DataFiles") != 0);
+
+	test_put(&tf, "/DataFiles/test.rec", data, FILE_SIZE, stamp);
+	check_local_size("DataFiles/test.rec", FILE_SIZE);
+	printf("test_sim: put %d bytes\n", FILE_SIZE);
+
+	test_get(&tf, "/DataFiles/test.rec", data, FILE_SIZE, stamp);
+	printf("test_sim: got %d bytes\n", FILE_SIZE);
+
+	assert(count_entries(&tf, "/") == 1);
+	assert(count_entries(&tf, "/DataFiles") == 1);
+	test_view(&tf, "/DataFiles", "test.rec", FILE_SIZE, stamp);
+
+	assert(tf_stat(&tf, "/DataFiles/test.rec", &dirent) == 0);
+	assert(dirent.type == 'f');
+	assert(dirent.size == FILE_SIZE);
+	assert(tf_stat(&tf, "/DataFiles/missing.rec", &dirent) == 1);
+
+	/* The same from FILE_START, falling back to a listing for directories */
+	tf.fast_stat = 1;
+	assert(tf_stat_probe(&tf, "/DataFiles/test.rec", &dirent) == 0);
+	assert(strcmp(dirent.name, "test.rec") == 0 && dirent.type == 'f');
+	assert(dirent.size == FILE_SIZE && dirent.stamp == stamp);
+	assert(tf_stat_probe(&tf, "/DataFiles", &dirent) == 1);
+	assert(tf_stat_probe(&tf, "/DataFiles/missing.rec", &dirent) == 1);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	assert(tf_stat(&tf, "/DataFiles/test.rec", &dirent) == 0);
+	assert(dirent.size == FILE_SIZE && dirent.stamp == stamp);
+	assert(tf_stat(&tf, "/DataFiles", &dirent) == 0 && dirent.type == 'd');
+	assert(tf_stat(&tf, "/", &dirent) == 0 && dirent.type == 'd');
+	assert(tf_stat(&tf, "/DataFiles/missing.rec", &dirent) == 1);
+	tf.fast_stat = TF_DEFAULT_FAST_STAT;
+
+	assert(tf_cmd_rename(&tf, "/DataFiles/test.rec", "/DataFiles/new.rec") == 0);
+	check_local_size("DataFiles/new.rec", FILE_SIZE);
+	assert(tf_cmd_get(&tf, "/DataFiles/test.rec", 0, &dirent) != 0);
+
+	/* A windowed put */
+	tf.put_window = 4;
+	test_put(&tf, "/DataFiles/window.rec", data, FILE_SIZE, stamp);
+	assert(tf.put_window == 4);
+	test_get(&tf, "/DataFiles/window.rec", data, FILE_SIZE, stamp);
+	assert(tf_cmd_delete(&tf, "/DataFiles/window.rec") == 0);
+	tf.put_window = 1;
+
+	/* A put built directly in the library's buffers */
+	for (i = 1; i <= 4; i *= 4) {
+		size_t offset;
+
+		tf.put_window = i;
+		assert(tf_cmd_put(&tf, "/DataFiles/commit.rec", FILE_SIZE, stamp, 0) == 0);
+		for (offset = 0; offset < FILE_SIZE; offset += MAX_PUT_SIZE) {
+			size_t len = FILE_SIZE - offset < MAX_PUT_SIZE ? FILE_SIZE - offset : MAX_PUT_SIZE;
+			size_t size;
+			void *buffer = tf_cmd_put_buffer(&tf, &size);
+
+			assert(buffer && size == MAX_PUT_SIZE);
+			memcpy(buffer, data + offset, len);
+			assert(tf_cmd_put_commit(&tf, offset, len) == 0);
+		}
+		assert(tf_cmd_put_done(&tf) == 0);
+		test_get(&tf, "/DataFiles/commit.rec", data, FILE_SIZE, stamp);
+		assert(tf_cmd_delete(&tf, "/DataFiles/commit.rec") == 0);
+	}
+	tf.put_window = 1;
+
+	/* Cancel a get part way through, and make sure everything still works */
+	assert(tf_cmd_get(&tf, "/DataFiles/new.rec", 0, &dirent) == 0);
+	assert(tf_cmd_get_next(&tf, &buf) == 0);
+	assert(tf_cmd_get_cancel(&tf) == 0);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	printf("test_sim: cancelled get\n");
+
+	/* Resume from an offset */
+	assert(tf_cmd_get(&tf, "/DataFiles/new.rec", FILE_SIZE - 10, &dirent) == 0);
+	assert(tf_cmd_get_next(&tf, &buf) == 0);
+	assert(buf.offset == FILE_SIZE - 10 && buf.size == 10);
+	assert(memcmp(buf.data, data + FILE_SIZE - 10, 10) == 0);
+	assert(tf_cmd_get_next(&tf, &buf) == TF_ERR_DONE);
+
+	test_sort_listing();
+	test_big_dir(&tf);
+
+	/* Paths may not escape the root */
+	assert(tf_cmd_get(&tf, "/../etc/passwd", 0, &dirent) != 0);
+
+	assert(tf_cmd_delete(&tf, "/DataFiles/new.rec") == 0);
+	assert(tf_cmd_delete(&tf, "/DataFiles") == 0);
+	assert(count_entries(&tf, "/") == 0);
+
+	topfield_close(&tf);
+	rmdir(root);
+	free(data);
+
+	printf("test_sim: OK\n");
+
+	return 0;
+}
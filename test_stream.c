@@ -0,0 +1,114 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "tf_stream.h"
+#include "tf_sim.h"
+
+#define FILE_SIZE 1000000
+
+static __u8 data[FILE_SIZE];
+
+/**
+ * Tests streaming gets from the simulator.
+ */
+int main(void)
+{
+	char root[64];
+	char path[128];
+	tf_handle tf;
+	tf_stream *s;
+	tf_dirent dirent;
+	tf_buffer buf;
+	tf_buffer held[3];
+	tf_size_result size;
+	size_t total = 0;
+	FILE *fh;
+	int ret;
+	int i;
+
+	strcpy(root, "/tmp/test_streamXXXXXX");
+	assert(mkdtemp(root));
+	snprintf(path, sizeof(path), "%s/test.rec", root);
+	fh = fopen(path, "w");
+	for (i = 0; i < FILE_SIZE; i++) {
+		data[i] = i * 5 + (i >> 12);
+	}
+	fwrite(data, FILE_SIZE, 1, fh);
+	fclose(fh);
+
+	assert(topfield_open_transport(&tf, tf_transport_sim(root)) == 0);
+	assert(tf_init(&tf) == 0);
+
+	/* The whole file, holding up to three buffers at a time */
+	s = tf_stream_get(&tf, "/test.rec", 0, 4, &dirent);
+	assert(s);
+	assert(dirent.size == FILE_SIZE);
+	i = 0;
+	while ((ret = tf_stream_next(s, &held[i])) == 0) {
+		assert(held[i].offset == total);
+		assert(memcmp(held[i].data, data + held[i].offset, held[i].size) == 0);
+		total += held[i].size;
+		if (++i == 3) {
+			/* The held buffers must not have changed */
+			for (i = 0; i < 3; i++) {
+				assert(memcmp(held[i].data, data + held[i].offset, held[i].size) == 0);
+				tf_stream_release(s);
+			}
+			i = 0;
+		}
+	}
+	assert(ret == TF_ERR_DONE);
+	assert(total == FILE_SIZE);
+	assert(tf_stream_next(s, &buf) == TF_ERR_DONE);
+	assert(tf_stream_close(s) == 0);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	printf("test_stream: streamed %d bytes\n", (int)total);
+
+	/* Stop part way through */
+	s = tf_stream_get(&tf, "/test.rec", 0, 2, &dirent);
+	assert(s);
+	assert(tf_stream_next(s, &buf) == 0);
+	tf_stream_release(s);
+	assert(tf_stream_next(s, &buf) == 0);
+	assert(tf_stream_close(s) == 0);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	printf("test_stream: stopped part way\n");
+
+	/* A missing file */
+	assert(tf_stream_get(&tf, "/missing.rec", 0, 0, &dirent) == 0);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	topfield_close(&tf);
+	unlink(path);
+	rmdir(root);
+
+	printf("test_stream: OK\n");
+
+	return 0;
+}
@@ -29,7 +29,72 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
 
+#include "tf_bytes.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks one byte_swap() implementation against a simple pairwise swap,
+ * for every length and alignment, including odd lengths.
+ */
+static void test_impl(const char *impl)
+{
+	__u8 buf[600];
+	__u8 ref[600];
+	int len;
+	int off;
+	int i;
+
+	assert(byte_swap_use(impl) == 0);
+
+	for (off = 0; off < 4; off++) {
+		for (len = 0; len < sizeof(buf) - off; len++) {
+			for (i = 0; i < sizeof(buf); i++) {
+				buf[i] = ref[i] = i * 13 + len;
+			}
+			for (i = 0; i + 1 < len; i += 2) {
+				ref[off + i] = buf[off + i + 1];
+				ref[off + i + 1] = buf[off + i];
+			}
+			byte_swap(buf + off, len);
+			assert(memcmp(buf, ref, sizeof(buf)) == 0);
+		}
+	}
+	printf("test_swab: byte_swap (%s) OK\n", impl);
+}
+
+/**
+ * Reports the throughput of swapping a whole packet in place.
+ */
+static void bench(const char *name, void (*swap)(void *, size_t))
+{
+	static __u8 packet[0x10000];
+	double start = now();
+	int loops = 5000;
+	int i;
+
+	for (i = 0; i < loops; i++) {
+		swap(packet, sizeof(packet));
+	}
+	printf("test_swab: %-8s %8.0f MB/s\n", name, sizeof(packet) * (double)loops / (now() - start) / 1e6);
+}
+
+static void libc_swab(void *packet, size_t count)
+{
+	/* swab() may not be given overlapping buffers */
+	static __u8 out[0x10000];
+
+	swab(packet, out, count);
+}
 
 /**
  * Tests the swab function.
@@ -37,11 +102,15 @@
  * The man page for swab() doesn't specify whether
  * it can swap a buffer in place, so test that here
  * Also test that swapping an odd length leaves the last byte unchanged
+ *
+ * Then tests each byte_swap() implementation, and compares their speed.
  */
 int main(void)
 {
 	char buf[] = "01234567";
 	char buf2[] = "0123456";
+	const char *impl;
+	int i;
 
 	swab(buf, buf, strlen(buf));
 
@@ -55,5 +124,18 @@ int main(void)
 
 	assert(strcmp(buf2, "1032546") == 0);
 
+	for (i = 0; (impl = byte_swap_impl(i)) != NULL; i++) {
+		test_impl(impl);
+	}
+	assert(i > 0);
+	assert(byte_swap_use("nonexistent") != 0);
+
+	bench("swab()", libc_swab);
+	for (i = 0; (impl = byte_swap_impl(i)) != NULL; i++) {
+		byte_swap_use(impl);
+		bench(impl, byte_swap);
+	}
+	byte_swap_use(NULL);
+
 	return 0;
 }
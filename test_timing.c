@@ -0,0 +1,172 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "tf_io.h"
+#include "tf_sim.h"
+#include "tf_timing.h"
+
+#define FILE_SIZE 1000000
+
+static char root[64];
+
+static void make_file(const char *name, size_t size)
+{
+	char path[256];
+	FILE *fh;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fh = fopen(path, "w");
+	assert(fh);
+	while (size--) {
+		fputc(size & 0xFF, fh);
+	}
+	fclose(fh);
+}
+
+/**
+ * Gets the file and returns the time taken in ms
+ */
+static int timed_get(tf_handle *tf, const char *path)
+{
+	__u64 start = tf_timed_clock(tf->transport);
+	tf_dirent dirent;
+	tf_buffer buf;
+	int ret;
+
+	assert(tf_cmd_get(tf, path, 0, &dirent) == 0);
+	while ((ret = tf_cmd_get_next(tf, &buf)) == 0) {
+	}
+	assert(ret == TF_ERR_DONE);
+
+	return (tf_timed_clock(tf->transport) - start) / 1000;
+}
+
+/**
+ * Puts a file with the given window and returns the time taken in ms
+ */
+static int timed_put(tf_handle *tf, int window)
+{
+	static __u8 data[MAX_PUT_SIZE];
+	__u64 start = tf_timed_clock(tf->transport);
+	int i;
+
+	tf->put_window = window;
+	assert(tf_cmd_put(tf, "/put.rec", sizeof(data) * 16, 0, 0) == 0);
+	for (i = 0; i < 16; i++) {
+		assert(tf_cmd_put_data(tf, i * sizeof(data), data, sizeof(data)) == 0);
+	}
+	assert(tf_cmd_put_done(tf) == 0);
+	assert(tf->put_window == window);
+	assert(tf_cmd_delete(tf, "/put.rec") == 0);
+
+	return (tf_timed_clock(tf->transport) - start) / 1000;
+}
+
+/**
+ * Tests the timing model with the model clock, so it runs quickly.
+ */
+int main(void)
+{
+	tf_handle tf;
+	tf_timing timing;
+	tf_size_result size;
+	char path[256];
+	__u64 start;
+	int slow, fast;
+	int i;
+
+	strcpy(root, "/tmp/test_timingXXXXXX");
+	assert(mkdtemp(root));
+	make_file("test.rec", FILE_SIZE);
+
+	tf_timing_defaults(&timing);
+	timing.bandwidth = 1000000;
+	timing.turbo_bandwidth = 4000000;
+	timing.turnaround = 1000;
+	timing.write_bandwidth = 1000000;
+	timing.spinup = 5000;
+	timing.idle = 100;
+	timing.realtime = 0;
+
+	assert(topfield_open_transport(&tf, tf_transport_timed(tf_transport_sim(root), &timing)) == 0);
+	assert(tf_init(&tf) == 0);
+
+	/* Bandwidth */
+	slow = timed_get(&tf, "/test.rec");
+	printf("test_timing: get with turbo off took %dms\n", slow);
+	assert(slow >= 1000 && slow < 1200);
+
+	assert(tf_cmd_turbo(&tf, 1) == 0);
+	fast = timed_get(&tf, "/test.rec");
+	printf("test_timing: get with turbo on took %dms\n", fast);
+	assert(fast >= 250 && fast < 350);
+	assert(tf_cmd_turbo(&tf, 0) == 0);
+
+	/* Spin-up: leave the disk idle, then use it */
+	for (i = 0; i < 200; i++) {
+		assert(tf_cmd_ready(&tf) == 0);
+	}
+	start = tf_timed_clock(tf.transport);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	printf("test_timing: size after idle took %dms\n", (int)((tf_timed_clock(tf.transport) - start) / 1000));
+	assert(tf_timed_clock(tf.transport) - start >= 5000000);
+
+	start = tf_timed_clock(tf.transport);
+	assert(tf_cmd_size(&tf, &size) == 0);
+	assert(tf_timed_clock(tf.transport) - start < 10000);
+
+	/* Keeping several packets outstanding lets the device write one packet
+	 * while the next is crossing the link
+	 */
+	slow = timed_put(&tf, 1);
+	fast = timed_put(&tf, 4);
+	printf("test_timing: put took %dms stop-and-wait, %dms with a window of 4\n", slow, fast);
+	assert(fast < slow * 3 / 4);
+
+	/* A spin-up longer than the timeout */
+	topfield_close(&tf);
+	timing.spinup = 15000;
+	assert(topfield_open_transport(&tf, tf_transport_timed(tf_transport_sim(root), &timing)) == 0);
+	for (i = 0; i < 200; i++) {
+		assert(tf_cmd_ready(&tf) == 0);
+	}
+	start = tf_timed_clock(tf.transport);
+	assert(tf_cmd_size(&tf, &size) == TF_ERR_IO);
+	assert(tf_timed_clock(tf.transport) - start >= tf.timeout * 1000);
+	printf("test_timing: size timed out after %dms\n", (int)((tf_timed_clock(tf.transport) - start) / 1000));
+
+	topfield_close(&tf);
+	snprintf(path, sizeof(path), "%s/test.rec", root);
+	unlink(path);
+	rmdir(root);
+
+	printf("test_timing: OK\n");
+
+	return 0;
+}
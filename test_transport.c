@@ -0,0 +1,231 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "tf_open.h"
+#include "tf_io.h"
+#include "tf_sim.h"
+
+#define FILE_SIZE 200000
+
+static char root[64];
+static __u8 *data;
+
+/* The far end of a socketpair, where the simulator plays the device */
+typedef struct {
+	int fd;
+	tf_transport *sim;
+	pthread_t thread;
+	__u8 buf[0x10000];
+} sim_server;
+
+/**
+ * Passes each request to the simulator and sends back its replies,
+ * until the other end is closed.
+ */
+static void *serve(void *arg)
+{
+	sim_server *server = arg;
+	ssize_t len;
+
+	while ((len = read(server->fd, server->buf, sizeof(server->buf))) > 0) {
+		server->sim->send(server->sim, server->buf, len, 0);
+		while ((len = server->sim->recv(server->sim, server->buf, sizeof(server->buf), 0, 0)) > 0) {
+			assert(write(server->fd, server->buf, len) == len);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Starts a simulator serving one end of a SOCK_SEQPACKET socketpair,
+ * and opens 'tf' on the other end.
+ */
+static void open_served(tf_handle *tf, sim_server *server)
+{
+	int fds[2];
+
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+	server->fd = fds[1];
+	server->sim = tf_transport_sim(root);
+	assert(server->sim);
+	assert(pthread_create(&server->thread, 0, serve, server) == 0);
+
+	assert(topfield_open_transport(tf, tf_transport_fd(fds[0])) == 0);
+	assert(tf_init(tf) == 0);
+}
+
+static void close_served(tf_handle *tf, sim_server *server)
+{
+	/* Closes our end, so the server sees EOF */
+	topfield_close(tf);
+	assert(pthread_join(server->thread, 0) == 0);
+	close(server->fd);
+	server->sim->close(server->sim);
+}
+
+/**
+ * Checks the next buffer of a get of the test file.
+ */
+static void check_buffer(const tf_buffer *buf, size_t *total)
+{
+	assert(buf->offset == *total);
+	assert(buf->offset + buf->size <= FILE_SIZE);
+	assert(memcmp(buf->data, data + buf->offset, buf->size) == 0);
+	*total += buf->size;
+}
+
+static void test_get(void)
+{
+	sim_server server;
+	tf_handle tf;
+	tf_size_result size;
+	tf_dirent dirent;
+	tf_buffer buf;
+	size_t total = 0;
+	int ret;
+
+	open_served(&tf, &server);
+	assert(tf_cmd_size(&tf, &size) == 0);
+
+	assert(tf_cmd_get(&tf, "/test.rec", 0, &dirent) == 0);
+	assert(dirent.size == FILE_SIZE);
+	while ((ret = tf_cmd_get_next(&tf, &buf)) == 0) {
+		check_buffer(&buf, &total);
+	}
+	assert(ret == TF_ERR_DONE);
+	assert(total == FILE_SIZE);
+
+	close_served(&tf, &server);
+}
+
+/**
+ * Runs gets on two handles at once from a single poll() loop.
+ */
+static void test_poll(void)
+{
+	sim_server server[2];
+	tf_handle tf[2];
+	size_t total[2] = { 0, 0 };
+	int done[2] = { 0, 0 };
+	int again = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		tf_dirent dirent;
+
+		open_served(&tf[i], &server[i]);
+		assert(tf_pollfds(&tf[i], 0, 0) == 1);
+		assert(tf_cmd_get(&tf[i], "/test.rec", 0, &dirent) == 0);
+		assert(dirent.size == FILE_SIZE);
+		tf[i].nonblock = 1;
+	}
+
+	while (!done[0] || !done[1]) {
+		struct pollfd fds[2];
+		int progress = 0;
+		int n = 0;
+
+		/* Nothing arrives until it is asked for, so try each first */
+		for (i = 0; i < 2; i++) {
+			tf_buffer buf;
+			int ret;
+
+			if (done[i]) {
+				continue;
+			}
+			ret = tf_cmd_get_next(&tf[i], &buf);
+			if (ret == TF_ERR_AGAIN) {
+				again++;
+				n += tf_pollfds(&tf[i], &fds[n], 1);
+				continue;
+			}
+			if (ret == TF_ERR_DONE) {
+				done[i] = 1;
+			}
+			else {
+				assert(ret == 0);
+				check_buffer(&buf, &total[i]);
+			}
+			progress = 1;
+		}
+
+		/* Only wait when neither can go on */
+		if (!progress && n) {
+			assert(poll(fds, n, 5000) > 0);
+		}
+	}
+	assert(total[0] == FILE_SIZE && total[1] == FILE_SIZE);
+
+	for (i = 0; i < 2; i++) {
+		/* Back to normal */
+		tf_size_result size;
+
+		tf[i].nonblock = 0;
+		assert(tf_cmd_size(&tf[i], &size) == 0);
+		close_served(&tf[i], &server[i]);
+	}
+
+	printf("test_transport: polled two gets, %d packets not yet arrived\n", again);
+}
+
+/**
+ * Tests tf_transport_fd() by talking to the simulator over a
+ * SOCK_SEQPACKET socketpair, as a device served by another process would be.
+ */
+int main(void)
+{
+	char path[128];
+	FILE *fh;
+	int i;
+
+	strcpy(root, "/tmp/test_transportXXXXXX");
+	assert(mkdtemp(root));
+	data = malloc(FILE_SIZE);
+	for (i = 0; i < FILE_SIZE; i++) {
+		data[i] = i * 7 + (i >> 8);
+	}
+	snprintf(path, sizeof(path), "%s/test.rec", root);
+	fh = fopen(path, "w");
+	assert(fh);
+	assert(fwrite(data, 1, FILE_SIZE, fh) == FILE_SIZE);
+	fclose(fh);
+
+	test_get();
+	test_poll();
+
+	unlink(path);
+	rmdir(root);
+	free(data);
+
+	printf("test_transport: OK\n");
+
+	return 0;
+}
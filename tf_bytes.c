@@ -23,10 +23,8 @@
 
 */
 
-#define _XOPEN_SOURCE 600
-#include <unistd.h>
-
 #include <stdio.h>
+#include <string.h>
 #include "tf_bytes.h"
 
 __u16 get_u16(const void *addr)
@@ -113,22 +111,173 @@ void put_u64(void *addr, __u64 val)
     b[7] = (val & 0xFF);
 }
 
-void byte_swap(void *packet, size_t count)
+/* byte_swap() implementations.
+ *
+ * libc swab() is often a byte at a time, and is rarely vectorised when
+ * swapping in place, so we have our own. The scalar version is the
+ * reference, and the SIMD versions leave any tail to it.
+ */
+
+static void swap_scalar(void *packet, size_t count)
 {
-#ifdef NO_SWAB
-	/* On the offchance that swab() isn't available
-	 * or doesn't work in-place, we do it manually
-	 */
-    int i;
-	__u8 *d = (__u8 *)packet;
+    __u8 *d = packet;
+
+    for (; count >= 2; count -= 2, d += 2) {
+        __u8 t = d[0];
+
+        d[0] = d[1];
+        d[1] = t;
+    }
+}
+
+static int always(void)
+{
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static void swap_ssse3(void *packet, size_t count)
+{
+    const __m128i mask = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    __u8 *d = packet;
+
+    for (; count >= 64; count -= 64, d += 64) {
+        __m128i a = _mm_loadu_si128((__m128i *)d);
+        __m128i b = _mm_loadu_si128((__m128i *)(d + 16));
+        __m128i c = _mm_loadu_si128((__m128i *)(d + 32));
+        __m128i e = _mm_loadu_si128((__m128i *)(d + 48));
+
+        _mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128((__m128i *)(d + 16), _mm_shuffle_epi8(b, mask));
+        _mm_storeu_si128((__m128i *)(d + 32), _mm_shuffle_epi8(c, mask));
+        _mm_storeu_si128((__m128i *)(d + 48), _mm_shuffle_epi8(e, mask));
+    }
+    for (; count >= 16; count -= 16, d += 16) {
+        _mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)d), mask));
+    }
+    swap_scalar(d, count);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(void *packet, size_t count)
+{
+    /* pshufb works within each 128 bit lane, so the mask is repeated */
+    const __m256i mask = _mm256_set_epi8(
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    __u8 *d = packet;
+
+    for (; count >= 128; count -= 128, d += 128) {
+        __m256i a = _mm256_loadu_si256((__m256i *)d);
+        __m256i b = _mm256_loadu_si256((__m256i *)(d + 32));
+        __m256i c = _mm256_loadu_si256((__m256i *)(d + 64));
+        __m256i e = _mm256_loadu_si256((__m256i *)(d + 96));
+
+        _mm256_storeu_si256((__m256i *)d, _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i *)(d + 32), _mm256_shuffle_epi8(b, mask));
+        _mm256_storeu_si256((__m256i *)(d + 64), _mm256_shuffle_epi8(c, mask));
+        _mm256_storeu_si256((__m256i *)(d + 96), _mm256_shuffle_epi8(e, mask));
+    }
+    for (; count >= 32; count -= 32, d += 32) {
+        _mm256_storeu_si256((__m256i *)d, _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)d), mask));
+    }
+    swap_scalar(d, count);
+}
+
+static int have_ssse3(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int have_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+
+static void swap_neon(void *packet, size_t count)
+{
+    __u8 *d = packet;
 
-    for (i = 0; i < count; i += 2) {
-        __u8 t = d[i];
+    for (; count >= 64; count -= 64, d += 64) {
+        uint8x16x4_t v = vld1q_u8_x4(d);
 
-        d[i] = d[i + 1];
-        d[i + 1] = t;
+        v.val[0] = vrev16q_u8(v.val[0]);
+        v.val[1] = vrev16q_u8(v.val[1]);
+        v.val[2] = vrev16q_u8(v.val[2]);
+        v.val[3] = vrev16q_u8(v.val[3]);
+        vst1q_u8_x4(d, v);
     }
-#else
-	swab(packet, packet, count);
+    for (; count >= 16; count -= 16, d += 16) {
+        vst1q_u8(d, vrev16q_u8(vld1q_u8(d)));
+    }
+    swap_scalar(d, count);
+}
+#endif
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    void (*swap)(void *packet, size_t count);
+} byte_swap_impl_t;
+
+/* Best first */
+static const byte_swap_impl_t swap_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", have_avx2, swap_avx2 },
+    { "ssse3", have_ssse3, swap_ssse3 },
+#endif
+#ifdef __ARM_NEON
+    { "neon", always, swap_neon },
 #endif
+    { "scalar", always, swap_scalar },
+};
+
+#define NUM_SWAP_IMPLS (sizeof(swap_impls) / sizeof(*swap_impls))
+
+/* Chosen on first use, perhaps by several threads at once */
+static const byte_swap_impl_t *swap_impl;
+
+const char *byte_swap_impl(int n)
+{
+    int i;
+
+    for (i = 0; i < NUM_SWAP_IMPLS; i++) {
+        if (swap_impls[i].supported() && n-- == 0) {
+            return swap_impls[i].name;
+        }
+    }
+    return NULL;
+}
+
+int byte_swap_use(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NUM_SWAP_IMPLS; i++) {
+        if ((!name || strcmp(name, swap_impls[i].name) == 0) && swap_impls[i].supported()) {
+            __atomic_store_n(&swap_impl, &swap_impls[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void byte_swap(void *packet, size_t count)
+{
+    const byte_swap_impl_t *impl = __atomic_load_n(&swap_impl, __ATOMIC_ACQUIRE);
+
+    if (!impl) {
+        byte_swap_use(NULL);
+        impl = __atomic_load_n(&swap_impl, __ATOMIC_ACQUIRE);
+    }
+    impl->swap(packet, count);
 }
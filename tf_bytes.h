@@ -67,7 +67,24 @@ void put_u64(void *addr, __u64 val);
  * Byte swap the given number of bytes (must be even)
  * in the given buffer.
  * This means swap bytes 0 and 1, butes 2 and 3, etc.
+ * If the count is odd, the last byte is left alone, as swab() does.
  */
 void byte_swap(void *packet, size_t count);
 
+/**
+ * byte_swap() has scalar and SIMD implementations. The best one
+ * which the CPU supports is chosen when it is first used.
+ *
+ * Returns the name of the n'th implementation which the CPU supports,
+ * best first, or NULL if there are fewer than n + 1.
+ */
+const char *byte_swap_impl(int n);
+
+/**
+ * Uses the named implementation, or the best one if 'name' is NULL.
+ * Returns 0 if OK or -1 if there is no such implementation or the CPU
+ * doesn't support it.
+ */
+int byte_swap_use(const char *name);
+
 #endif /* _TF_BYTES_H */
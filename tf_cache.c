@@ -0,0 +1,582 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tf_cache.h"
+#include "tf_util.h"
+
+/* Number of hash chains. Plenty for TF_CACHE_MAX_DIRS listings */
+#define TF_CACHE_BUCKETS 64
+
+/* Listings with more entries than this get a hash index for lookups */
+#define TF_CACHE_INDEX_MIN 16
+
+/* A remembered listing */
+struct tf_cache_dir {
+	struct tf_cache_dir *next;	/* Next in the same hash chain */
+	char *path;					/* Canonical path */
+	unsigned hash;				/* Hash of the path */
+	long long when;				/* When it was listed, in ms */
+	int count;					/* Number of entries */
+	int size;					/* Number of entries there is room for */
+	tf_typefile_t *entry;		/* The entries as received, with null terminated names */
+	int *index;					/* Entry number + 1 by hash of name, or 0 if empty.
+								 * Built when first needed */
+	unsigned index_mask;		/* Size of the index - 1 */
+};
+
+struct tf_cache {
+	int ttl;					/* ms, or 0 for no limit */
+	int dirs;					/* Number of listings remembered */
+	struct tf_cache_dir *bucket[TF_CACHE_BUCKETS];
+	struct tf_cache_dir *fill;	/* Listing being received, or NULL */
+	tf_cache_stats stats;
+};
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Returns a malloc'd copy of 'path' in canonical form: a leading /,
+ * no trailing /, no empty, "." or ".." components, and / rather than \.
+ * The root is "/".
+ */
+static char *canon_path(const char *path)
+{
+	char *buf = malloc(strlen(path) + 2);
+	char *pt = buf;
+
+	if (!buf) {
+		return 0;
+	}
+	while (*path) {
+		const char *end = path;
+		int len;
+
+		while (*end && *end != '/' && *end != '\\') {
+			end++;
+		}
+		len = end - path;
+
+		if (len == 2 && path[0] == '.' && path[1] == '.') {
+			/* Back up a directory */
+			while (pt > buf && *--pt != '/') {
+			}
+		}
+		else if (len && !(len == 1 && path[0] == '.')) {
+			*pt++ = '/';
+			memcpy(pt, path, len);
+			pt += len;
+		}
+		path = *end ? end + 1 : end;
+	}
+	if (pt == buf) {
+		*pt++ = '/';
+	}
+	*pt = 0;
+
+	return buf;
+}
+
+/**
+ * Splits the canonical path 'path' into its parent, which is returned
+ * (malloc'd), and its last component, which is stored in '*name'.
+ * Returns NULL for the root, which has no parent.
+ */
+static char *split_path(const char *path, const char **name)
+{
+	const char *pt = strrchr(path, '/');
+	char *parent;
+
+	if (!path[1]) {
+		return 0;
+	}
+	*name = pt + 1;
+	if (pt == path) {
+		return strdup("/");
+	}
+	parent = strndup(path, pt - path);
+
+	return parent;
+}
+
+static void free_dir(struct tf_cache_dir *dir)
+{
+	if (dir) {
+		free(dir->path);
+		free(dir->entry);
+		free(dir->index);
+		free(dir);
+	}
+}
+
+/**
+ * Returns the link which points to the listing of the canonical
+ * path 'path' (which may be NULL if there is none).
+ */
+static struct tf_cache_dir **find_link(struct tf_cache *cache, const char *path)
+{
+	unsigned hash = tf_hash_name(path);
+	struct tf_cache_dir **link = &cache->bucket[hash % TF_CACHE_BUCKETS];
+
+	while (*link && ((*link)->hash != hash || strcmp((*link)->path, path) != 0)) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+static void unlink_dir(struct tf_cache *cache, struct tf_cache_dir **link)
+{
+	struct tf_cache_dir *dir = *link;
+
+	*link = dir->next;
+	cache->dirs--;
+	free_dir(dir);
+}
+
+/**
+ * Returns the listing of the canonical path 'path' if it is
+ * remembered and not too old.
+ */
+static struct tf_cache_dir *lookup(struct tf_cache *cache, const char *path)
+{
+	struct tf_cache_dir **link = find_link(cache, path);
+
+	if (*link && cache->ttl && now_ms() - (*link)->when >= cache->ttl) {
+		unlink_dir(cache, link);
+		cache->stats.expired++;
+	}
+	return *link;
+}
+
+/**
+ * Builds the hash index of a listing.
+ * Returns 0 if OK or -1 if out of memory.
+ */
+static int build_index(struct tf_cache_dir *dir)
+{
+	unsigned size = 1;
+	int i;
+
+	while (size < 2 * dir->count) {
+		size *= 2;
+	}
+	dir->index = calloc(size, sizeof(*dir->index));
+	if (!dir->index) {
+		return -1;
+	}
+	dir->index_mask = size - 1;
+
+	for (i = 0; i < dir->count; i++) {
+		unsigned h = tf_hash_name((const char *)dir->entry[i].name) & dir->index_mask;
+
+		while (dir->index[h]) {
+			h = (h + 1) & dir->index_mask;
+		}
+		dir->index[h] = i + 1;
+	}
+	return 0;
+}
+
+/**
+ * Forgets the hash index once the entries change.
+ */
+static void drop_index(struct tf_cache_dir *dir)
+{
+	free(dir->index);
+	dir->index = 0;
+}
+
+static int find_entry(struct tf_cache_dir *dir, const char *name)
+{
+	int i;
+
+	if (dir->index || (dir->count > TF_CACHE_INDEX_MIN && build_index(dir) == 0)) {
+		unsigned h;
+
+		for (h = tf_hash_name(name) & dir->index_mask; dir->index[h]; h = (h + 1) & dir->index_mask) {
+			i = dir->index[h] - 1;
+			if (strcmp((const char *)dir->entry[i].name, name) == 0) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	for (i = 0; i < dir->count; i++) {
+		if (strcmp((const char *)dir->entry[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void remove_entry(struct tf_cache_dir *dir, int i)
+{
+	drop_index(dir);
+	memmove(&dir->entry[i], &dir->entry[i + 1], (dir->count - i - 1) * sizeof(*dir->entry));
+	dir->count--;
+}
+
+/**
+ * Appends 'count' entries to the listing, making room as needed.
+ * Returns 0 if OK or -1 if out of memory.
+ */
+static int add_entries(struct tf_cache_dir *dir, const tf_typefile_t *entry, int count)
+{
+	drop_index(dir);
+
+	if (dir->count + count > dir->size) {
+		int size = dir->size ? dir->size * 2 : MAX_DIR_ENTRIES;
+		tf_typefile_t *grown;
+
+		while (size < dir->count + count) {
+			size *= 2;
+		}
+		grown = realloc(dir->entry, size * sizeof(*grown));
+		if (!grown) {
+			return -1;
+		}
+		dir->entry = grown;
+		dir->size = size;
+	}
+	memcpy(&dir->entry[dir->count], entry, count * sizeof(*entry));
+	dir->count += count;
+
+	return 0;
+}
+
+/**
+ * Forgets the listing of the canonical path 'path', and of every
+ * directory below it.
+ */
+static void forget_tree(struct tf_cache *cache, const char *path)
+{
+	size_t len = strlen(path);
+	int i;
+
+	for (i = 0; i < TF_CACHE_BUCKETS; i++) {
+		struct tf_cache_dir **link = &cache->bucket[i];
+
+		while (*link) {
+			const char *p = (*link)->path;
+
+			if (strncmp(p, path, len) == 0 && (p[len] == 0 || p[len] == '/' || len == 1)) {
+				unlink_dir(cache, link);
+				cache->stats.invalidated++;
+			}
+			else {
+				link = &(*link)->next;
+			}
+		}
+	}
+}
+
+int tf_cache_enable(tf_handle *tf, int ttl)
+{
+	if (!tf->cache) {
+		tf->cache = calloc(1, sizeof(*tf->cache));
+		if (!tf->cache) {
+			return TF_ERR_NOMEM;
+		}
+	}
+	tf->cache->ttl = ttl;
+
+	return 0;
+}
+
+void tf_cache_flush(tf_handle *tf)
+{
+	struct tf_cache *cache = tf->cache;
+	int i;
+
+	if (cache) {
+		for (i = 0; i < TF_CACHE_BUCKETS; i++) {
+			while (cache->bucket[i]) {
+				unlink_dir(cache, &cache->bucket[i]);
+			}
+		}
+		free_dir(cache->fill);
+		cache->fill = 0;
+	}
+}
+
+void tf_cache_disable(tf_handle *tf)
+{
+	tf_cache_flush(tf);
+	free(tf->cache);
+	tf->cache = 0;
+}
+
+void tf_cache_get_stats(tf_handle *tf, tf_cache_stats *stats)
+{
+	if (tf->cache) {
+		*stats = tf->cache->stats;
+	}
+	else {
+		memset(stats, 0, sizeof(*stats));
+	}
+}
+
+const tf_typefile_t *tf_cache_find_dir(tf_handle *tf, const char *path, int *count)
+{
+	struct tf_cache_dir *dir;
+	char *canon;
+
+	if (!tf->cache || !(canon = canon_path(path))) {
+		return 0;
+	}
+	dir = lookup(tf->cache, canon);
+	free(canon);
+
+	if (!dir) {
+		tf->cache->stats.misses++;
+		return 0;
+	}
+	tf->cache->stats.hits++;
+	*count = dir->count;
+
+	return dir->entry;
+}
+
+int tf_cache_stat(tf_handle *tf, const char *path, tf_dirent *dirent)
+{
+	struct tf_cache_dir *dir = 0;
+	const char *name;
+	char *parent = 0;
+	char *canon;
+	int ret = -1;
+
+	if (!tf->cache || !(canon = canon_path(path))) {
+		return -1;
+	}
+	parent = split_path(canon, &name);
+	if (parent) {
+		dir = lookup(tf->cache, parent);
+	}
+
+	if (dir) {
+		int i = find_entry(dir, name);
+
+		tf->cache->stats.hits++;
+		if (i >= 0) {
+			/* A view is just the entry itself */
+			tf_dirent_view_unpack((const tf_dirent_view *)&dir->entry[i], dirent);
+			ret = 0;
+		}
+		else {
+			ret = 1;
+		}
+	}
+	free(parent);
+	free(canon);
+
+	return ret;
+}
+
+void tf_cache_fill_begin(tf_handle *tf, const char *path)
+{
+	struct tf_cache *cache = tf->cache;
+
+	if (cache) {
+		free_dir(cache->fill);
+		cache->fill = calloc(1, sizeof(*cache->fill));
+		if (cache->fill && !(cache->fill->path = canon_path(path))) {
+			free_dir(cache->fill);
+			cache->fill = 0;
+		}
+	}
+}
+
+void tf_cache_fill_add(tf_handle *tf, const tf_typefile_t *entry, int count)
+{
+	struct tf_cache *cache = tf->cache;
+
+	if (cache && cache->fill && add_entries(cache->fill, entry, count) != 0) {
+		/* Can't remember this one */
+		free_dir(cache->fill);
+		cache->fill = 0;
+	}
+}
+
+void tf_cache_fill_end(tf_handle *tf, int complete)
+{
+	struct tf_cache *cache = tf->cache;
+	struct tf_cache_dir *dir;
+	struct tf_cache_dir **link;
+
+	if (!cache || !cache->fill) {
+		return;
+	}
+	dir = cache->fill;
+	cache->fill = 0;
+
+	if (!complete) {
+		free_dir(dir);
+		return;
+	}
+
+	/* Replace any older listing */
+	link = find_link(cache, dir->path);
+	if (*link) {
+		unlink_dir(cache, link);
+	}
+	else if (cache->dirs == TF_CACHE_MAX_DIRS) {
+		/* Make room by forgetting the oldest */
+		struct tf_cache_dir **oldest = 0;
+		int i;
+
+		for (i = 0; i < TF_CACHE_BUCKETS; i++) {
+			for (link = &cache->bucket[i]; *link; link = &(*link)->next) {
+				if (!oldest || (*link)->when < (*oldest)->when) {
+					oldest = link;
+				}
+			}
+		}
+		unlink_dir(cache, oldest);
+	}
+
+	dir->hash = tf_hash_name(dir->path);
+	dir->when = now_ms();
+	link = &cache->bucket[dir->hash % TF_CACHE_BUCKETS];
+	dir->next = *link;
+	*link = dir;
+	cache->dirs++;
+}
+
+void tf_cache_removed(tf_handle *tf, const char *path)
+{
+	struct tf_cache *cache = tf->cache;
+	struct tf_cache_dir *dir;
+	const char *name;
+	char *parent;
+	char *canon;
+
+	if (!cache || !(canon = canon_path(path))) {
+		return;
+	}
+	forget_tree(cache, canon);
+
+	parent = split_path(canon, &name);
+	if (parent && (dir = *find_link(cache, parent)) != 0) {
+		int i = find_entry(dir, name);
+
+		if (i >= 0) {
+			remove_entry(dir, i);
+			cache->stats.invalidated++;
+		}
+	}
+	free(parent);
+	free(canon);
+}
+
+void tf_cache_renamed(tf_handle *tf, const char *src, const char *dest)
+{
+	struct tf_cache *cache = tf->cache;
+	struct tf_cache_dir *dir;
+	tf_typefile_t entry;
+	int found = 0;
+	const char *name;
+	char *parent;
+	char *canon;
+
+	if (!cache || !(canon = canon_path(src))) {
+		return;
+	}
+	forget_tree(cache, canon);
+
+	/* Take the entry out of the old directory, if we know it */
+	parent = split_path(canon, &name);
+	if (parent && (dir = *find_link(cache, parent)) != 0) {
+		int i = find_entry(dir, name);
+
+		if (i >= 0) {
+			entry = dir->entry[i];
+			found = 1;
+			remove_entry(dir, i);
+			cache->stats.invalidated++;
+		}
+	}
+	free(parent);
+	free(canon);
+
+	if (!(canon = canon_path(dest))) {
+		tf_cache_flush(tf);
+		return;
+	}
+	forget_tree(cache, canon);
+
+	/* And put it in the new one, or forget the new one if we can't */
+	parent = split_path(canon, &name);
+	if (parent) {
+		struct tf_cache_dir **link = find_link(cache, parent);
+
+		if ((dir = *link) != 0) {
+			int i = find_entry(dir, name);
+
+			if (i >= 0) {
+				remove_entry(dir, i);
+			}
+			if (found && strlen(name) < sizeof(entry.name)) {
+				strcpy((char *)entry.name, name);
+			}
+			else {
+				found = 0;
+			}
+			if (!found || add_entries(dir, &entry, 1) != 0) {
+				unlink_dir(cache, link);
+			}
+			cache->stats.invalidated++;
+		}
+	}
+	free(parent);
+	free(canon);
+}
+
+void tf_cache_changed(tf_handle *tf, const char *path)
+{
+	struct tf_cache *cache = tf->cache;
+	struct tf_cache_dir **link;
+	const char *name;
+	char *parent;
+	char *canon;
+
+	if (!cache || !(canon = canon_path(path))) {
+		return;
+	}
+	parent = split_path(canon, &name);
+	if (parent && *(link = find_link(cache, parent))) {
+		unlink_dir(cache, link);
+		cache->stats.invalidated++;
+	}
+	free(parent);
+	free(canon);
+}
@@ -0,0 +1,128 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_CACHE_H
+#define TF_CACHE_H
+
+/* A cache of directory listings, so that repeated stats and listings
+ * of the same directory don't each go to the device.
+ *
+ * Listings are remembered by canonical path. Changes made through the
+ * handle (delete, rename, mkdir and put) update or forget the affected
+ * listings straight away. Changes made on the Toppy itself (such as a
+ * recording starting) are only seen once a listing is older than the TTL.
+ */
+
+#include "tf_io.h"
+#include "tf_proto.h"
+
+/* Default number of milliseconds a listing is trusted for */
+#define TF_CACHE_DEFAULT_TTL 5000
+
+/* Most listings remembered at once. The oldest is forgotten first. */
+#define TF_CACHE_MAX_DIRS 64
+
+/**
+ * Statistics returned by tf_cache_get_stats()
+ */
+typedef struct {
+	unsigned long hits;			/* Lookups answered from the cache */
+	unsigned long misses;		/* Lookups which had to go to the device */
+	unsigned long expired;		/* Listings forgotten because they were older than the TTL */
+	unsigned long invalidated;	/* Listings changed or forgotten because of a change made through the handle */
+} tf_cache_stats;
+
+/**
+ * Turns on the cache for the handle, or changes the TTL if it is already on.
+ * Listings older than 'ttl' milliseconds are listed again.
+ * If 'ttl' is 0, listings are trusted until the handle changes them.
+ *
+ * Once the cache is on, tf_stat() and tf_dir_open() answer from it when
+ * they can, and every complete listing is remembered, including those
+ * from tf_cmd_dir_first()/tf_cmd_dir_next() (which always go to the device).
+ *
+ * Returns 0 if OK or TF_ERR_NOMEM.
+ */
+int tf_cache_enable(tf_handle *tf, int ttl);
+
+/**
+ * Turns off the cache and frees it.
+ * This is done by topfield_close().
+ */
+void tf_cache_disable(tf_handle *tf);
+
+/**
+ * Forgets every listing, but leaves the cache on.
+ */
+void tf_cache_flush(tf_handle *tf);
+
+/**
+ * Stores the statistics since the cache was turned on in '*stats'.
+ * They are all 0 if the cache is off.
+ */
+void tf_cache_get_stats(tf_handle *tf, tf_cache_stats *stats);
+
+/* The following are used by the rest of the library.
+ * They do nothing if the cache is off.
+ */
+
+/**
+ * Returns the cached listing of the directory 'path' and stores
+ * the number of entries in '*count', or returns NULL if it isn't cached.
+ */
+const tf_typefile_t *tf_cache_find_dir(tf_handle *tf, const char *path, int *count);
+
+/**
+ * Looks up 'path' in the cached listing of its parent.
+ * Returns 0 and fills in '*dirent' if it is there, 1 if it isn't,
+ * or -1 if the parent isn't cached.
+ * Only hits are counted, since a miss is followed by listing the parent.
+ */
+int tf_cache_stat(tf_handle *tf, const char *path, tf_dirent *dirent);
+
+/**
+ * A listing of 'path' is starting. The entries passed to tf_cache_fill_add()
+ * are collected and, if tf_cache_fill_end() says the listing was complete,
+ * remembered.
+ */
+void tf_cache_fill_begin(tf_handle *tf, const char *path);
+void tf_cache_fill_add(tf_handle *tf, const tf_typefile_t *entry, int count);
+void tf_cache_fill_end(tf_handle *tf, int complete);
+
+/**
+ * 'path' has been deleted.
+ */
+void tf_cache_removed(tf_handle *tf, const char *path);
+
+/**
+ * 'src' has been renamed to 'dest'.
+ */
+void tf_cache_renamed(tf_handle *tf, const char *src, const char *dest);
+
+/**
+ * 'path' has been created or changed in some way that can't
+ * be worked out here, so the listing of its parent is forgotten.
+ */
+void tf_cache_changed(tf_handle *tf, const char *path);
+
+#endif
@@ -0,0 +1,325 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tf_fault.h"
+#include "tf_bytes.h"
+
+#define FAULT_MAX_RULES 16
+#define FAULT_MAX_PACKET 0x10000
+
+typedef struct {
+	tf_transport t;
+	tf_transport *inner;
+	tf_fault_stats stats;
+
+	tf_fault_rule rules[FAULT_MAX_RULES];
+	int matched[FAULT_MAX_RULES];	/* Number of packets which matched each rule */
+	int num_rules;
+
+	int permille;				/* Random faults */
+	int max_delay;
+	unsigned rand;
+
+	__u8 *buf;					/* Scratch space for a corrupted send */
+	__u8 *held;					/* A delayed reply */
+	ssize_t held_len;
+	int held_delay;				/* Remaining delay in ms */
+} tf_fault;
+
+static unsigned fault_random(tf_fault *tf)
+{
+	tf->rand = tf->rand * 1103515245 + 12345;
+	return (tf->rand >> 16) & 0x7FFF;
+}
+
+static void fault_sleep(int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) != 0) {
+	}
+}
+
+/**
+ * Decides what should happen to the given packet.
+ * Returns the action, or 0 for none, and sets '*arg'.
+ */
+static int fault_choose(tf_fault *ft, int dir, const __u8 *buf, size_t len, int *arg)
+{
+	__u32 cmd = len >= 8 ? get_u32_raw(buf + 4) : 0;
+	int i;
+
+	for (i = 0; i < ft->num_rules; i++) {
+		const tf_fault_rule *rule = &ft->rules[i];
+		int seen;
+
+		if (rule->dir != dir || (rule->cmd && rule->cmd != cmd)) {
+			continue;
+		}
+		seen = ft->matched[i]++;
+		if (seen < rule->skip) {
+			return 0;
+		}
+		if (rule->count && seen >= rule->skip + rule->count) {
+			/* This rule is used up */
+			continue;
+		}
+		*arg = rule->arg;
+		return rule->action;
+	}
+
+	if (ft->permille && fault_random(ft) % 1000 < ft->permille) {
+		int action = TF_FAULT_DROP + fault_random(ft) % 4;
+
+		*arg = action == TF_FAULT_DELAY ? fault_random(ft) % (ft->max_delay + 1) : 0;
+		return action;
+	}
+
+	return 0;
+}
+
+/**
+ * Spoils the CRC of a Topfield packet. The CRC is in bytes 2 and 3
+ * whether or not the packet has been byte swapped.
+ */
+static void fault_corrupt(__u8 *buf, size_t len)
+{
+	if (len >= 4) {
+		buf[2] ^= 0x5A;
+	}
+	else if (len) {
+		buf[0] ^= 0x5A;
+	}
+}
+
+static ssize_t tf_fault_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	tf_fault *ft = (tf_fault *)t;
+	int arg = 0;
+	ssize_t ret;
+
+	switch (fault_choose(ft, TF_FAULT_SEND, buf, len, &arg)) {
+		case TF_FAULT_DROP:
+			ft->stats.dropped++;
+			return len;
+
+		case TF_FAULT_TRUNCATE:
+			ft->stats.truncated++;
+			ret = ft->inner->send(ft->inner, buf, arg && arg < len ? arg : len / 2, timeout);
+			return ret < 0 ? ret : len;
+
+		case TF_FAULT_CORRUPT:
+			if (len <= FAULT_MAX_PACKET) {
+				ft->stats.corrupted++;
+				memcpy(ft->buf, buf, len);
+				fault_corrupt(ft->buf, len);
+				return ft->inner->send(ft->inner, ft->buf, len, timeout);
+			}
+			break;
+
+		case TF_FAULT_DELAY:
+			ft->stats.delayed++;
+			fault_sleep(arg);
+			break;
+	}
+
+	return ft->inner->send(ft->inner, buf, len, timeout);
+}
+
+static ssize_t tf_fault_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	tf_fault *ft = (tf_fault *)t;
+	__u8 *p = buf;
+	ssize_t ret;
+	int arg = 0;
+
+	if (data) {
+		*data = buf;
+	}
+
+	if (ft->held_len) {
+		/* A delayed reply. A timeout of 0 waits forever, so it always arrives */
+		if (timeout > 0 && ft->held_delay >= timeout) {
+			fault_sleep(timeout);
+			ft->held_delay -= timeout;
+			return 0;
+		}
+		fault_sleep(ft->held_delay);
+		ret = ft->held_len < size ? ft->held_len : size;
+		memcpy(buf, ft->held, ret);
+		ft->held_len = 0;
+		return ret;
+	}
+
+	for (;;) {
+		ret = ft->inner->recv(ft->inner, buf, size, data ? (void **)&p : 0, timeout);
+		if (ret <= 0) {
+			return ret;
+		}
+		if (data) {
+			*data = p;
+		}
+
+		switch (fault_choose(ft, TF_FAULT_RECV, p, ret, &arg)) {
+			case TF_FAULT_DROP:
+				/* Lost, so wait for whatever comes next */
+				ft->stats.dropped++;
+				continue;
+
+			case TF_FAULT_TRUNCATE:
+				ft->stats.truncated++;
+				return arg && arg < ret ? arg : ret / 2;
+
+			case TF_FAULT_CORRUPT:
+				ft->stats.corrupted++;
+				fault_corrupt(p, ret);
+				return ret;
+
+			case TF_FAULT_DELAY:
+				ft->stats.delayed++;
+				if (timeout > 0 && arg >= timeout && ret <= FAULT_MAX_PACKET) {
+					/* Too late for this recv, but not the next */
+					memcpy(ft->held, p, ret);
+					ft->held_len = ret;
+					ft->held_delay = arg - timeout;
+					fault_sleep(timeout);
+					return 0;
+				}
+				fault_sleep(arg);
+				return ret;
+		}
+		return ret;
+	}
+}
+
+static int tf_fault_cancel(tf_transport *t)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	ft->held_len = 0;
+	return ft->inner->cancel(ft->inner);
+}
+
+static int tf_fault_read_ahead(tf_transport *t, int packets)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	return ft->inner->read_ahead(ft->inner, packets);
+}
+
+static void *tf_fault_alloc(tf_transport *t, size_t size)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	return ft->inner->alloc(ft->inner, size);
+}
+
+static void tf_fault_free(tf_transport *t, void *buf)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	ft->inner->free(ft->inner, buf);
+}
+
+static void tf_fault_close(tf_transport *t)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	ft->inner->close(ft->inner);
+	free(ft->buf);
+	free(ft->held);
+	free(ft);
+}
+
+tf_transport *tf_transport_fault(tf_transport *inner)
+{
+	tf_fault *ft;
+
+	if (!inner) {
+		return 0;
+	}
+	ft = calloc(1, sizeof(*ft));
+	if (!ft) {
+		return 0;
+	}
+	ft->buf = malloc(FAULT_MAX_PACKET);
+	ft->held = malloc(FAULT_MAX_PACKET);
+	if (!ft->buf || !ft->held) {
+		free(ft->buf);
+		free(ft->held);
+		free(ft);
+		return 0;
+	}
+	ft->inner = inner;
+	ft->t = *inner;
+	ft->t.send = tf_fault_send;
+	ft->t.recv = tf_fault_recv;
+	ft->t.cancel = tf_fault_cancel;
+	ft->t.close = tf_fault_close;
+	ft->t.read_ahead = inner->read_ahead ? tf_fault_read_ahead : 0;
+	ft->t.alloc = inner->alloc ? tf_fault_alloc : 0;
+	ft->t.free = inner->free ? tf_fault_free : 0;
+
+	return &ft->t;
+}
+
+int tf_fault_add(tf_transport *t, const tf_fault_rule *rule)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	if (ft->num_rules == FAULT_MAX_RULES) {
+		return -1;
+	}
+	ft->matched[ft->num_rules] = 0;
+	ft->rules[ft->num_rules++] = *rule;
+
+	return 0;
+}
+
+void tf_fault_clear(tf_transport *t)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	ft->num_rules = 0;
+	ft->permille = 0;
+}
+
+void tf_fault_random(tf_transport *t, int permille, int max_delay, unsigned seed)
+{
+	tf_fault *ft = (tf_fault *)t;
+
+	ft->permille = permille;
+	ft->max_delay = max_delay;
+	ft->rand = seed;
+}
+
+void tf_fault_get_stats(tf_transport *t, tf_fault_stats *stats)
+{
+	*stats = ((tf_fault *)t)->stats;
+}
@@ -0,0 +1,93 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_FAULT_H
+#define TF_FAULT_H
+
+/* Injects faults into the packets carried by another transport,
+ * so that the recovery paths in tf_io.c can be exercised and timed.
+ */
+
+#include "tf_transport.h"
+#include "tf_types.h"
+
+typedef enum {
+	TF_FAULT_DROP = 1,		/* The packet is lost */
+	TF_FAULT_TRUNCATE,		/* Only the first 'arg' bytes arrive (half if 0) */
+	TF_FAULT_CORRUPT,		/* The packet arrives with a bad CRC */
+	TF_FAULT_DELAY,			/* The packet arrives 'arg' ms late */
+} tf_fault_action;
+
+#define TF_FAULT_SEND 1		/* Packets sent to the device */
+#define TF_FAULT_RECV 2		/* Packets received from the device */
+
+typedef struct {
+	int dir;				/* TF_FAULT_SEND or TF_FAULT_RECV */
+	__u32 cmd;				/* Only packets with this command (TF_MSG_...), or 0 for any */
+	int skip;				/* Let this many matching packets through first */
+	int count;				/* Then affect this many, or 0 for all that follow */
+	tf_fault_action action;
+	int arg;
+} tf_fault_rule;
+
+typedef struct {
+	int dropped;
+	int truncated;
+	int corrupted;
+	int delayed;
+} tf_fault_stats;
+
+/**
+ * Creates a transport which passes packets to and from 'inner',
+ * injecting faults as directed by tf_fault_add() and tf_fault_random().
+ * 'inner' is closed when this transport is closed.
+ *
+ * Returns 0 if no memory is available.
+ */
+tf_transport *tf_transport_fault(tf_transport *inner);
+
+/**
+ * Adds a scripted fault. Rules are checked in the order they are added
+ * and the first which applies to a packet is used.
+ * Returns 0 if OK or -1 if there are too many rules.
+ */
+int tf_fault_add(tf_transport *t, const tf_fault_rule *rule);
+
+/**
+ * Removes all scripted faults and turns off random faults.
+ */
+void tf_fault_clear(tf_transport *t);
+
+/**
+ * Affects each packet not matched by a scripted fault with probability
+ * 'permille'/1000, choosing one of the actions at random.
+ * Delays are up to 'max_delay' ms. The choices depend only on 'seed'.
+ */
+void tf_fault_random(tf_transport *t, int permille, int max_delay, unsigned seed);
+
+/**
+ * Fills in the statistics for a transport created by tf_transport_fault().
+ */
+void tf_fault_get_stats(tf_transport *t, tf_fault_stats *stats);
+
+#endif
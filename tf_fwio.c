@@ -23,8 +23,6 @@
   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 */
-#include "usb_io.h"
-
 #include <string.h>
 #include <stdio.h>
 #include <syslog.h>
@@ -59,15 +57,6 @@ typedef struct
     __u8 data[MAX_DATA_SIZE + 1];	/* Add one byte for the crc */
 } __attribute__ ((packed)) tf_packet_t;
 
-/* Topfield command codes */
-#define TF_FW_ID                     0x02
-#define TF_FW_PC_TO_STB              0x01
-#define TF_FW_STB_TO_PC              0x03
-#define TF_FW_REQ_DATA               0x04
-#define TF_FW_DATA                   0x05
-#define TF_FW_END                    0x06
-#define TF_FW_REBOOT                 0x0B
-
 static const char *tf_command_name(__u8 cmd);
 static void print_packet(FILE *fh, const char *prefix, int trace_level, tf_packet_t *packet);
 
@@ -140,7 +129,7 @@ static void tf_req_putdata(tf_packet_t *req, const void *data, size_t len)
  */
 static int tf_send(tf_handle *tf, const tf_packet_t *req)
 {
-	if (tf->dev) {
+	if (tf->transport) {
 		unsigned char *data;
 		int len = PACKET_HEAD_SIZE + get_u16(&req->length) + 1;
 		int pad = 0;
@@ -176,13 +165,13 @@ static int tf_send(tf_handle *tf, const tf_packet_t *req)
 			if (tosend > MAX_SEND_SIZE) {
 				tosend = MAX_SEND_SIZE;
 			}
-			int ret = usb_bulk_write(tf->dev, 0x01, (void *)data, tosend, tf->timeout);
+			int ret = tf->transport->send(tf->transport, data, tosend, tf->timeout);
 
-			DEBUG_LOG("usb_bulk_write(endpoint=0x01, len=%d, timeout=%dms)", tosend, tf->timeout);
+			DEBUG_LOG("send(len=%d, timeout=%dms)", tosend, tf->timeout);
 #ifdef DEBUG_DUMP
 			dump_hex_buf(stderr, (__u8 *)data, tosend);
 #endif
-			DEBUG_LOG("usb_bulk_write() returned %d", ret);
+			DEBUG_LOG("send() returned %d", ret);
 			if (ret != tosend) {
 				tf->error = -1;
 				break;
@@ -204,13 +193,13 @@ static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
 {
 	int ret;
 
-	if (!tf->dev) {
+	if (!tf->transport) {
 		tf->error = -2;
 		return tf->error;
 	}
 
-	ret = usb_bulk_read(tf->dev, 0x82, (void *)reply, sizeof(*reply), tf->timeout);
-	DEBUG_LOG("usb_bulk_read(endpoint=0x82, len=%d, timeout=%dms) returned %d\n", sizeof(*reply), tf->timeout, ret);
+	ret = tf->transport->recv(tf->transport, reply, sizeof(*reply), NULL, tf->timeout);
+	DEBUG_LOG("recv(len=%d, timeout=%dms) returned %d\n", sizeof(*reply), tf->timeout, ret);
 #ifdef DEBUG_DUMP
 	if (ret > 0) {
 		dump_hex_buf(stderr, (__u8 *)reply, ret);
@@ -219,7 +208,7 @@ static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
 
 	if (ret < PACKET_HEAD_SIZE) {
 		if (ret >= 0) {
-			DEBUG_LOG("usb_bulk_read() returned ret=%d < 8", ret);
+			DEBUG_LOG("recv() returned ret=%d < 8", ret);
 		}
 		tf->error = -1;
     }
@@ -227,7 +216,7 @@ static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
 		__u16 len = get_u16(&reply->length);
 
 		if (ret < len) {
-			DEBUG_LOG("usb_bulk_read() returned ret=%d < len=%d", ret, len);
+			DEBUG_LOG("recv() returned ret=%d < len=%d", ret, len);
 			tf->error = -1;
 		}
 		else {
@@ -242,27 +231,27 @@ static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
 
 static int tf_wait_for_req_data(tf_handle *tf, tf_fw_data_t *fw_data)
 {
-	tf_packet_t reply;
+	tf_packet_t *reply = tf->reply;
 
 	/* Wait for it to ask for the first block */
-	int ret = tf_get_response(tf, &reply);
+	int ret = tf_get_response(tf, reply);
 
-	/*printf("tf_wait_for_req_data() ret=%d reply.cmd=%s\n", ret, tf_command_name(reply.cmd));*/
+	/*printf("tf_wait_for_req_data() ret=%d reply->cmd=%s\n", ret, tf_command_name(reply->cmd));*/
 
 	if (ret != 0) {
 		return -1;
 	}
 
-	if (reply.cmd == TF_FW_REQ_DATA) {
+	if (reply->cmd == TF_FW_REQ_DATA) {
 		/* Success - send data */
 		/* Extract len and offset into fw_data */
-		fw_data->seq = reply.seq;
-		fw_data->len = get_u16(reply.data);
-		fw_data->offset = get_u24(reply.data + 2);
+		fw_data->seq = reply->seq;
+		fw_data->len = get_u16(reply->data);
+		fw_data->offset = get_u24(reply->data + 2);
 		DEBUG_LOG("REQ_DATA: seq=%02X len=%u, offset=%lu", fw_data->seq, fw_data->len, fw_data->offset);
 		return 0;
 	}
-	if (reply.cmd == TF_FW_END) {
+	if (reply->cmd == TF_FW_END) {
 		/* Success - done */
 		return 1;
 	}
@@ -274,19 +263,19 @@ static int tf_wait_for_req_data(tf_handle *tf, tf_fw_data_t *fw_data)
 int tf_fw_upload(tf_handle *tf, tf_fw_data_t *fw_data)
 {
 	int ret;
-    tf_packet_t req;
+    tf_packet_t *req = tf->req;
 
 	/* But in USB means we send cmd=1 (which should be 2) *before* we receive cmd=1 */
-	tf_req_init(&req, TF_FW_PC_TO_STB, 0);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_FW_PC_TO_STB, 0);
+	tf_req_done(tf, req);
 
-    ret = tf_send(tf, &req);
+    ret = tf_send(tf, req);
 	if (ret == 0) {
-		tf_packet_t reply;
+		tf_packet_t *reply = tf->reply;
 
-		ret = tf_get_response(tf, &reply);
-		/*printf("Got ret=%d, reply.cmd=%d\n", ret, reply.cmd);*/
-		if (ret != 0 || reply.cmd != TF_FW_ID) {
+		ret = tf_get_response(tf, reply);
+		/*printf("Got ret=%d, reply->cmd=%d\n", ret, reply->cmd);*/
+		if (ret != 0 || reply->cmd != TF_FW_ID) {
 			return -1;
 		}
 
@@ -299,7 +288,7 @@ int tf_fw_upload(tf_handle *tf, tf_fw_data_t *fw_data)
 int tf_fw_upload_next(tf_handle *tf, const void *buf, size_t len, tf_fw_data_t *fw_data)
 {
 	/* Send the data */
-    tf_packet_t req;
+    tf_packet_t *req = tf->req;
 	int ret;
 
 	if (len > MAX_DATA_SIZE) {
@@ -308,11 +297,11 @@ int tf_fw_upload_next(tf_handle *tf, const void *buf, size_t len, tf_fw_data_t *
 	}
 
 	/* Use the same seq as the request */
-	tf_req_init(&req, TF_FW_DATA, fw_data->seq);
-	tf_req_putdata(&req, buf, len);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_FW_DATA, fw_data->seq);
+	tf_req_putdata(req, buf, len);
+	tf_req_done(tf, req);
 
-    ret = tf_send(tf, &req);
+    ret = tf_send(tf, req);
 
 	if (ret != 0) {
 		return -1;
@@ -324,12 +313,12 @@ int tf_fw_upload_next(tf_handle *tf, const void *buf, size_t len, tf_fw_data_t *
 
 int tf_fw_reboot(tf_handle *tf)
 {
-    tf_packet_t req;
+    tf_packet_t *req = tf->req;
 
-	tf_req_init(&req, TF_FW_REBOOT, 0);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_FW_REBOOT, 0);
+	tf_req_done(tf, req);
 
-    return tf_send(tf, &req);
+    return tf_send(tf, req);
 }
 
 /**
@@ -35,6 +35,15 @@
 */
 #define MAX_DATA_SIZE 0x8000
 
+/* Bootloader command codes */
+#define TF_FW_ID                     0x02
+#define TF_FW_PC_TO_STB              0x01
+#define TF_FW_STB_TO_PC              0x03
+#define TF_FW_REQ_DATA               0x04
+#define TF_FW_DATA                   0x05
+#define TF_FW_END                    0x06
+#define TF_FW_REBOOT                 0x0B
+
 typedef struct {
 	unsigned seq;
 	unsigned len;		/* will be no more than MAX_DATA_SIZE */
@@ -0,0 +1,341 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "tf_fwsim.h"
+#include "tf_fwio.h"
+#include "tf_bytes.h"
+
+/* ToFi, seq, cmd, length, then the data and a checksum byte */
+#define FW_HEAD_SIZE 8
+#define FW_PACKET_SIZE(len) (FW_HEAD_SIZE + (len) + 1)
+
+/* The largest offset which fits in REQ_DATA */
+#define FW_MAX_IMAGE 0x1000000
+
+#define FW_MAX_REPLIES 2
+
+typedef enum {
+	FW_IDLE,		/* Waiting for PC_TO_STB */
+	FW_LOADING,		/* Requesting blocks */
+	FW_DONE,		/* Sent END */
+} tf_fwsim_state;
+
+typedef struct {
+	tf_transport t;
+	tf_fwsim_options opts;
+	tf_fwsim_stats stats;
+	tf_fwsim_state state;
+
+	__u8 *image;
+	size_t size;
+
+	unsigned *order;		/* The order in which the blocks are requested */
+	unsigned nblocks;
+	unsigned next;			/* Index into order[] of the next new block */
+	int since_repeat;		/* Blocks requested since the last repeat */
+	unsigned rand;
+
+	__u8 seq;				/* The current request */
+	unsigned req_len;
+	unsigned req_offset;
+
+	__u8 *rx;				/* The packet being received */
+	size_t rx_len;
+
+	__u8 replies[FW_MAX_REPLIES][FW_PACKET_SIZE(8)];
+	int reply_head;
+	int reply_count;
+} tf_fwsim;
+
+static unsigned fwsim_random(tf_fwsim *fw)
+{
+	/* A small, fully deterministic generator */
+	fw->rand = fw->rand * 1103515245 + 12345;
+	return (fw->rand >> 16) & 0x7FFF;
+}
+
+static __u8 fwsim_checksum(const __u8 *buf, size_t len)
+{
+	__u8 sum = 0;
+
+	while (len--) {
+		sum += *buf++;
+	}
+	return sum;
+}
+
+static void fwsim_reply(tf_fwsim *fw, __u8 cmd, const __u8 *data, unsigned len)
+{
+	__u8 *p;
+
+	if (fw->reply_count == FW_MAX_REPLIES) {
+		return;
+	}
+	p = fw->replies[(fw->reply_head + fw->reply_count++) % FW_MAX_REPLIES];
+
+	memcpy(p, "ToFi", 4);
+	p[4] = fw->seq;
+	p[5] = cmd;
+	put_u16(p + 6, len);
+	memcpy(p + FW_HEAD_SIZE, data, len);
+	p[FW_HEAD_SIZE + len] = fwsim_checksum(p + 4, len + 4);
+}
+
+/**
+ * Sends REQ_DATA for the current request.
+ */
+static void fwsim_request(tf_fwsim *fw)
+{
+	__u8 data[5];
+
+	put_u16(data, fw->req_len);
+	data[2] = (fw->req_offset >> 16) & 0xFF;
+	data[3] = (fw->req_offset >> 8) & 0xFF;
+	data[4] = fw->req_offset & 0xFF;
+
+	fwsim_reply(fw, TF_FW_REQ_DATA, data, sizeof(data));
+}
+
+/**
+ * Decides which block to ask for next and asks for it,
+ * or sends END if every block has been received.
+ */
+static void fwsim_next(tf_fwsim *fw)
+{
+	unsigned block;
+
+	fw->seq++;
+
+	if (fw->opts.repeat && fw->since_repeat >= fw->opts.repeat && fw->next) {
+		/* Ask again for a block which has already been received */
+		block = fw->order[fwsim_random(fw) % fw->next];
+		fw->since_repeat = 0;
+		fw->stats.repeats++;
+	}
+	else if (fw->next < fw->nblocks) {
+		block = fw->order[fw->next++];
+		fw->since_repeat++;
+	}
+	else {
+		fw->state = FW_DONE;
+		fw->stats.complete = 1;
+		fwsim_reply(fw, TF_FW_END, 0, 0);
+		return;
+	}
+
+	fw->req_offset = block * fw->opts.block;
+	fw->req_len = fw->size - fw->req_offset;
+	if (fw->req_len > fw->opts.block) {
+		fw->req_len = fw->opts.block;
+	}
+	fwsim_request(fw);
+}
+
+/**
+ * Acts on the complete packet in fw->rx.
+ */
+static void fwsim_packet(tf_fwsim *fw)
+{
+	const __u8 *p = fw->rx;
+	unsigned datalen = get_u16(p + 6);
+
+	fw->stats.packets++;
+
+	if (fwsim_checksum(p + 4, datalen + 4) != p[FW_HEAD_SIZE + datalen]) {
+		fw->stats.checksum_errors++;
+		if (fw->state == FW_LOADING) {
+			/* Ask for it again */
+			fwsim_request(fw);
+		}
+		return;
+	}
+
+	switch (p[5]) {
+		case TF_FW_PC_TO_STB:
+			fw->state = FW_LOADING;
+			fw->next = 0;
+			fw->since_repeat = 0;
+			fw->seq = 0;
+			fwsim_reply(fw, TF_FW_ID, 0, 0);
+			fwsim_next(fw);
+			break;
+
+		case TF_FW_DATA:
+			if (fw->state != FW_LOADING || p[4] != fw->seq || datalen != fw->req_len) {
+				fw->stats.seq_errors++;
+				if (fw->state == FW_LOADING) {
+					fwsim_request(fw);
+				}
+				break;
+			}
+			memcpy(fw->image + fw->req_offset, p + FW_HEAD_SIZE, datalen);
+			fwsim_next(fw);
+			break;
+
+		case TF_FW_REBOOT:
+			fw->stats.rebooted = 1;
+			break;
+	}
+}
+
+static ssize_t tf_fwsim_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	tf_fwsim *fw = (tf_fwsim *)t;
+	const __u8 *b = buf;
+	size_t n;
+
+	fw->stats.transfers++;
+	fw->stats.bytes += len;
+
+	if (fw->rx_len == 0 && (len < 4 || memcmp(b, "ToFi", 4) != 0)) {
+		/* Padding left over from the last packet */
+		return len;
+	}
+
+	/* Packets larger than a single transfer arrive in pieces */
+	n = FW_PACKET_SIZE(MAX_DATA_SIZE) - fw->rx_len;
+	memcpy(fw->rx + fw->rx_len, b, len < n ? len : n);
+	fw->rx_len += len < n ? len : n;
+
+	if (fw->rx_len >= FW_HEAD_SIZE) {
+		size_t need = FW_PACKET_SIZE(get_u16(fw->rx + 6));
+
+		if (need > FW_PACKET_SIZE(MAX_DATA_SIZE)) {
+			fw->stats.checksum_errors++;
+			fw->rx_len = 0;
+		}
+		else if (fw->rx_len >= need) {
+			/* Anything else in this transfer is padding */
+			fwsim_packet(fw);
+			fw->rx_len = 0;
+		}
+	}
+
+	return len;
+}
+
+static ssize_t tf_fwsim_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	tf_fwsim *fw = (tf_fwsim *)t;
+	const __u8 *p;
+	size_t len;
+
+	if (data) {
+		*data = buf;
+	}
+	if (fw->reply_count == 0) {
+		return 0;
+	}
+
+	p = fw->replies[fw->reply_head];
+	fw->reply_head = (fw->reply_head + 1) % FW_MAX_REPLIES;
+	fw->reply_count--;
+
+	len = FW_PACKET_SIZE(get_u16(p + 6));
+	if (len > size) {
+		len = size;
+	}
+	memcpy(buf, p, len);
+
+	return len;
+}
+
+static int tf_fwsim_cancel(tf_transport *t)
+{
+	return 0;
+}
+
+static void tf_fwsim_close(tf_transport *t)
+{
+	tf_fwsim *fw = (tf_fwsim *)t;
+
+	free(fw->image);
+	free(fw->order);
+	free(fw->rx);
+	free(fw);
+}
+
+tf_transport *tf_transport_fwsim(size_t size, const tf_fwsim_options *opts)
+{
+	tf_fwsim *fw;
+	unsigned i;
+
+	if (size > FW_MAX_IMAGE) {
+		return 0;
+	}
+	fw = calloc(1, sizeof(*fw));
+	if (!fw) {
+		return 0;
+	}
+	if (opts) {
+		fw->opts = *opts;
+	}
+	if (fw->opts.block == 0 || fw->opts.block > MAX_DATA_SIZE) {
+		fw->opts.block = MAX_DATA_SIZE;
+	}
+	fw->rand = fw->opts.seed;
+	fw->size = size;
+	fw->nblocks = (size + fw->opts.block - 1) / fw->opts.block;
+	fw->image = calloc(1, size ? size : 1);
+	fw->order = malloc((fw->nblocks + 1) * sizeof(*fw->order));
+	fw->rx = malloc(FW_PACKET_SIZE(MAX_DATA_SIZE));
+
+	if (!fw->image || !fw->order || !fw->rx) {
+		tf_fwsim_close(&fw->t);
+		return 0;
+	}
+
+	for (i = 0; i < fw->nblocks; i++) {
+		fw->order[i] = i;
+	}
+	if (fw->opts.shuffle) {
+		for (i = fw->nblocks; i > 1; i--) {
+			unsigned j = fwsim_random(fw) % i;
+			unsigned tmp = fw->order[i - 1];
+
+			fw->order[i - 1] = fw->order[j];
+			fw->order[j] = tmp;
+		}
+	}
+
+	fw->t.send = tf_fwsim_send;
+	fw->t.recv = tf_fwsim_recv;
+	fw->t.cancel = tf_fwsim_cancel;
+	fw->t.close = tf_fwsim_close;
+	fw->state = FW_IDLE;
+
+	return &fw->t;
+}
+
+const __u8 *tf_fwsim_image(tf_transport *t)
+{
+	return ((tf_fwsim *)t)->image;
+}
+
+void tf_fwsim_get_stats(tf_transport *t, tf_fwsim_stats *stats)
+{
+	*stats = ((tf_fwsim *)t)->stats;
+}
@@ -0,0 +1,76 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_FWSIM_H
+#define TF_FWSIM_H
+
+/* An emulation of the "ToFi" bootloader, for testing tf_fwio.c without hardware */
+
+#include "tf_transport.h"
+#include "tf_types.h"
+
+typedef struct {
+	unsigned block;		/* Size of each requested block. 0 for MAX_DATA_SIZE */
+	int shuffle;		/* If set, request the blocks in a pseudo-random order */
+	int repeat;			/* Request a block again after every 'repeat' blocks. 0 for never */
+	unsigned seed;		/* Seed for the order of blocks and repeats */
+} tf_fwsim_options;
+
+typedef struct {
+	int packets;			/* Number of complete packets received */
+	int transfers;			/* Number of USB transfers (send calls) received */
+	__u64 bytes;			/* Number of bytes received, including headers and padding */
+	int checksum_errors;	/* Packets with a bad checksum or header */
+	int seq_errors;			/* DATA packets which didn't match the request */
+	int repeats;			/* Blocks requested more than once */
+	int complete;			/* Set once every block has been received and END sent */
+	int rebooted;			/* Set once REBOOT has been received */
+} tf_fwsim_stats;
+
+/**
+ * Creates a transport which emulates the bootloader receiving a
+ * firmware image of 'size' bytes.
+ *
+ * After PC_TO_STB the emulator replies with ID, then requests the image
+ * with REQ_DATA, one block at a time, and finally sends END.
+ * Each DATA packet may arrive in several transfers and is checked against
+ * its checksum and the request. A bad packet is requested again.
+ *
+ * 'opts' may be 0 for sequential blocks of MAX_DATA_SIZE.
+ * Returns 0 if no memory is available or the image is too big
+ * for the 24-bit offset.
+ */
+tf_transport *tf_transport_fwsim(size_t size, const tf_fwsim_options *opts);
+
+/**
+ * Returns the image received so far by a transport
+ * created by tf_transport_fwsim().
+ */
+const __u8 *tf_fwsim_image(tf_transport *t);
+
+/**
+ * Fills in the statistics for a transport created by tf_transport_fwsim().
+ */
+void tf_fwsim_get_stats(tf_transport *t, tf_fwsim_stats *stats);
+
+#endif
@@ -23,17 +23,18 @@
   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 */
-#include "usb_io.h"
-
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include "tf_io.h"
+#include "tf_proto.h"
 #include "tf_bytes.h"
 #include "crc16.h"
 #include "mjd.h"
+#include "tf_cache.h"
 
 /*#define DEBUG*/
 /*#define DEBUG_DUMP*/
@@ -44,71 +45,6 @@
 #define DEBUG_LOG(A...)
 #endif
 
-/* The maximum packet size used by the Toppy. This happens to be an
-   odd number, which could cause issues when the Topfield specific
-   byte swapping is applied. It's best to ensure that transmitted
-   packets contain an even number of bytes that is smaller than this
-   value.
-*/
-#define MAXIMUM_PACKET_SIZE 0xFFFFL
-
-/* The size of every packet header. */
-#define PACKET_HEAD_SIZE 8
-
-/* Format of a Topfield protocol packet */
-typedef struct
-{
-	__u16 length;
-	__u16 crc;
-	__u32 cmd;
-	__u8 data[MAXIMUM_PACKET_SIZE - PACKET_HEAD_SIZE];
-	__u8 dummy;	/* extra dummy byte sometimes gets sent for padding */
-} __attribute__ ((packed)) tf_packet_t;
-
-/* Possible values for tf_typefile_t->filetype */
-#define TYPE_DIR  1
-#define TYPE_FILE 2
-
-/* Topfield file descriptor data structure. */
-typedef struct
-{
-	struct tf_datetime stamp;
-	__u8 filetype;
-	__u64 size;
-	__u8 name[95];
-	__u8 unused;
-	__u32 attrib;
-} __attribute__ ((packed)) tf_typefile_t;
-
-/* Topfield command codes */
-#define TF_MSG_FAIL                  0x0001
-#define TF_MSG_SUCCESS               0x0002
-#define TF_MSG_CANCEL                0x0003
-
-#define TF_MSG_READY                 0x0100
-#define TF_MSG_RESET                 0x0101
-#define TF_MSG_TURBO                 0x0102
-
-#define TF_MSG_HDD_SIZE              0x1000
-#define TF_MSG_HDD_SIZE_RESULT       0x1001
-
-#define TF_MSG_HDD_DIR               0x1002
-#define TF_MSG_HDD_DIRENT            0x1003
-#define TF_MSG_HDD_DIREND            0x1004
-
-#define TF_MSG_HDD_DELETE            0x1005
-#define TF_MSG_HDD_RENAME            0x1006
-#define TF_MSG_HDD_MKDIR             0x1007
-
-#define TF_MSG_HDD_FILE_SEND         0x1008
-#define TF_MSG_HDD_FILE_START        0x1009
-#define TF_MSG_HDD_FILE_DATA         0x100A
-#define TF_MSG_HDD_FILE_END          0x100B
-
-/* Direction for TF_MSG_HDD_FILE_SEND */
-#define DIR_PUT 0
-#define DIR_GET 1
-
 static const char *tf_command_name(long cmd);
 static void print_packet(FILE *fh, const char *prefix, int trace_level, tf_packet_t *packet);
 
@@ -155,17 +91,25 @@ static void tf_req_done(tf_handle *tf, tf_packet_t *req)
 
 	put_u16(&req->length, len);
 
-	put_u16(&req->crc, crc16_ansi(0, &req->cmd, len - 4));
-
-	print_packet(tf->tracefh, ">>", tf->trace_level, req);
-
 	if (len % 2 == 1) {
 		/* If the packet size would be odd, padd it with an extra byte */
 		pad = 1;
 		((unsigned char *)req)[len] = 0;
 	}
 
-	byte_swap(req, len + pad);
+	if (tf->trace_level > 0) {
+		/* The trace shows the packet before it is swapped */
+		put_u16(&req->crc, crc16_ansi(0, &req->cmd, len - 4));
+
+		print_packet(tf->tracefh, ">>", tf->trace_level, req);
+
+		byte_swap(req, len + pad);
+	}
+	else {
+		/* Calculate the CRC and swap in one pass */
+		put_u16(&req->crc, crc16_ansi_swab(0, &req->cmd, len - 4));
+		byte_swap(req, 4);
+	}
 }
 
 static void tf_req_put8(tf_packet_t *req, __u8 value)
@@ -250,7 +194,7 @@ static void tf_req_putfilename(tf_packet_t *req, const char *str, int addlength)
  */
 static int tf_send(tf_handle *tf, const tf_packet_t *req)
 {
-	if (tf->dev) {
+	if (tf->transport) {
 		int len = get_u16_raw(&req->length);
 		int pad = 0;
 		if (len % 64 == 0) {
@@ -270,11 +214,11 @@ static int tf_send(tf_handle *tf, const tf_packet_t *req)
 			/* Pad with zero bytes for safety */
 			/*memset(((unsigned char *)req->data) + len, 0, pad);*/
 		}
-		DEBUG_LOG("usb_bulk_write(len=%d)", len);
+		DEBUG_LOG("transport send(len=%d)", len);
 #ifdef DEBUG_DUMP
 		dump_hex_buf(tf->tracefh, (void *)req, len);
 #endif
-		int ret = usb_bulk_write(tf->dev, 0x01, (void *)req, len, tf->timeout);
+		int ret = tf->transport->send(tf->transport, req, len, tf->timeout);
 
 		tf->error = (ret == len) ? TF_ERR_NONE : TF_ERR_IO;
 	}
@@ -285,22 +229,41 @@ static int tf_send(tf_handle *tf, const tf_packet_t *req)
 	return tf->error;
 }
 
-static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
+/**
+ * Turns read-ahead on the reply endpoint on or off.
+ * While a get is in progress, several reads are kept in flight so that
+ * the next FILE_DATA packet is already arriving while the caller is
+ * handling the current one.
+ */
+static void tf_read_ahead(tf_handle *tf, int on)
 {
-	int ret;
-
-	tf->error = 0;
+	tf_transport *t = tf->transport;
 
-	if (!tf->dev) {
-		tf->error = TF_ERR_NOCONN;
-		return tf->error;
+	if (!t) {
+		return;
+	}
+	if (on && tf->read_queue > 0) {
+		if (t->read_ahead && t->read_ahead(t, tf->read_queue) != 0) {
+			DEBUG_LOG("read_ahead() failed, using synchronous reads");
+		}
+	}
+	else {
+		t->cancel(t);
 	}
+}
 
-	ret = usb_bulk_read(tf->dev, 0x82, (void *)reply, sizeof(*reply), tf->timeout);
+/**
+ * Checks a packet which has just been received into 'reply'.
+ * 'ret' is the number of bytes received.
+ * The packet is byte swapped in place.
+ */
+static int tf_check_response(tf_handle *tf, tf_packet_t *reply, int ret)
+{
+	tf->error = 0;
 
 	if (ret < PACKET_HEAD_SIZE) {
 		if (ret >= 0) {
-			DEBUG_LOG("usb_bulk_read() returned ret=%d < 8", ret);
+			DEBUG_LOG("recv() returned ret=%d < 8", ret);
 		}
 		tf->error = TF_ERR_IO;
 	}
@@ -308,20 +271,35 @@ static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
 		__u16 len = get_u16_raw(&reply->length);
 
 		if (ret < len) {
-			DEBUG_LOG("usb_bulk_read() returned ret=%d < len=%d", ret, len);
+			DEBUG_LOG("recv() returned ret=%d < len=%d", ret, len);
+			tf->error = TF_ERR_IO;
+		}
+		else if (len < PACKET_HEAD_SIZE) {
+			DEBUG_LOG("recv() returned len=%d < 8", len);
 			tf->error = TF_ERR_IO;
 		}
 		else {
-			/* Note: we need to byte swap an extra byte if odd */
-			byte_swap(reply, len + (len % 2));
-
-			print_packet(tf->tracefh, "<<", tf->trace_level, reply);
+			if (ret == len && len % 2) {
+				/* The buffer isn't cleared before reading, so make
+				 * sure the padding byte is well defined
+				 */
+				((__u8 *)reply)[len] = 0;
+			}
 
-			if (!tf->nocrc) {
+			if (tf->nocrc) {
+				/* Note: we need to byte swap an extra byte if odd */
+				byte_swap(reply, len + (len % 2));
+			}
+			else {
 				__u16 crc;
 				__u16 calc_crc;
+
+				/* Swap and calculate the CRC in one pass.
+				 * If odd, this swaps the extra byte too
+				 */
+				byte_swap(reply, 4);
 				crc = get_u16(&reply->crc);
-				calc_crc = crc16_ansi(0, &(reply->cmd), len - 4);
+				calc_crc = crc16_ansi_unswab(0, &(reply->cmd), len - 4);
 
 				if (crc != calc_crc) {
 					DEBUG_LOG("reply crc=%04X != calc crc=%04X", crc, calc_crc);
@@ -329,6 +307,8 @@ static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
 				}
 			}
 
+			print_packet(tf->tracefh, "<<", tf->trace_level, reply);
+
 			/* Make it easier to read */
 			reply->length = len;
 			reply->cmd = get_u32(&reply->cmd);
@@ -337,6 +317,51 @@ static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
 	return tf->error;
 }
 
+/**
+ * Receives a packet into 'buf' and checks it.
+ *
+ * If 'reply' is not NULL, copying is avoided where the transport can:
+ * '*reply' is set to point to the packet in place in its read buffer
+ * (or else to 'buf'). Either way, the packet is valid until the next
+ * response is read.
+ *
+ * A negative timeout doesn't wait, and TF_ERR_AGAIN is returned
+ * if nothing has arrived.
+ */
+static int get_response(tf_handle *tf, void *buf, tf_packet_t **reply, int timeout)
+{
+	int ret;
+
+	tf->error = 0;
+
+	if (!tf->transport) {
+		tf->error = TF_ERR_NOCONN;
+		return tf->error;
+	}
+
+	ret = tf->transport->recv(tf->transport, buf, sizeof(tf_packet_t), (void **)reply, timeout);
+	if (ret == 0 && timeout < 0) {
+		tf->error = TF_ERR_AGAIN;
+		return tf->error;
+	}
+
+	return tf_check_response(tf, reply ? *reply : buf, ret);
+}
+
+static int tf_get_response(tf_handle *tf, tf_packet_t *reply)
+{
+	return get_response(tf, reply, NULL, tf->timeout);
+}
+
+/**
+ * The timeout for the next packet of a get. In non-blocking
+ * mode this is -1, so long as the transport can be polled.
+ */
+static int get_timeout(tf_handle *tf)
+{
+	return tf->nonblock && tf->transport && tf->transport->pollfds ? -1 : tf->timeout;
+}
+
 /**
  * Send the command and wait for a SUCCESS response.
  * Returns 0 if OK.
@@ -348,14 +373,14 @@ static int tf_cmd(tf_handle *tf, tf_packet_t *req)
 {
 	int ret = tf_send(tf, req);
 	if (ret == 0) {
-		tf_packet_t reply;
-		ret = tf_get_response(tf, &reply);
+		tf_packet_t *reply = tf->reply;
+		ret = tf_get_response(tf, reply);
 		if (ret == 0) {
-			if (reply.cmd == TF_MSG_FAIL) {
-				ret = tf->error = -get_u32(reply.data);
+			if (reply->cmd == TF_MSG_FAIL) {
+				ret = tf->error = -get_u32(reply->data);
 			}
-			else if (reply.cmd != TF_MSG_SUCCESS) {
-				DEBUG_LOG("tf_cmd(): reply.cmd = unexpected %d", reply.cmd);
+			else if (reply->cmd != TF_MSG_SUCCESS) {
+				DEBUG_LOG("tf_cmd(): reply.cmd = unexpected %d", reply->cmd);
 				ret = tf->error = TF_ERR_UNEXPECTED;
 			}
 		}
@@ -401,20 +426,20 @@ int tf_init(tf_handle *tf)
 
 int tf_cmd_size(tf_handle *tf, tf_size_result *result)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_SIZE);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_HDD_SIZE);
+	tf_req_done(tf, req);
 
-	ret = tf_send(tf, &req);
+	ret = tf_send(tf, req);
 	if (ret == 0) {
-		tf_packet_t reply;
+		tf_packet_t *reply = tf->reply;
 
-		ret = tf_get_response(tf, &reply);
+		ret = tf_get_response(tf, reply);
 		if (ret == 0) {
-			if (reply.cmd == TF_MSG_HDD_SIZE_RESULT) {
-				const tf_size_result *r = (const tf_size_result *)&reply.data;
+			if (reply->cmd == TF_MSG_HDD_SIZE_RESULT) {
+				const tf_size_result *r = (const tf_size_result *)reply->data;
 
 				result->totalk = get_u32(&r->totalk);
 				result->freek = get_u32(&r->freek);
@@ -429,110 +454,148 @@ int tf_cmd_size(tf_handle *tf, tf_size_result *result)
 
 int tf_cmd_cancel(tf_handle *tf)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 
-	tf_req_init(&req, TF_MSG_CANCEL);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_CANCEL);
+	tf_req_done(tf, req);
 
-	return tf_cmd(tf, &req);
+	return tf_cmd(tf, req);
 }
 
 int tf_cmd_ready(tf_handle *tf)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 
-	tf_req_init(&req, TF_MSG_READY);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_READY);
+	tf_req_done(tf, req);
 
-	return tf_cmd(tf, &req);
+	return tf_cmd(tf, req);
 }
 
 int tf_cmd_reset(tf_handle *tf)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 
-	tf_req_init(&req, TF_MSG_RESET);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_RESET);
+	tf_req_done(tf, req);
 
-	return tf_cmd(tf, &req);
+	return tf_cmd(tf, req);
 }
 
 int tf_cmd_turbo(tf_handle *tf, int on)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 
-	tf_req_init(&req, TF_MSG_TURBO);
-	tf_req_put32(&req, on);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_TURBO);
+	tf_req_put32(req, on);
+	tf_req_done(tf, req);
 
-	return tf_cmd(tf, &req);
+	return tf_cmd(tf, req);
 }
 
 int tf_cmd_delete(tf_handle *tf, const char *path)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 
-	tf_req_init(&req, TF_MSG_HDD_DELETE);
-	tf_req_putfilename(&req, path, 0);
-	tf_req_done(tf, &req);
+	int ret;
+
+	tf_req_init(req, TF_MSG_HDD_DELETE);
+	tf_req_putfilename(req, path, 0);
+	tf_req_done(tf, req);
 
-	return tf_cmd(tf, &req);
+	ret = tf_cmd(tf, req);
+	if (ret == 0) {
+		tf_cache_removed(tf, path);
+	}
+	return ret;
 }
 
 int tf_cmd_mkdir(tf_handle *tf, const char *path)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
+
+	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_MKDIR);
-	tf_req_putfilename(&req, path, 1);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_HDD_MKDIR);
+	tf_req_putfilename(req, path, 1);
+	tf_req_done(tf, req);
 
-	return tf_cmd(tf, &req);
+	ret = tf_cmd(tf, req);
+	if (ret == 0) {
+		tf_cache_changed(tf, path);
+	}
+	return ret;
 }
 
 int tf_cmd_rename(tf_handle *tf, const char *src, const char *dest)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
+	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_RENAME);
-	tf_req_putfilename(&req, src, 1);
-	tf_req_putfilename(&req, dest, 1);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_HDD_RENAME);
+	tf_req_putfilename(req, src, 1);
+	tf_req_putfilename(req, dest, 1);
+	tf_req_done(tf, req);
 
-	return tf_cmd(tf, &req);
+	ret = tf_cmd(tf, req);
+	if (ret == 0) {
+		tf_cache_renamed(tf, src, dest);
+	}
+	return ret;
 }
 
-static int unpack_dirent(tf_dirent *d, const tf_typefile_t *typefile)
+/**
+ * Unpacks everything but the time stamp, which is
+ * converted separately so that whole batches can be done at once.
+ */
+static void unpack_dirent_fields(tf_dirent *d, const tf_typefile_t *typefile)
 {
-	d->stamp = tfdt_to_time(&typefile->stamp);
 	d->type = (typefile->filetype == TYPE_DIR) ? 'd' : 'f';
 	d->size = get_u64(&typefile->size);
 	strcpy(d->name, (char *)typefile->name);
 	d->attrib = get_u16(&typefile->attrib);
+}
+
+static int unpack_dirent(tf_dirent *d, const tf_typefile_t *typefile)
+{
+	d->stamp = tfdt_to_time(&typefile->stamp);
+	unpack_dirent_fields(d, typefile);
 
 	return 0;
 }
 
-static int get_dirents(tf_handle *tf, tf_dir_entries *result)
+/**
+ * Receives the next DIRENT packet of a listing into tf->reply.
+ * Returns 0 if OK, TF_ERR_DONE at the end of the listing, or < 0 on error.
+ */
+static int get_dir_packet(tf_handle *tf)
 {
-	tf_packet_t reply;
+	tf_packet_t *reply = tf->reply;
 
-	int ret = tf_get_response(tf, &reply);
+	int ret = tf_get_response(tf, reply);
 	if (ret == 0) {
-		if (reply.cmd == TF_MSG_HDD_DIRENT) {
-			/* Unpack each entry into the array */
-			const tf_typefile_t *typefile = (const tf_typefile_t *)reply.data;
+		if (reply->cmd == TF_MSG_HDD_DIRENT) {
+			tf_typefile_t *typefile = (tf_typefile_t *)reply->data;
+			int count = (reply->length - PACKET_HEAD_SIZE) / sizeof(tf_typefile_t);
 			int i;
 
-			result->count = (reply.length - PACKET_HEAD_SIZE) / sizeof(tf_typefile_t);
+			/* Ask for the next batch straight away, so the device
+			 * fetches it while we unpack this one
+			 */
+			if (tf->dir_pipeline && tf_send_success(tf) == 0) {
+				tf->pending = 1;
+			}
 
-			for (i = 0; i < result->count; i++) {
-				unpack_dirent(&result->entry[i], &typefile[i]);
+			/* Make sure that names can be used in place */
+			for (i = 0; i < count; i++) {
+				typefile[i].name[sizeof(typefile[i].name) - 1] = 0;
 			}
+			tf_cache_fill_add(tf, typefile, count);
 		}
-		else if (reply.cmd == TF_MSG_HDD_DIREND) {
+		else if (reply->cmd == TF_MSG_HDD_DIREND) {
 			/* No more files */
 			tf_send_success(tf);
+			tf_cache_fill_end(tf, 1);
 
 			ret = TF_ERR_DONE;
 		}
@@ -540,6 +603,39 @@ static int get_dirents(tf_handle *tf, tf_dir_entries *result)
 			ret = TF_ERR_UNEXPECTED;
 		}
 	}
+	if (ret < 0) {
+		tf_cache_fill_end(tf, 0);
+	}
+	return ret;
+}
+
+/**
+ * Returns the number of entries in the DIRENT packet in tf->reply.
+ */
+static int dir_packet_count(tf_handle *tf)
+{
+	tf_packet_t *reply = tf->reply;
+
+	return (reply->length - PACKET_HEAD_SIZE) / sizeof(tf_typefile_t);
+}
+
+static int get_dirents(tf_handle *tf, tf_dir_entries *result)
+{
+	int ret = get_dir_packet(tf);
+
+	if (ret == 0) {
+		/* Unpack each entry into the array */
+		const tf_typefile_t *typefile = (const tf_typefile_t *)((tf_packet_t *)tf->reply)->data;
+		int i;
+
+		result->count = dir_packet_count(tf);
+
+		for (i = 0; i < result->count; i++) {
+			unpack_dirent_fields(&result->entry[i], &typefile[i]);
+		}
+		tfdt_to_time_batch(&typefile->stamp, sizeof(*typefile),
+			&result->entry->stamp, sizeof(*result->entry), result->count);
+	}
 	return ret;
 }
 
@@ -548,14 +644,15 @@ static int get_dirents(tf_handle *tf, tf_dir_entries *result)
  */
 int tf_cmd_dir_first(tf_handle *tf, const char *path, tf_dir_entries *result)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_DIR);
-	tf_req_putfilename(&req, path, 0);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_HDD_DIR);
+	tf_req_putfilename(req, path, 0);
+	tf_req_done(tf, req);
 
-	ret = tf_send(tf, &req);
+	tf_cache_fill_begin(tf, path);
+	ret = tf_send(tf, req);
 
 	if (ret == 0) {
 		ret = get_dirents(tf, result);
@@ -565,7 +662,15 @@ int tf_cmd_dir_first(tf_handle *tf, const char *path, tf_dir_entries *result)
 
 int tf_cmd_dir_next(tf_handle *tf, tf_dir_entries *result)
 {
-	int ret = tf_send_success(tf);
+	int ret = 0;
+
+	/* The next batch may already have been asked for */
+	if (!tf->pending) {
+		ret = tf_send_success(tf);
+	}
+
+	tf->pending = 0;
+
 	if (ret == 0) {
 		ret = get_dirents(tf, result);
 	}
@@ -574,32 +679,213 @@ int tf_cmd_dir_next(tf_handle *tf, tf_dir_entries *result)
 
 int tf_cmd_dir_cancel(tf_handle *tf)
 {
+	/* The listing is incomplete, so it can't be remembered */
+	tf_cache_fill_end(tf, 0);
+
+	if (tf->pending) {
+		tf_packet_t *reply = tf->reply;
+
+		tf->pending = 0;
+
+		/* The next batch was already asked for, so collect it first.
+		 * If that was the end of the listing, there is nothing to cancel
+		 */
+		if (tf_get_response(tf, reply) == 0 && reply->cmd == TF_MSG_HDD_DIREND) {
+			return tf_send_success(tf);
+		}
+	}
+
 	/* Say we don't want any more results */
 	return tf_cmd_cancel(tf);
 }
 
-int tf_cmd_put(tf_handle *tf, const char *path, __u64 size, time_t stamp, __u64 offset)
+int tf_dir_open(tf_handle *tf, const char *path, tf_dir_iter *it)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_FILE_SEND);
-	tf_req_put8(&req, DIR_PUT);
-	tf_req_putfilename(&req, path, 1);
-	tf_req_put64(&req, offset);
-	tf_req_done(tf, &req);
+	it->tf = tf;
+	it->index = 0;
+	it->count = 0;
+	it->done = 1;
+	it->cached = tf_cache_find_dir(tf, path, &it->count);
+	if (it->cached) {
+		/* Nothing needs to be sent, or cancelled */
+		return 0;
+	}
 
-	ret = tf_send(tf, &req);
+	tf_req_init(req, TF_MSG_HDD_DIR);
+	tf_req_putfilename(req, path, 0);
+	tf_req_done(tf, req);
+
+	tf_cache_fill_begin(tf, path);
+	ret = tf_send(tf, req);
 
 	if (ret == 0) {
-		tf_packet_t reply;
+		ret = get_dir_packet(tf);
+		if (ret == 0) {
+			it->count = dir_packet_count(tf);
+			it->done = 0;
+		}
+		else if (ret == TF_ERR_DONE) {
+			/* An empty directory */
+			ret = 0;
+		}
+	}
+	return ret;
+}
+
+/* A view is just the entry in place in the received packet */
+struct tf_dirent_view {
+	tf_typefile_t typefile;
+};
+
+const char *tf_dirent_view_name(const tf_dirent_view *view)
+{
+	return (const char *)view->typefile.name;
+}
 
-		ret = tf_get_response(tf, &reply);
+char tf_dirent_view_type(const tf_dirent_view *view)
+{
+	return (view->typefile.filetype == TYPE_DIR) ? 'd' : 'f';
+}
+
+__u64 tf_dirent_view_size(const tf_dirent_view *view)
+{
+	return get_u64(&view->typefile.size);
+}
+
+time_t tf_dirent_view_stamp(const tf_dirent_view *view)
+{
+	return tfdt_to_time(&view->typefile.stamp);
+}
+
+__u32 tf_dirent_view_attrib(const tf_dirent_view *view)
+{
+	return get_u16(&view->typefile.attrib);
+}
+
+void tf_dirent_view_unpack(const tf_dirent_view *view, tf_dirent *dirent)
+{
+	unpack_dirent(dirent, &view->typefile);
+}
+
+int tf_dir_read_view(tf_dir_iter *it, const tf_dirent_view **view)
+{
+	tf_handle *tf = it->tf;
+
+	if (it->cached) {
+		if (it->index == it->count) {
+			return TF_ERR_DONE;
+		}
+		*view = (const tf_dirent_view *)&((const tf_typefile_t *)it->cached)[it->index++];
+		return 0;
+	}
+
+	while (it->index == it->count) {
+		int ret;
+
+		if (it->done) {
+			return TF_ERR_DONE;
+		}
+
+		/* This batch is used up, so get the next one */
+		if (!tf->pending) {
+			ret = tf_send_success(tf);
+		}
+		else {
+			ret = 0;
+		}
+		tf->pending = 0;
+
+		if (ret == 0) {
+			ret = get_dir_packet(tf);
+		}
+		if (ret != 0) {
+			it->done = 1;
+			it->index = it->count = 0;
+			return ret;
+		}
+		it->index = 0;
+		it->count = dir_packet_count(tf);
+	}
+
+	*view = (const tf_dirent_view *)&((const tf_typefile_t *)((tf_packet_t *)tf->reply)->data)[it->index++];
+
+	return 0;
+}
+
+int tf_dir_read(tf_dir_iter *it, tf_dirent *dirent)
+{
+	const tf_dirent_view *view;
+	int ret = tf_dir_read_view(it, &view);
+
+	if (ret == 0) {
+		unpack_dirent(dirent, &view->typefile);
+	}
+	return ret;
+}
+
+int tf_dir_close(tf_dir_iter *it)
+{
+	it->cached = 0;
+
+	if (it->done) {
+		return 0;
+	}
+	it->done = 1;
+	it->index = it->count = 0;
+
+	return tf_cmd_dir_cancel(it->tf);
+}
+
+int tf_dir_foreach(tf_handle *tf, const char *path, tf_dir_callback fn, void *arg)
+{
+	tf_dir_iter it;
+	tf_dirent dirent;
+	int ret;
+
+	ret = tf_dir_open(tf, path, &it);
+
+	while (ret == 0 && (ret = tf_dir_read(&it, &dirent)) == 0) {
+		int stop = fn(&dirent, arg);
+
+		if (stop) {
+			/* Return the callback's result rather than the cancel's */
+			tf_dir_close(&it);
+			return stop;
+		}
+	}
+	tf_dir_close(&it);
+
+	return ret == TF_ERR_DONE ? 0 : ret;
+}
+
+/**
+ * Sends FILE_SEND and FILE_START to begin a put.
+ */
+static int put_start(tf_handle *tf, const char *path, __u64 size, time_t stamp, __u64 offset)
+{
+	tf_packet_t *req = tf->req;
+	int ret;
+
+	tf_req_init(req, TF_MSG_HDD_FILE_SEND);
+	tf_req_put8(req, DIR_PUT);
+	tf_req_putfilename(req, path, 1);
+	tf_req_put64(req, offset);
+	tf_req_done(tf, req);
+
+	ret = tf_send(tf, req);
+
+	if (ret == 0) {
+		tf_packet_t *reply = tf->reply;
+
+		ret = tf_get_response(tf, reply);
 
 		if (ret == 0) {
 			/* Now we expect a SUCCESS response */
 
-			if (reply.cmd == TF_MSG_SUCCESS) {
+			if (reply->cmd == TF_MSG_SUCCESS) {
 				/* Good, now send a FILE_START */
 				tf_typefile_t typefile;
 
@@ -611,28 +897,28 @@ int tf_cmd_put(tf_handle *tf, const char *path, __u64 size, time_t stamp, __u64
 				typefile.unused = 0;
 				typefile.attrib = 0;
 
-				tf_req_init(&req, TF_MSG_HDD_FILE_START);
-				tf_req_putdata(&req, &typefile, sizeof(typefile));
-				tf_req_done(tf, &req);
+				tf_req_init(req, TF_MSG_HDD_FILE_START);
+				tf_req_putdata(req, &typefile, sizeof(typefile));
+				tf_req_done(tf, req);
 
-				ret = tf_send(tf, &req);
+				ret = tf_send(tf, req);
 
 				DEBUG_LOG("tf_send() file_start returned ret=%d", ret);
 
 				if (ret == 0) {
-					ret = tf_get_response(tf, &reply);
+					ret = tf_get_response(tf, reply);
 
 					DEBUG_LOG("tf_send() file_start get_response() returned ret=%d", ret);
 
-					if (ret == 0 && reply.cmd != TF_MSG_SUCCESS) {
+					if (ret == 0 && reply->cmd != TF_MSG_SUCCESS) {
 						ret = TF_ERR_UNEXPECTED;
 					}
 				}
 			}
-			else if (reply.cmd == TF_MSG_FAIL) {
+			else if (reply->cmd == TF_MSG_FAIL) {
 				/* REVISIT: Should this be something else? */
 				/*ret = TF_ERR_DONE;*/
-				ret = -get_u32(reply.data);
+				ret = -get_u32(reply->data);
 			}
 			else {
 				ret = TF_ERR_UNEXPECTED;
@@ -649,58 +935,285 @@ int tf_cmd_put(tf_handle *tf, const char *path, __u64 size, time_t stamp, __u64
 	return ret;
 }
 
-int tf_cmd_put_data(tf_handle *tf, __u64 offset, void *buffer, size_t len)
+/* The largest put window. More than this gains nothing.
+ * Each packet in the window needs 64k, so low memory builds keep it small.
+ */
+#ifdef TF_LOWMEM
+#define MAX_PUT_WINDOW 4
+#else
+#define MAX_PUT_WINDOW 64
+#endif
+
+/**
+ * The state of a windowed put.
+ * Every packet which has been sent but not acknowledged is kept so that
+ * it can be sent again if the device can't cope with the window.
+ * The packets follow the state, each on a page boundary.
+ */
+struct tf_put_window {
+	char path[256];
+	__u64 size;
+	time_t stamp;
+	int window;
+	int head;				/* The oldest unacknowledged packet */
+	int outstanding;		/* Number of unacknowledged packets */
+	__u64 offsets[MAX_PUT_WINDOW];	/* The file offset of each packet */
+};
+
+#define PUT_WINDOW_HEAD_SIZE 4096
+
+static tf_packet_t *put_window_packet(struct tf_put_window *pw, int i)
+{
+	return (tf_packet_t *)((char *)pw + PUT_WINDOW_HEAD_SIZE + (size_t)(i % pw->window) * TF_PACKET_BUF_SIZE);
+}
+
+static void put_window_free(tf_handle *tf)
+{
+	free(tf->put);
+	tf->put = 0;
+}
+
+int tf_cmd_put(tf_handle *tf, const char *path, __u64 size, time_t stamp, __u64 offset)
+{
+	int ret;
+
+	put_window_free(tf);
+
+	/* Even a put which fails may have created or truncated the file.
+	 * Nothing can be listed until the put is done or cancelled, so
+	 * there is no need to wait until then.
+	 */
+	tf_cache_changed(tf, path);
+
+	ret = put_start(tf, path, size, stamp, offset);
+
+	if (ret == 0 && tf->put_window > 1 && strlen(path) < sizeof(tf->put->path)) {
+		struct tf_put_window *pw;
+		int window = tf->put_window < MAX_PUT_WINDOW ? tf->put_window : MAX_PUT_WINDOW;
+
+		if (posix_memalign((void **)&pw, PUT_WINDOW_HEAD_SIZE, PUT_WINDOW_HEAD_SIZE + window * TF_PACKET_BUF_SIZE) == 0) {
+			strcpy(pw->path, path);
+			pw->size = size;
+			pw->stamp = stamp;
+			pw->window = window;
+			pw->head = 0;
+			pw->outstanding = 0;
+			tf->put = pw;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Waits for the SUCCESS which acknowledges a FILE_DATA packet.
+ * Returns 0 if OK, the device's error if it sent FAIL,
+ * TF_ERR_UNEXPECTED for any other packet or < 0 if nothing usable came.
+ */
+static int put_data_response(tf_handle *tf)
 {
-	tf_packet_t req;
+	tf_packet_t *reply = tf->reply;
 	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_FILE_DATA);
-	tf_req_put64(&req, offset);
-	tf_req_putdata(&req, buffer, len);
-	tf_req_done(tf, &req);
+	/* REVISIT: Use a longer timeout for puts */
+	int timeout = tf->timeout;
+	tf->timeout = timeout * 2;
+
+	ret = tf_get_response(tf, reply);
+
+	tf->timeout = timeout;
 
-	ret = tf_send(tf, &req);
 	if (ret == 0) {
-		tf_packet_t reply;
+		/* Now we expect a SUCCESS response */
+		if (reply->cmd == TF_MSG_FAIL) {
+			ret = -get_u32(reply->data);
+		}
+		else if (reply->cmd != TF_MSG_SUCCESS) {
+			ret = TF_ERR_UNEXPECTED;
+		}
+	}
+	else {
+		DEBUG_LOG("tf_cmd_put_data() get_response() failed, ret=%d", ret);
+	}
+	return ret;
+}
 
-		/* REVISIT: Use a longer timeout for puts */
-		int timeout = tf->timeout;
-		tf->timeout = timeout * 2;
+/**
+ * Collects any replies still on the way for the packets after the oldest,
+ * so that the next reply is to the next command.
+ * Stops at the first which doesn't come within the usual timeout.
+ */
+static void put_window_drain(tf_handle *tf, struct tf_put_window *pw)
+{
+	int i;
+
+	for (i = 1; i < pw->outstanding; i++) {
+		if (tf_get_response(tf, tf->reply) != 0) {
+			break;
+		}
+	}
+}
+
+/**
+ * The device didn't acknowledge a packet while several were outstanding,
+ * so assume that it can't cope and go back to one at a time.
+ * The put is restarted at the oldest unacknowledged packet and the
+ * outstanding packets are sent again.
+ */
+static int put_window_fallback(tf_handle *tf)
+{
+	struct tf_put_window *pw = tf->put;
+	int ret;
+	int i;
+
+	DEBUG_LOG("put window of %d failed, falling back to 1", pw->window);
+	tf->put_window = 1;
+	tf->put = 0;
+
+	put_window_drain(tf, pw);
 
-		ret = tf_get_response(tf, &reply);
+	tf_cmd_cancel(tf);
 
-		tf->timeout = timeout;
+	ret = put_start(tf, pw->path, pw->size, pw->stamp, pw->offsets[pw->head]);
 
+	for (i = 0; ret == 0 && i < pw->outstanding; i++) {
+		ret = tf_send(tf, put_window_packet(pw, pw->head + i));
 		if (ret == 0) {
-			/* Now we expect a SUCCESS response */
-			if (reply.cmd != TF_MSG_SUCCESS) {
-				ret = TF_ERR_UNEXPECTED;
-			}
+			ret = put_data_response(tf);
 		}
-		else {
-			DEBUG_LOG("tf_cmd_put_data() get_response() failed, ret=%d", ret);
+	}
+
+	free(pw);
+
+	return ret;
+}
+
+/**
+ * Waits for the oldest outstanding packet to be acknowledged.
+ * Only a missing or out of order acknowledgement means the window is
+ * too much for the device. Anything it reports with FAIL, such as a full
+ * disk, is a real error and is returned as is.
+ */
+static int put_window_ack(tf_handle *tf)
+{
+	struct tf_put_window *pw = tf->put;
+	int ret = put_data_response(tf);
+
+	if (ret == TF_ERR_IO || ret == TF_ERR_UNEXPECTED) {
+		return put_window_fallback(tf);
+	}
+	if (ret != 0) {
+		put_window_drain(tf, pw);
+		put_window_free(tf);
+		return ret;
+	}
+	pw->head = (pw->head + 1) % pw->window;
+	pw->outstanding--;
+
+	return 0;
+}
+
+/**
+ * Returns the packet which the next FILE_DATA will be built in.
+ */
+static tf_packet_t *put_packet(tf_handle *tf)
+{
+	if (tf->put) {
+		return put_window_packet(tf->put, tf->put->head + tf->put->outstanding);
+	}
+	return (tf_packet_t *)tf->buf;
+}
+
+void *tf_cmd_put_buffer(tf_handle *tf, size_t *size)
+{
+	if (!tf->buf) {
+		return 0;
+	}
+	if (size) {
+		*size = MAX_PUT_SIZE;
+	}
+	/* Leave room for the header and the offset */
+	return put_packet(tf)->data + 8;
+}
+
+int tf_cmd_put_commit(tf_handle *tf, __u64 offset, size_t len)
+{
+	tf_packet_t *req = put_packet(tf);
+	__u16 plen = PACKET_HEAD_SIZE + 8 + len;
+	__u8 *p = (__u8 *)req;
+	int ret;
+
+	if (len > MAX_PUT_SIZE) {
+		return TF_ERR_BLKSIZE;
+	}
+
+	/* The data is already in place, so fill in the header around it.
+	 * Then the CRC and byte swap are done together in a single pass.
+	 */
+	put_u16(&req->length, plen);
+	put_u32(&req->cmd, TF_MSG_HDD_FILE_DATA);
+	put_u64(req->data, offset);
+	print_packet(tf->tracefh, ">>", tf->trace_level, req);
+	if (plen % 2) {
+		p[plen] = 0;
+	}
+	put_u16(&req->crc, crc16_ansi_swab(0, &req->cmd, plen - 4));
+	byte_swap(req, 4);
+
+	ret = tf_send(tf, req);
+	if (ret != 0) {
+		DEBUG_LOG("tf_cmd_put_data() failed to send, ret=%d", ret);
+	}
+	else if (tf->put) {
+		/* Don't wait for the acknowledgement until the window is full */
+		tf->put->offsets[(tf->put->head + tf->put->outstanding) % tf->put->window] = offset;
+		if (++tf->put->outstanding == tf->put->window) {
+			ret = put_window_ack(tf);
 		}
 	}
 	else {
-		DEBUG_LOG("tf_cmd_put_data() failed to send, ret=%d", ret);
+		ret = put_data_response(tf);
 	}
 	return ret;
 }
 
+int tf_cmd_put_data(tf_handle *tf, __u64 offset, void *buffer, size_t len)
+{
+	void *data = tf_cmd_put_buffer(tf, 0);
+
+	if (!data) {
+		return TF_ERR_NOCONN;
+	}
+	if (len > MAX_PUT_SIZE) {
+		return TF_ERR_BLKSIZE;
+	}
+	memcpy(data, buffer, len);
+
+	return tf_cmd_put_commit(tf, offset, len);
+}
+
 int tf_cmd_put_done(tf_handle *tf)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_FILE_END);
-	tf_req_done(tf, &req);
+	/* Wait for everything in the window to be acknowledged */
+	while (tf->put && tf->put->outstanding) {
+		if ((ret = put_window_ack(tf)) != 0) {
+			return ret;
+		}
+	}
+	put_window_free(tf);
 
-	ret = tf_send(tf, &req);
+	tf_req_init(req, TF_MSG_HDD_FILE_END);
+	tf_req_done(tf, req);
+
+	ret = tf_send(tf, req);
 	if (ret == 0) {
-		tf_packet_t reply;
+		tf_packet_t *reply = tf->reply;
 
-		ret = tf_get_response(tf, &reply);
-		if (ret == 0 && reply.cmd != TF_MSG_SUCCESS) {
+		ret = tf_get_response(tf, reply);
+		if (ret == 0 && reply->cmd != TF_MSG_SUCCESS) {
 			ret = TF_ERR_UNEXPECTED;
 		}
 		if (ret != 0) {
@@ -713,6 +1226,8 @@ int tf_cmd_put_done(tf_handle *tf)
 
 int tf_cmd_put_cancel(tf_handle *tf)
 {
+	put_window_free(tf);
+
 	/* It helps to send cancel twice */
 	tf_cmd_cancel(tf);
 	sleep(1);
@@ -720,40 +1235,44 @@ int tf_cmd_put_cancel(tf_handle *tf)
 	return tf_cmd_cancel(tf);
 }
 
-int tf_cmd_get(tf_handle *tf, const char *path, __u64 offset, tf_dirent *dirent)
+/**
+ * Sends FILE_SEND and waits for the HDD_FILE_START reply,
+ * which holds the details of the file.
+ */
+static int get_start(tf_handle *tf, const char *path, __u64 offset, tf_dirent *dirent)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 	int ret;
 
-	tf_req_init(&req, TF_MSG_HDD_FILE_SEND);
-	tf_req_put8(&req, DIR_GET);
-	tf_req_putfilename(&req, path, 1);
-	tf_req_put64(&req, offset);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_HDD_FILE_SEND);
+	tf_req_put8(req, DIR_GET);
+	tf_req_putfilename(req, path, 1);
+	tf_req_put64(req, offset);
+	tf_req_done(tf, req);
 
-	ret = tf_send(tf, &req);
+	ret = tf_send(tf, req);
 
 	if (ret == 0) {
-		tf_packet_t reply;
+		tf_packet_t *reply = tf->reply;
 
-		ret = tf_get_response(tf, &reply);
+		ret = tf_get_response(tf, reply);
 
 		if (ret == 0) {
 
-			/*printf("tf_cmd_get() got response %04X\n", reply.cmd);*/
+			/*printf("tf_cmd_get() got response %04X\n", reply->cmd);*/
 
 			/* Now we expect a HDD_FILE_START response */
 
-			if (reply.cmd == TF_MSG_HDD_FILE_START) {
+			if (reply->cmd == TF_MSG_HDD_FILE_START) {
 				/* Good, remember this info */
-				unpack_dirent(dirent, (const tf_typefile_t *)reply.data);
+				unpack_dirent(dirent, (const tf_typefile_t *)reply->data);
 				/*printf("tf_cmd_get() got start, returning 0\n");*/
 			}
-			else if (reply.cmd == TF_MSG_FAIL) {
+			else if (reply->cmd == TF_MSG_FAIL) {
 				/*printf("tf_cmd_get() got fail\n");*/
 				/* REVISIT: Should this be something else? */
 				/*ret = TF_ERR_DONE;*/
-				ret = -get_u32(reply.data);
+				ret = -get_u32(reply->data);
 			}
 			else {
 				ret = TF_ERR_UNEXPECTED;
@@ -764,6 +1283,89 @@ int tf_cmd_get(tf_handle *tf, const char *path, __u64 offset, tf_dirent *dirent)
 	return ret;
 }
 
+int tf_cmd_get(tf_handle *tf, const char *path, __u64 offset, tf_dirent *dirent)
+{
+	int ret = get_start(tf, path, offset, dirent);
+
+	if (ret == 0) {
+		/* The data packets will follow, so start reading ahead */
+		tf_read_ahead(tf, 1);
+	}
+	return ret;
+}
+
+int tf_cmd_get_probe(tf_handle *tf, const char *path, tf_dirent *dirent)
+{
+	int ret = get_start(tf, path, 0, dirent);
+
+	if (ret == 0) {
+		/* No data is sent until FILE_START is acknowledged,
+		 * so a single CANCEL ends the get
+		 */
+		ret = tf_cmd_cancel(tf);
+		if (ret == TF_ERR_UNEXPECTED) {
+			/* Something else was on its way. The SUCCESS should follow */
+			ret = tf_get_response(tf, tf->reply);
+			if (ret == 0 && ((tf_packet_t *)tf->reply)->cmd != TF_MSG_SUCCESS) {
+				ret = TF_ERR_UNEXPECTED;
+			}
+		}
+	}
+	else if (tf->error || ret == TF_ERR_UNEXPECTED) {
+		/* There was no proper answer, so the get may have started */
+		tf_cmd_cancel(tf);
+	}
+	return ret;
+}
+
+/**
+ * Handles a packet received during a get.
+ * If 'ack' is set, a SUCCESS is sent for a data packet straight away
+ * and the reply to it becomes pending.
+ */
+static int get_data(tf_handle *tf, tf_packet_t *reply, tf_buffer *buf, int ack)
+{
+	int ret;
+
+	if (reply->cmd == TF_MSG_HDD_FILE_END) {
+		DEBUG_LOG("tf_cmd_get_next() got EOF");
+
+		/* All done. */
+		tf_read_ahead(tf, 0);
+		tf_send_success(tf);
+
+		ret = TF_ERR_DONE;
+	}
+	else if (reply->cmd == TF_MSG_HDD_FILE_DATA) {
+		/* Send a success response right away so we don't hold
+		 * things up
+		 */
+		if (ack && tf_send_success(tf) == 0) {
+			tf->pending = 1;
+		}
+
+		__u64 off = get_u64(reply->data);
+		__u16 len = reply->length - (PACKET_HEAD_SIZE + 8);
+
+		buf->offset = off;
+		buf->size = len;
+		buf->data = &reply->data[8];
+
+		ret = 0;
+	}
+	else if (reply->cmd == TF_MSG_FAIL) {
+		/* Assume a CRC failure */
+		DEBUG_LOG("tf_cmd_get_next() got FAIL -- assuming I/O error");
+		ret = TF_ERR_IO;
+	}
+	else {
+		DEBUG_LOG("tf_cmd_get_next() got unexpected packet");
+		ret = TF_ERR_UNEXPECTED;
+	}
+
+	return ret;
+}
+
 int tf_cmd_get_next(tf_handle *tf, tf_buffer *buf)
 {
 	/* Send success and wait for the packet to come back */
@@ -776,46 +1378,19 @@ int tf_cmd_get_next(tf_handle *tf, tf_buffer *buf)
 	tf->pending = 0;
 
 	if (ret == 0) {
-		/* We use the buffer in the handle so we don't need to copy data more than once */
-		tf_packet_t *reply = (tf_packet_t *)tf->buf;
+		/* The packet is received, swapped and checked in place
+		 * so we don't need to copy data more than once
+		 */
+		tf_packet_t *reply;
 
-		ret = tf_get_response(tf, reply);
+		ret = get_response(tf, tf->buf, &reply, get_timeout(tf));
 
 		if (ret == 0) {
-			if (reply->cmd == TF_MSG_HDD_FILE_END) {
-				DEBUG_LOG("tf_cmd_get_next() got EOF");
-
-				/* All done. */
-				tf_send_success(tf);
-
-				ret = TF_ERR_DONE;
-			}
-			else if (reply->cmd == TF_MSG_HDD_FILE_DATA) {
-				/* Send a success response right away so we don't hold
-				 * things up
-				 */
-				if (tf_send_success(tf) == 0) {
-					tf->pending = 1;
-				}
-
-				__u64 off = get_u64(reply->data);
-				__u16 len = reply->length - (PACKET_HEAD_SIZE + 8);
-
-				buf->offset = off;
-				buf->size = len;
-				buf->data = &reply->data[8];
-
-				ret = 0;
-			}
-			else if (reply->cmd == TF_MSG_FAIL) {
-				/* Assume a CRC failure */
-				DEBUG_LOG("tf_cmd_get_next() got FAIL -- assuming I/O error");
-				ret = TF_ERR_IO;
-			}
-			else {
-				DEBUG_LOG("tf_cmd_get_next() got unexpected packet");
-				ret = TF_ERR_UNEXPECTED;
-			}
+			ret = get_data(tf, reply, buf, 1);
+		}
+		else if (ret == TF_ERR_AGAIN) {
+			/* Still on its way, so don't ask again next time */
+			tf->pending = 1;
 		}
 		else {
 			DEBUG_LOG("tf_cmd_get_next() failed to get response");
@@ -830,18 +1405,46 @@ int tf_cmd_get_next(tf_handle *tf, tf_buffer *buf)
 	return ret;
 }
 
+int tf_cmd_get_next_packet(tf_handle *tf, void *packet, tf_buffer *buf)
+{
+	int ret = 0;
+
+	if (!tf->pending) {
+		ret = tf_send_success(tf);
+	}
+
+	tf->pending = 0;
+
+	if (ret == 0) {
+		tf_packet_t *reply = packet;
+
+		ret = get_response(tf, reply, NULL, get_timeout(tf));
+
+		if (ret == 0) {
+			ret = get_data(tf, reply, buf, 0);
+		}
+		else if (ret == TF_ERR_AGAIN) {
+			tf->pending = 1;
+		}
+	}
+
+	tf->error = ret;
+
+	return ret;
+}
+
 int tf_cmd_get_cancel(tf_handle *tf)
 {
 	int i;
 	int ret = 0;
 
 	if (tf->pending) {
-		tf_packet_t reply;
+		tf_packet_t *reply = tf->reply;
 
 		tf->pending = 0;
 
 		/* Get and discard any pending response */
-		tf_get_response(tf, &reply);
+		tf_get_response(tf, reply);
 	}
 
 
@@ -849,7 +1452,7 @@ int tf_cmd_get_cancel(tf_handle *tf)
 	 * so give it a few tries!
 	 */
 	for (i = 0; i < 5; i++) {
-		tf_packet_t reply;
+		tf_packet_t *reply = tf->reply;
 
 		/* First send a FAIL */
 		tf_send_fail(tf, TF_ERR_CRC);
@@ -864,7 +1467,7 @@ int tf_cmd_get_cancel(tf_handle *tf)
 		 */
 		sleep(2);
 
-		ret = tf_get_response(tf, &reply);
+		ret = tf_get_response(tf, reply);
 		if (ret == 0) {
 			break;
 		}
@@ -874,9 +1477,21 @@ int tf_cmd_get_cancel(tf_handle *tf)
 		DEBUG_LOG("tf_cmd_get_cancel() failed after 5 attempts");
 	}
 
+	tf_read_ahead(tf, 0);
+
 	return ret;
 }
 
+int tf_pollfds(tf_handle *tf, struct pollfd *fds, int max)
+{
+	tf_transport *t = tf->transport;
+
+	if (!t || !t->pollfds) {
+		return -1;
+	}
+	return t->pollfds(t, fds, max);
+}
+
 /**
  * Returns a string describing the given error number.
  */
@@ -895,6 +1510,7 @@ const char *tf_strerror(int error)
 		case TF_ERR_UNEXPECTED: return "Unexpected response";
 		case TF_ERR_IO: return "I/O error";
 		case TF_ERR_NOCONN: return "Not connected";
+		case TF_ERR_AGAIN: return "Nothing received yet";
 		default: return "Unknown error";
 	}
 }
@@ -914,13 +1530,13 @@ int tf_send_success(tf_handle *tf)
 
 int tf_send_fail(tf_handle *tf, int reason)
 {
-	tf_packet_t req;
+	tf_packet_t *req = tf->req;
 
-	tf_req_init(&req, TF_MSG_FAIL);
-	tf_req_put32(&req, reason);
-	tf_req_done(tf, &req);
+	tf_req_init(req, TF_MSG_FAIL);
+	tf_req_put32(req, reason);
+	tf_req_done(tf, req);
 
-	return tf_send(tf, &req);
+	return tf_send(tf, req);
 }
 
 /**
@@ -26,6 +26,8 @@
 
 /* Provides an interface to the Topfield 5000PVR USB functionality */
 
+#include <poll.h>
+
 #include "tf_types.h"
 
 #include "tf_open.h"
@@ -106,6 +108,7 @@ typedef struct {
 #define	TF_ERR_UNEXPECTED  -100		/* Unexpected response packet */
 #define	TF_ERR_IO          -101		/* I/O error (e.g. short read) */
 #define	TF_ERR_NOCONN      -102		/* Not connected. topfield_open() did not succeed */
+#define	TF_ERR_AGAIN       -103		/* Nothing has arrived yet (tf->nonblock is set) */
 
 /**
  * These tf_cmd... functions are all synchronous.
@@ -193,6 +196,10 @@ int tf_cmd_dir_first(tf_handle *tf, const char *path, tf_dir_entries *result);
 /**
  * Continues an in-progress file list operation.
  * Otherwise identical to tf_cmd_dir_first()
+ *
+ * If tf->dir_pipeline is set, the next batch is requested as soon as each
+ * batch arrives, so no other command may be sent until the listing has
+ * finished or been cancelled.
  */
 int tf_cmd_dir_next(tf_handle *tf, tf_dir_entries *result);
 
@@ -202,6 +209,86 @@ int tf_cmd_dir_next(tf_handle *tf, tf_dir_entries *result);
  */
 int tf_cmd_dir_cancel(tf_handle *tf);
 
+/**
+ * State of a directory listing read with tf_dir_read().
+ * Entries are decoded one at a time straight from the DIRENT packet
+ * as it was received, so unlike tf_dir_entries this is tiny.
+ */
+typedef struct {
+	tf_handle *tf;
+	int index;		/* Next entry in the current packet */
+	int count;		/* Number of entries in the current packet */
+	int done;		/* Set once the listing has ended or failed */
+	const void *cached;	/* Entries of a listing from the cache (see tf_cache.h), or NULL */
+} tf_dir_iter;
+
+/**
+ * Begins listing the directory 'path', as tf_cmd_dir_first() does.
+ * If the handle has a cache and the directory is in it, the entries
+ * come from there instead of the device.
+ * Returns 0 if OK (even if the directory is empty) or < 0 on error.
+ *
+ * The listing must be finished with tf_dir_close(), and no other
+ * command may be sent until then.
+ */
+int tf_dir_open(tf_handle *tf, const char *path, tf_dir_iter *it);
+
+/**
+ * Stores the next entry of the listing in '*dirent'.
+ * Returns 0 if OK, TF_ERR_DONE if there are no more entries, or < 0 on error.
+ */
+int tf_dir_read(tf_dir_iter *it, tf_dirent *dirent);
+
+/**
+ * A read-only view of a directory entry, in place in the DIRENT packet
+ * as it was received. Each field is only decoded when it is asked for.
+ * A view is valid until the next tf_dir_read(), tf_dir_read_view()
+ * or tf_dir_close() on the listing.
+ */
+typedef struct tf_dirent_view tf_dirent_view;
+
+/**
+ * Sets '*view' to the next entry of the listing, without decoding it.
+ * Returns 0 if OK, TF_ERR_DONE if there are no more entries, or < 0 on error.
+ */
+int tf_dir_read_view(tf_dir_iter *it, const tf_dirent_view **view);
+
+/**
+ * Accessors for the fields of a view, which are the same as those of a
+ * tf_dirent. The name is null terminated and is not copied.
+ */
+const char *tf_dirent_view_name(const tf_dirent_view *view);
+char tf_dirent_view_type(const tf_dirent_view *view);
+__u64 tf_dirent_view_size(const tf_dirent_view *view);
+time_t tf_dirent_view_stamp(const tf_dirent_view *view);
+__u32 tf_dirent_view_attrib(const tf_dirent_view *view);
+
+/**
+ * Decodes every field of the view into '*dirent'.
+ */
+void tf_dirent_view_unpack(const tf_dirent_view *view, tf_dirent *dirent);
+
+/**
+ * Ends a listing begun with tf_dir_open(). If there may be more
+ * entries, the listing is cancelled.
+ * Returns 0 if OK or < 0 on error.
+ */
+int tf_dir_close(tf_dir_iter *it);
+
+/**
+ * Called by tf_dir_foreach() for each entry.
+ * Returns 0 to carry on, or any other value to stop.
+ */
+typedef int (*tf_dir_callback)(const tf_dirent *dirent, void *arg);
+
+/**
+ * Calls 'fn' for each entry in the directory 'path' until it returns
+ * non-zero, in which case the listing is cancelled.
+ * Returns 0 if every entry was seen, the value 'fn' returned if it
+ * stopped early, or TF_ERR_... < 0 on error.
+ */
+int tf_dir_foreach(tf_handle *tf, const char *path, tf_dir_callback fn, void *arg);
+
 /**
  * Begins a file get operation for the file specified by the given
  * full path name.
@@ -214,6 +301,16 @@ int tf_cmd_dir_cancel(tf_handle *tf);
  */
 int tf_cmd_get(tf_handle *tf, const char *path, __u64 offset, tf_dirent *dirent);
 
+/**
+ * Gets the details of the file 'path' the way tf_cmd_get() does,
+ * then cancels the get with a single CANCEL before any data is sent.
+ * Nothing is read ahead.
+ *
+ * Returns 0 if OK, or < 0 on error, including the device's FAIL code
+ * if it refused the get. No cancel is needed afterwards.
+ */
+int tf_cmd_get_probe(tf_handle *tf, const char *path, tf_dirent *dirent);
+
 /**
  * Gets the next buffer of data from an in-progress file get operation.
  * If there is more data to get, this operation returns 0 (TF_ERR_NONE).
@@ -221,9 +318,37 @@ int tf_cmd_get(tf_handle *tf, const char *path, __u64 offset, tf_dirent *dirent)
  * Note that this is the ONLY case where you need not call tf_cmd_get_cancel().
  * Any other result indicates that the operation has failed and tf_cmd_get_cancel()
  * must be called.
+ *
+ * If tf->nonblock is set and the packet hasn't arrived yet, this returns
+ * TF_ERR_AGAIN at once. Simply call it again once tf_pollfds() reports
+ * activity. This is not an error, so the get need not be cancelled.
  */
 int tf_cmd_get_next(tf_handle *tf, tf_buffer *buf);
 
+/**
+ * The size of the buffer needed by tf_cmd_get_next_packet()
+ */
+#define TF_PACKET_BUF_SIZE 0x10000
+
+/**
+ * Like tf_cmd_get_next(), but the packet is received into 'packet',
+ * which must be TF_PACKET_BUF_SIZE bytes, and buf->data points into it.
+ * The next packet is only requested by the next call, so the device
+ * is not asked for more data until the caller is ready for it.
+ */
+int tf_cmd_get_next_packet(tf_handle *tf, void *packet, tf_buffer *buf);
+
+/**
+ * So that a single thread can run gets from several devices at once
+ * with one poll() loop, tf->nonblock may be set once a get has started.
+ *
+ * Fills in up to 'max' entries of 'fds' with the descriptors to poll
+ * for the next packet of the get. Returns the number of entries needed,
+ * which may be more than 'max', or -1 if the transport can't be polled
+ * (in which case tf->nonblock has no effect).
+ */
+int tf_pollfds(tf_handle *tf, struct pollfd *fds, int max);
+
 /**
  * Cancel and in-progress or failed file get operation.
  */
@@ -251,6 +376,27 @@ int tf_cmd_put(tf_handle *tf, const char *path, __u64 size, time_t stamp, __u64
  */
 int tf_cmd_put_data(tf_handle *tf, __u64 offset, void *buffer, size_t len);
 
+/**
+ * Returns a buffer owned by the library which the next FILE_DATA packet
+ * will be sent from, so that the caller can fill it directly (e.g. with read())
+ * rather than having tf_cmd_put_data() copy the data.
+ * If 'size' is not NULL, the size of the buffer (MAX_PUT_SIZE) is stored there.
+ *
+ * The buffer is valid until the next tf_cmd_put_commit() or until the put ends.
+ * Returns NULL if not connected.
+ */
+void *tf_cmd_put_buffer(tf_handle *tf, size_t *size);
+
+/**
+ * Sends the first 'len' bytes of the buffer from tf_cmd_put_buffer()
+ * as the data at the given file offset.
+ * The header is built around the data, and the CRC and byte swap
+ * are done in a single pass over it.
+ *
+ * Returns as for tf_cmd_put_data().
+ */
+int tf_cmd_put_commit(tf_handle *tf, __u64 offset, size_t len);
+
 /**
  * Indicates that the file transfer is complete.
  */
@@ -32,11 +32,179 @@
 
 #include "usb_io.h"
 #include "tf_open.h"
+#include "tf_cache.h"
 #include "usbutil.h"
 
 #define TOPFIELD_VENDOR_ID 0x11DB
 #define TOPFIELD_5000PVRT_ID 0x1000
 
+/* The USB transport, which is what is normally used */
+typedef struct {
+	tf_transport t;
+	struct usb_dev_handle *dev;
+} tf_usb_transport;
+
+static ssize_t tf_usb_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	return usb_bulk_write(((tf_usb_transport *)t)->dev, 0x01, buf, len, timeout);
+}
+
+static ssize_t tf_usb_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	struct usb_dev_handle *dev = ((tf_usb_transport *)t)->dev;
+
+	if (data) {
+		if (dev->rq) {
+			/* Hand out the data in place in the read-ahead buffer */
+			return usb_read_queue_get(dev, 0x82, (__u8 **)data, size, timeout);
+		}
+		*data = buf;
+	}
+	return usb_bulk_read(dev, 0x82, buf, size, timeout);
+}
+
+static int tf_usb_read_ahead(tf_transport *t, int packets)
+{
+	/* Each packet may need several reads if the kernel limits their size */
+	int per_packet = (USB_MAX_TRANSFER + t->max_read - 1) / t->max_read;
+
+	return usb_read_queue_start(((tf_usb_transport *)t)->dev, 0x82, packets * per_packet, t->max_read);
+}
+
+static int tf_usb_cancel(tf_transport *t)
+{
+	usb_read_queue_stop(((tf_usb_transport *)t)->dev);
+	return 0;
+}
+
+static void tf_usb_close(tf_transport *t)
+{
+	close_usb_dev(((tf_usb_transport *)t)->dev);
+	free(t);
+}
+
+#ifdef USE_LIBUSB
+static int tf_usb_pollfds(tf_transport *t, struct pollfd *fds, int max)
+{
+	return usb_get_pollfds(fds, max);
+}
+#endif
+
+static void *tf_usb_alloc(tf_transport *t, size_t size)
+{
+	return usb_alloc_buffer(((tf_usb_transport *)t)->dev, size);
+}
+
+static void tf_usb_free(tf_transport *t, void *buf)
+{
+	usb_free_buffer(((tf_usb_transport *)t)->dev, buf);
+}
+
+static tf_transport *tf_transport_usb(struct usb_dev_handle *dev)
+{
+	tf_usb_transport *ut = calloc(1, sizeof(*ut));
+
+	if (!ut) {
+		return 0;
+	}
+	ut->t.send = tf_usb_send;
+	ut->t.recv = tf_usb_recv;
+	ut->t.cancel = tf_usb_cancel;
+	ut->t.close = tf_usb_close;
+	ut->t.read_ahead = tf_usb_read_ahead;
+	ut->t.alloc = tf_usb_alloc;
+	ut->t.free = tf_usb_free;
+#ifdef USE_LIBUSB
+	/* Only libusb can collect a read without waiting for it */
+	ut->t.pollfds = tf_usb_pollfds;
+#endif
+	ut->dev = dev;
+
+	/* Note what the kernel let us have, so it can be checked */
+	usb_get_limits(dev, &ut->t.max_read, &ut->t.max_write);
+
+	return &ut->t;
+}
+
+static void tf_handle_init(tf_handle *tf)
+{
+	memset(tf, 0, sizeof(*tf));
+	tf->timeout = TF_DEFAULT_TIMEOUT;
+	tf->read_queue = TF_DEFAULT_READ_QUEUE;
+	tf->put_window = TF_DEFAULT_PUT_WINDOW;
+	tf->dir_pipeline = TF_DEFAULT_DIR_PIPELINE;
+	tf->fast_stat = TF_DEFAULT_FAST_STAT;
+	tf->tracefh = stderr;
+	tf->lock_fd = -1;
+}
+
+/**
+ * Frees the buffers allocated by tf_attach().
+ */
+static void tf_free_buffers(tf_handle *tf)
+{
+	if (tf->req != tf->buf) {
+		free(tf->req);
+	}
+	tf->req = tf->reply = 0;
+
+	if (tf->transport->free) {
+		tf->transport->free(tf->transport, tf->buf);
+	}
+	else {
+		free(tf->buf);
+	}
+	tf->buf = 0;
+}
+
+/**
+ * Attaches the transport to the handle and allocates the
+ * buffers needed to talk to the device.
+ */
+static int tf_attach(tf_handle *tf, tf_transport *transport)
+{
+	tf->transport = transport;
+	tf->max_read = transport->max_read;
+	tf->max_write = transport->max_write;
+
+	/* Allocate a buffer big enough for a send/reply packet.
+	 * If possible this is DMA-able memory so that packets are
+	 * received straight into it. Otherwise it is page aligned,
+	 * since puts are built in place in it
+	 */
+	if (transport->alloc) {
+		tf->buf = transport->alloc(transport, 0x10000);
+	}
+	else if (posix_memalign((void **)&tf->buf, 4096, 0x10000) != 0) {
+		tf->buf = 0;
+	}
+	if (!tf->buf) {
+		transport->close(transport);
+		tf->transport = 0;
+		return -1;
+	}
+
+	/* Commands build their request and receive their reply in these
+	 * rather than in 64k packets on the stack.
+	 * A command always sends its request before reading the reply,
+	 * so low memory builds let both share the data buffer.
+	 */
+#ifdef TF_LOWMEM
+	tf->req = tf->reply = tf->buf;
+#else
+	tf->req = malloc(2 * 0x10000);
+	if (!tf->req) {
+		tf_free_buffers(tf);
+		transport->close(transport);
+		tf->transport = 0;
+		return -1;
+	}
+	tf->reply = (char *)tf->req + 0x10000;
+#endif
+
+	return 0;
+}
+
 /**
  * May return a pointer to a static buffer.
  */
@@ -56,10 +224,10 @@ static const char *lock_filename(int index)
 
 int topfield_open(tf_handle *tf, int index, tf_lock_t lock)
 {
-	memset(tf, 0, sizeof(*tf));
-	tf->timeout = TF_DEFAULT_TIMEOUT;
-	tf->tracefh = stderr;
-	tf->lock_fd = -1;
+	struct usb_dev_handle *dev;
+	tf_transport *transport;
+
+	tf_handle_init(tf);
 
 	/* The lock filename MUST be compatible with puppy, otherwise
 	 * the locking scheme will break and users will experience USB
@@ -127,28 +295,40 @@ int topfield_open(tf_handle *tf, int index, tf_lock_t lock)
 		}
 	}
 
-	tf->dev = open_usb_dev(TOPFIELD_VENDOR_ID, TOPFIELD_5000PVRT_ID, index);
+	dev = open_usb_dev(TOPFIELD_VENDOR_ID, TOPFIELD_5000PVRT_ID, index);
+
+	transport = dev ? tf_transport_usb(dev) : 0;
 
-    if (!tf->dev) {
+	if (!transport || tf_attach(tf, transport) != 0) {
+		if (dev && !transport) {
+			close_usb_dev(dev);
+		}
 		close(tf->lock_fd);
 		tf->lock_fd = -1;
-        return -1;
-    }
-
-	/* Allocate a buffer big enough for a send/reply packet */
-	tf->buf = malloc(0x10000);
+		return -1;
+	}
 
 	return 0;
 }
 
+int topfield_open_transport(tf_handle *tf, tf_transport *transport)
+{
+	tf_handle_init(tf);
+
+	return tf_attach(tf, transport);
+}
+
 void topfield_close(tf_handle *tf)
 {
-	if (tf->dev) {
-		close_usb_dev(tf->dev);
-		tf->dev = 0;
-		free(tf->buf);
-		tf->buf = 0;
-		close(tf->lock_fd);
+	if (tf->transport) {
+		tf_free_buffers(tf);
+		free(tf->put);
+		tf->put = 0;
+		tf_cache_disable(tf);
+		tf->transport->close(tf->transport);
+		tf->transport = 0;
+		if (tf->lock_fd >= 0) {
+			close(tf->lock_fd);
+		}
 	}
 }
-
@@ -28,13 +28,38 @@
 
 #include <stdio.h>
 
-struct usb_dev_handle;
+#include "tf_transport.h"
 
 /* Default number of milliseconds to wait for a packet transfer to complete.
  * This needs to be fairly long in case the disk needs to spin up from sleep mode
  */
 #define TF_DEFAULT_TIMEOUT 11000
 
+/* Default number of packets read ahead during a file get.
+ * The USB read queue (and its bulk continuation slots) hasn't yet run
+ * against a device, so it is off unless asked for. Set read_queue to 3
+ * for the next packet to be arriving while the caller handles the
+ * current one. Low memory builds shouldn't read ahead at all.
+ */
+#define TF_DEFAULT_READ_QUEUE 0
+
+/* Default number of FILE_DATA packets outstanding during a put.
+ * 1 is stop-and-wait, which every firmware supports.
+ */
+#define TF_DEFAULT_PUT_WINDOW 1
+
+/* By default, directory listings ask for the next batch of entries
+ * as soon as a batch arrives, so that the device is fetching it
+ * while the current one is unpacked.
+ */
+#define TF_DEFAULT_DIR_PIPELINE 1
+
+/* By default, tf_stat() lists the parent directory. The FILE_SEND probe
+ * is much quicker in large directories, but needs a cancel which some
+ * firmware is slow to accept.
+ */
+#define TF_DEFAULT_FAST_STAT 0
+
 /* Note that this is the lockfile for device 0.
  * Device 1 use /tmp/puppy.1, etc.
  */
@@ -49,15 +74,30 @@ typedef struct {
 	int trace_level;			/* 0 = none */
 	FILE *tracefh;				/* Debug trace filehandle */
 	int nocrc;					/* If set, crc is not checked on received packets */
+	int read_queue;				/* Number of packets to read ahead during a get (0 to disable) */
+	int put_window;				/* Number of packets outstanding during a put. Set back to 1
+								 * if the device can't cope with more */
+	int dir_pipeline;			/* If set, the next batch of a directory listing is asked for
+								 * before the current one is unpacked */
+	int fast_stat;				/* If set, tf_stat() probes regular files with a get
+								 * before listing the parent (see tf_stat_probe()) */
+	int nonblock;				/* If set, the next packet of a get isn't waited for
+								 * (see tf_pollfds()) */
 
 	/* The following fields may be accessed */
 	int error;					/* Last error, or 0 if no error */
+	int max_read;				/* Largest single USB read, as chosen by the transport */
+	int max_write;				/* Largest single USB write, as chosen by the transport */
 
 	/* The following fields should not be touched */
 	int lock_fd;			/* File used for locking to avoid Linux kernel bugs */
-	struct usb_dev_handle *dev;	/* USB handle to the device */
+	tf_transport *transport;	/* Carries packets to and from the device */
 	int pending;				/* A reply should be pending */
 	char *buf;					/* Buffer used for transferring data during get/put */
+	void *req;					/* Packet which commands are built in */
+	void *reply;				/* Packet which replies to commands are received into */
+	struct tf_put_window *put;	/* State of a windowed put, or NULL */
+	struct tf_cache *cache;		/* Directory listing cache, or NULL (see tf_cache.h) */
 } tf_handle;
 
 typedef enum {
@@ -79,6 +119,15 @@ typedef enum {
  */
 int topfield_open(tf_handle *tf, int index, tf_lock_t lock);
 
+/**
+ * Like topfield_open(), but talks to the device over the given transport
+ * instead of USB. No locking is done.
+ * The transport is closed by topfield_close().
+ *
+ * Returns 0 if OK or < 0 on error (in which case the transport is closed).
+ */
+int topfield_open_transport(tf_handle *tf, tf_transport *transport);
+
 /**
  * Closes a previously opened topfield device.
  */
@@ -0,0 +1,99 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_PROTO_H
+#define TF_PROTO_H
+
+/* Definitions of the Topfield USB protocol packets.
+ * These are private to the library (tf_io.c and the device simulator).
+ */
+
+#include "tf_types.h"
+#include "mjd.h"
+
+/* The maximum packet size used by the Toppy. This happens to be an
+   odd number, which could cause issues when the Topfield specific
+   byte swapping is applied. It's best to ensure that transmitted
+   packets contain an even number of bytes that is smaller than this
+   value.
+*/
+#define MAXIMUM_PACKET_SIZE 0xFFFFL
+
+/* The size of every packet header. */
+#define PACKET_HEAD_SIZE 8
+
+/* Format of a Topfield protocol packet */
+typedef struct
+{
+	__u16 length;
+	__u16 crc;
+	__u32 cmd;
+	__u8 data[MAXIMUM_PACKET_SIZE - PACKET_HEAD_SIZE];
+	__u8 dummy;	/* extra dummy byte sometimes gets sent for padding */
+} __attribute__ ((packed)) tf_packet_t;
+
+/* Possible values for tf_typefile_t->filetype */
+#define TYPE_DIR  1
+#define TYPE_FILE 2
+
+/* Topfield file descriptor data structure. */
+typedef struct
+{
+	struct tf_datetime stamp;
+	__u8 filetype;
+	__u64 size;
+	__u8 name[95];
+	__u8 unused;
+	__u32 attrib;
+} __attribute__ ((packed)) tf_typefile_t;
+
+/* Topfield command codes */
+#define TF_MSG_FAIL                  0x0001
+#define TF_MSG_SUCCESS               0x0002
+#define TF_MSG_CANCEL                0x0003
+
+#define TF_MSG_READY                 0x0100
+#define TF_MSG_RESET                 0x0101
+#define TF_MSG_TURBO                 0x0102
+
+#define TF_MSG_HDD_SIZE              0x1000
+#define TF_MSG_HDD_SIZE_RESULT       0x1001
+
+#define TF_MSG_HDD_DIR               0x1002
+#define TF_MSG_HDD_DIRENT            0x1003
+#define TF_MSG_HDD_DIREND            0x1004
+
+#define TF_MSG_HDD_DELETE            0x1005
+#define TF_MSG_HDD_RENAME            0x1006
+#define TF_MSG_HDD_MKDIR             0x1007
+
+#define TF_MSG_HDD_FILE_SEND         0x1008
+#define TF_MSG_HDD_FILE_START        0x1009
+#define TF_MSG_HDD_FILE_DATA         0x100A
+#define TF_MSG_HDD_FILE_END          0x100B
+
+/* Direction for TF_MSG_HDD_FILE_SEND */
+#define DIR_PUT 0
+#define DIR_GET 1
+
+#endif
@@ -0,0 +1,378 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tf_record.h"
+#include "tf_bytes.h"
+
+#define REC_HEAD_SIZE 8
+#define REC_EVENT_SIZE 13
+#define REC_MAX_DATA 0x10000
+
+static __u64 rec_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Recording */
+
+typedef struct {
+	tf_transport t;
+	tf_transport *inner;
+	FILE *fh;
+	__u64 last;				/* Start time of the previous event */
+} tf_rec;
+
+static void rec_event(tf_rec *rec, __u8 type, __u64 start, ssize_t result, const void *data)
+{
+	__u8 head[REC_EVENT_SIZE];
+
+	head[0] = type;
+	put_u32(head + 1, start - rec->last);
+	put_u32(head + 5, rec_clock() - start);
+	put_u32(head + 9, result);
+	rec->last = start;
+
+	fwrite(head, sizeof(head), 1, rec->fh);
+	if (result > 0 && data) {
+		fwrite(data, result, 1, rec->fh);
+	}
+}
+
+static ssize_t tf_rec_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	tf_rec *rec = (tf_rec *)t;
+	__u64 start = rec_clock();
+	ssize_t ret = rec->inner->send(rec->inner, buf, len, timeout);
+
+	/* Record what was sent, even if it failed */
+	rec_event(rec, 'S', start, ret > 0 ? (ssize_t)len : ret, buf);
+
+	return ret;
+}
+
+static ssize_t tf_rec_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	tf_rec *rec = (tf_rec *)t;
+	__u64 start = rec_clock();
+	ssize_t ret = rec->inner->recv(rec->inner, buf, size, data, timeout);
+
+	rec_event(rec, 'R', start, ret, data ? *data : buf);
+
+	return ret;
+}
+
+static int tf_rec_cancel(tf_transport *t)
+{
+	tf_rec *rec = (tf_rec *)t;
+	__u64 start = rec_clock();
+	int ret = rec->inner->cancel(rec->inner);
+
+	rec_event(rec, 'C', start, ret, 0);
+
+	return ret;
+}
+
+static int tf_rec_read_ahead(tf_transport *t, int packets)
+{
+	tf_rec *rec = (tf_rec *)t;
+
+	return rec->inner->read_ahead ? rec->inner->read_ahead(rec->inner, packets) : 0;
+}
+
+static void *tf_rec_alloc(tf_transport *t, size_t size)
+{
+	tf_rec *rec = (tf_rec *)t;
+
+	return rec->inner->alloc(rec->inner, size);
+}
+
+static void tf_rec_free(tf_transport *t, void *buf)
+{
+	tf_rec *rec = (tf_rec *)t;
+
+	rec->inner->free(rec->inner, buf);
+}
+
+static void tf_rec_close(tf_transport *t)
+{
+	tf_rec *rec = (tf_rec *)t;
+
+	rec->inner->close(rec->inner);
+	fclose(rec->fh);
+	free(rec);
+}
+
+int tf_record_start(tf_handle *tf, const char *filename)
+{
+	tf_rec *rec;
+	__u8 head[REC_HEAD_SIZE];
+
+	if (!tf->transport) {
+		return -1;
+	}
+	tf_record_stop(tf);
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec) {
+		return -1;
+	}
+	rec->fh = fopen(filename, "wb");
+	if (!rec->fh) {
+		free(rec);
+		return -1;
+	}
+
+	memcpy(head, "TFRC", 4);
+	put_u16(head + 4, TF_RECORD_VERSION);
+	put_u16(head + 6, 0);
+	fwrite(head, sizeof(head), 1, rec->fh);
+
+	rec->inner = tf->transport;
+	rec->t = *rec->inner;
+	rec->t.send = tf_rec_send;
+	rec->t.recv = tf_rec_recv;
+	rec->t.cancel = tf_rec_cancel;
+	rec->t.close = tf_rec_close;
+	rec->t.read_ahead = rec->inner->read_ahead ? tf_rec_read_ahead : 0;
+	rec->t.alloc = rec->inner->alloc ? tf_rec_alloc : 0;
+	rec->t.free = rec->inner->free ? tf_rec_free : 0;
+	rec->last = rec_clock();
+
+	tf->transport = &rec->t;
+
+	return 0;
+}
+
+void tf_record_stop(tf_handle *tf)
+{
+	if (tf->transport && tf->transport->send == tf_rec_send) {
+		tf_rec *rec = (tf_rec *)tf->transport;
+
+		tf->transport = rec->inner;
+		fclose(rec->fh);
+		free(rec);
+	}
+}
+
+/* Replay */
+
+typedef struct {
+	tf_transport t;
+	FILE *fh;
+	int flags;
+	tf_replay_stats stats;
+
+	int have;				/* Set if 'ev...' holds the next event */
+	__u8 ev_type;			/* 0 at the end of the recording */
+	__u32 ev_duration;		/* Reduced by any time already waited */
+	ssize_t ev_result;
+	__u8 *ev_data;
+} tf_replay;
+
+/**
+ * Reads the next event if necessary.
+ * Returns its type, or 0 if there are no more events.
+ */
+static __u8 replay_peek(tf_replay *rp)
+{
+	__u8 head[REC_EVENT_SIZE];
+
+	if (rp->have) {
+		return rp->ev_type;
+	}
+
+	rp->have = 1;
+	rp->ev_type = 0;
+
+	if (fread(head, sizeof(head), 1, rp->fh) != 1) {
+		return 0;
+	}
+	rp->ev_duration = get_u32(head + 5);
+	rp->ev_result = (int)get_u32(head + 9);
+
+	if (rp->ev_result > REC_MAX_DATA) {
+		return 0;
+	}
+	if (rp->ev_result > 0 && fread(rp->ev_data, rp->ev_result, 1, rp->fh) != 1) {
+		return 0;
+	}
+	rp->ev_type = head[0];
+
+	return rp->ev_type;
+}
+
+static void replay_next(tf_replay *rp)
+{
+	if (rp->ev_type) {
+		rp->have = 0;
+		rp->stats.events++;
+	}
+}
+
+/**
+ * Waits for 'us' microseconds if replaying in real time.
+ */
+static void replay_wait(tf_replay *rp, __u64 us)
+{
+	rp->stats.device_time += us;
+
+	if (rp->flags & TF_REPLAY_REALTIME) {
+		struct timespec ts;
+
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = us % 1000000 * 1000;
+		while (nanosleep(&ts, &ts) != 0) {
+		}
+	}
+}
+
+static ssize_t tf_replay_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	tf_replay *rp = (tf_replay *)t;
+	__u8 type;
+
+	while ((type = replay_peek(rp)) == 'C') {
+		replay_next(rp);
+	}
+
+	if (type == 'S') {
+		if (rp->ev_result != len || memcmp(rp->ev_data, buf, len) != 0) {
+			rp->stats.mismatches++;
+		}
+		replay_next(rp);
+	}
+	else {
+		/* Not expecting to send anything now */
+		rp->stats.mismatches++;
+	}
+
+	return len;
+}
+
+static ssize_t tf_replay_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	tf_replay *rp = (tf_replay *)t;
+	__u64 limit = (__u64)timeout * 1000;
+	ssize_t ret;
+	__u8 type;
+
+	if (data) {
+		*data = buf;
+	}
+
+	while ((type = replay_peek(rp)) == 'S' || type == 'C') {
+		if (type == 'S') {
+			/* The recording sent something we didn't */
+			rp->stats.mismatches++;
+		}
+		replay_next(rp);
+	}
+
+	if (type != 'R') {
+		/* The end of the recording */
+		return 0;
+	}
+
+	if (timeout && rp->ev_duration > limit && rp->ev_result > 0) {
+		/* The reply didn't arrive in time. It will be there next time */
+		replay_wait(rp, limit);
+		rp->ev_duration -= limit;
+		return 0;
+	}
+	replay_wait(rp, rp->ev_duration);
+
+	ret = rp->ev_result;
+	if (ret > (ssize_t)size) {
+		ret = size;
+	}
+	if (ret > 0) {
+		memcpy(buf, rp->ev_data, ret);
+	}
+	replay_next(rp);
+
+	return ret;
+}
+
+static int tf_replay_cancel(tf_transport *t)
+{
+	tf_replay *rp = (tf_replay *)t;
+
+	if (replay_peek(rp) == 'C') {
+		replay_next(rp);
+	}
+	return 0;
+}
+
+static void tf_replay_close(tf_transport *t)
+{
+	tf_replay *rp = (tf_replay *)t;
+
+	fclose(rp->fh);
+	free(rp->ev_data);
+	free(rp);
+}
+
+tf_transport *tf_transport_replay(const char *filename, int flags)
+{
+	tf_replay *rp;
+	__u8 head[REC_HEAD_SIZE];
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp) {
+		return 0;
+	}
+	rp->fh = fopen(filename, "rb");
+	rp->ev_data = malloc(REC_MAX_DATA);
+
+	if (!rp->fh || !rp->ev_data || fread(head, sizeof(head), 1, rp->fh) != 1 ||
+		memcmp(head, "TFRC", 4) != 0 || get_u16(head + 4) != TF_RECORD_VERSION) {
+		if (rp->fh) {
+			fclose(rp->fh);
+		}
+		free(rp->ev_data);
+		free(rp);
+		return 0;
+	}
+
+	rp->t.send = tf_replay_send;
+	rp->t.recv = tf_replay_recv;
+	rp->t.cancel = tf_replay_cancel;
+	rp->t.close = tf_replay_close;
+	rp->flags = flags;
+
+	return &rp->t;
+}
+
+void tf_replay_get_stats(tf_transport *t, tf_replay_stats *stats)
+{
+	*stats = ((tf_replay *)t)->stats;
+}
@@ -0,0 +1,83 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_RECORD_H
+#define TF_RECORD_H
+
+/* Recording of the packets exchanged with a device, and replay of a recording.
+ *
+ * A recording is a binary file which starts with an 8 byte header:
+ *   "TFRC", u16 version, u16 reserved
+ * followed by one record for each event:
+ *   u8 type       - 'S' (send), 'R' (recv) or 'C' (cancel)
+ *   u32 delta     - microseconds since the start of the previous event
+ *   u32 duration  - microseconds the call took
+ *   s32 result    - bytes sent or received, or the result of a failed call
+ *   u8 data[]     - the packet as seen on the wire, if result > 0
+ * All integers are big-endian.
+ */
+
+#include "tf_io.h"
+
+#define TF_RECORD_VERSION 1
+
+/**
+ * Starts recording every packet sent and received by 'tf' to 'filename'.
+ * Returns 0 if OK or -1 if the file can't be created.
+ */
+int tf_record_start(tf_handle *tf, const char *filename);
+
+/**
+ * Stops any recording started by tf_record_start() and closes the file.
+ * Recording also stops when the handle is closed.
+ */
+void tf_record_stop(tf_handle *tf);
+
+/* Flags for tf_transport_replay() */
+#define TF_REPLAY_REALTIME 0x0001	/* Each recv takes as long as it did when recorded */
+
+typedef struct {
+	int events;				/* Events replayed */
+	int mismatches;			/* Sends which didn't match the recording */
+	__u64 device_time;		/* Microseconds spent waiting in recv, as recorded */
+} tf_replay_stats;
+
+/**
+ * Creates a transport which replays a recording.
+ *
+ * Each recv returns the next recorded reply, or times out if the recording
+ * did. If the recorded recv took longer than the timeout now in use, it
+ * times out and the reply is returned by the next recv.
+ * Sends are compared with the recording, and differences counted,
+ * but otherwise have no effect.
+ *
+ * Returns 0 if the file can't be read or isn't a recording.
+ */
+tf_transport *tf_transport_replay(const char *filename, int flags);
+
+/**
+ * Fills in the statistics for a transport created by tf_transport_replay().
+ */
+void tf_replay_get_stats(tf_transport *t, tf_replay_stats *stats);
+
+#endif
@@ -0,0 +1,613 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "tf_sim.h"
+#include "tf_io.h"
+#include "tf_proto.h"
+#include "tf_bytes.h"
+#include "crc16.h"
+#include "mjd.h"
+
+/* A reply packet, in wire format, waiting to be received */
+typedef struct tf_sim_reply {
+	struct tf_sim_reply *next;
+	size_t len;
+	__u8 data[0];
+} tf_sim_reply;
+
+typedef enum {
+	SIM_IDLE,
+	SIM_DIR,		/* Sent a DIRENT, more may follow */
+	SIM_GET,		/* Sending FILE_DATA */
+	SIM_GET_END,	/* Sent FILE_END */
+	SIM_PUT,		/* Receiving FILE_DATA */
+} tf_sim_state;
+
+typedef struct {
+	tf_transport t;
+	char *root;
+	int turbo;
+
+	tf_sim_state state;
+	DIR *dir;				/* SIM_DIR: the directory being listed */
+	char *dirpath;			/* SIM_DIR: and its local path */
+	int fd;					/* SIM_GET/SIM_PUT: the file being transferred */
+	char *putpath;			/* SIM_PUT: the local path of the file */
+	__u64 offset;			/* SIM_GET: offset of the next FILE_DATA */
+	time_t stamp;			/* SIM_PUT: timestamp from FILE_START */
+
+	tf_sim_reply *head;		/* Replies waiting to be received */
+	tf_sim_reply *tail;
+
+	tf_packet_t req;		/* The request being processed */
+	tf_packet_t reply;		/* The reply being built, in host order */
+} tf_sim;
+
+static void sim_reply_init(tf_sim *sim, __u32 cmd)
+{
+	/* As for requests, the length is kept in host order until the end */
+	sim->reply.length = PACKET_HEAD_SIZE;
+	sim->reply.crc = 0;
+	put_u32(&sim->reply.cmd, cmd);
+}
+
+static void sim_reply_put(tf_sim *sim, const void *data, size_t len)
+{
+	memcpy(sim->reply.data + sim->reply.length - PACKET_HEAD_SIZE, data, len);
+	sim->reply.length += len;
+}
+
+static void sim_reply_put32(tf_sim *sim, __u32 value)
+{
+	__u8 b[4];
+
+	put_u32(b, value);
+	sim_reply_put(sim, b, sizeof(b));
+}
+
+static void sim_reply_put64(tf_sim *sim, __u64 value)
+{
+	__u8 b[8];
+
+	put_u64(b, value);
+	sim_reply_put(sim, b, sizeof(b));
+}
+
+/**
+ * Finalises the reply exactly as the Toppy would and
+ * queues it to be received.
+ */
+static void sim_reply_send(tf_sim *sim)
+{
+	__u16 len = sim->reply.length;
+	size_t wirelen = len + (len % 2);
+	tf_sim_reply *r;
+
+	put_u16(&sim->reply.length, len);
+	put_u16(&sim->reply.crc, crc16_ansi(0, &sim->reply.cmd, len - 4));
+	((__u8 *)&sim->reply)[len] = 0;
+	byte_swap(&sim->reply, wirelen);
+
+	r = malloc(sizeof(*r) + wirelen);
+	if (!r) {
+		return;
+	}
+	r->next = 0;
+	r->len = wirelen;
+	memcpy(r->data, &sim->reply, wirelen);
+
+	if (sim->tail) {
+		sim->tail->next = r;
+	}
+	else {
+		sim->head = r;
+	}
+	sim->tail = r;
+}
+
+static void sim_reply(tf_sim *sim, __u32 cmd)
+{
+	sim_reply_init(sim, cmd);
+	sim_reply_send(sim);
+}
+
+static void sim_fail(tf_sim *sim, int reason)
+{
+	sim_reply_init(sim, TF_MSG_FAIL);
+	sim_reply_put32(sim, reason);
+	sim_reply_send(sim);
+}
+
+/**
+ * Abandons any transfer or listing in progress.
+ */
+static void sim_abort(tf_sim *sim)
+{
+	if (sim->dir) {
+		closedir(sim->dir);
+		sim->dir = 0;
+	}
+	free(sim->dirpath);
+	sim->dirpath = 0;
+	if (sim->fd >= 0) {
+		close(sim->fd);
+		sim->fd = -1;
+	}
+	free(sim->putpath);
+	sim->putpath = 0;
+	sim->state = SIM_IDLE;
+}
+
+/**
+ * Converts a Toppy path such as \DataFiles\abc (possibly preceded by a length)
+ * into a local path under the root.
+ * Returns a malloc'ed string, or 0 if the path is not acceptable.
+ */
+static char *sim_local_path(tf_sim *sim, const __u8 *name, size_t maxlen)
+{
+	size_t len = strnlen((const char *)name, maxlen);
+	char *path;
+	char *pt;
+
+	if (len == maxlen) {
+		return 0;
+	}
+	path = malloc(strlen(sim->root) + 1 + len + 1);
+	if (!path) {
+		return 0;
+	}
+	sprintf(path, "%s/%s", sim->root, (const char *)name);
+
+	for (pt = path + strlen(sim->root); *pt; pt++) {
+		if (*pt == '\\') {
+			*pt = '/';
+		}
+	}
+
+	/* Don't allow escape from the root */
+	if (strstr(path, "/../") || (strlen(path) >= 3 && strcmp(path + strlen(path) - 3, "/..") == 0)) {
+		free(path);
+		return 0;
+	}
+
+	return path;
+}
+
+static void sim_fill_typefile(tf_typefile_t *typefile, const char *name, const struct stat *st)
+{
+	memset(typefile, 0, sizeof(*typefile));
+	time_to_tfdt(st->st_mtime, &typefile->stamp);
+	typefile->filetype = S_ISDIR(st->st_mode) ? TYPE_DIR : TYPE_FILE;
+	put_u64(&typefile->size, st->st_size);
+	snprintf((char *)typefile->name, sizeof(typefile->name), "%s", name);
+}
+
+/**
+ * Sends the next batch of directory entries, or DIREND if there are no more.
+ */
+static void sim_dir_next(tf_sim *sim)
+{
+	struct dirent *de;
+	int count = 0;
+
+	sim_reply_init(sim, TF_MSG_HDD_DIRENT);
+
+	while (count < TF_SIM_DIR_BATCH && (de = readdir(sim->dir)) != 0) {
+		tf_typefile_t typefile;
+		struct stat st;
+		char *path;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		path = malloc(strlen(sim->dirpath) + 1 + strlen(de->d_name) + 1);
+		if (!path) {
+			continue;
+		}
+		sprintf(path, "%s/%s", sim->dirpath, de->d_name);
+		if (stat(path, &st) == 0) {
+			sim_fill_typefile(&typefile, de->d_name, &st);
+			sim_reply_put(sim, &typefile, sizeof(typefile));
+			count++;
+		}
+		free(path);
+	}
+
+	if (count) {
+		sim->state = SIM_DIR;
+		sim_reply_send(sim);
+	}
+	else {
+		sim_abort(sim);
+		sim_reply(sim, TF_MSG_HDD_DIREND);
+	}
+}
+
+/**
+ * Sends the next FILE_DATA, or FILE_END if there is no more data.
+ */
+static void sim_get_next(tf_sim *sim)
+{
+	__u8 *data;
+	ssize_t n;
+
+	sim_reply_init(sim, TF_MSG_HDD_FILE_DATA);
+	sim_reply_put64(sim, sim->offset);
+
+	data = sim->reply.data + sim->reply.length - PACKET_HEAD_SIZE;
+	n = pread(sim->fd, data, TF_SIM_GET_CHUNK, sim->offset);
+	if (n < 0) {
+		sim_abort(sim);
+		sim_fail(sim, -TF_ERR_GENERR);
+	}
+	else if (n == 0) {
+		sim_abort(sim);
+		sim->state = SIM_GET_END;
+		sim_reply(sim, TF_MSG_HDD_FILE_END);
+	}
+	else {
+		sim->reply.length += n;
+		sim->offset += n;
+		sim_reply_send(sim);
+	}
+}
+
+static void sim_hdd_size(tf_sim *sim)
+{
+	struct statvfs sv;
+
+	if (statvfs(sim->root, &sv) != 0) {
+		sim_fail(sim, -TF_ERR_GENERR);
+		return;
+	}
+	sim_reply_init(sim, TF_MSG_HDD_SIZE_RESULT);
+	sim_reply_put32(sim, (__u64)sv.f_blocks * sv.f_frsize / 1024);
+	sim_reply_put32(sim, (__u64)sv.f_bavail * sv.f_frsize / 1024);
+	sim_reply_send(sim);
+}
+
+static void sim_file_send(tf_sim *sim, const __u8 *data, size_t len)
+{
+	__u8 dir;
+	size_t namelen;
+	__u64 offset;
+	char *path;
+	struct stat st;
+	const char *pt;
+	tf_typefile_t typefile;
+
+	if (len < 3 || (namelen = get_u16(data + 1)) + 3 + 8 > len) {
+		sim_fail(sim, -TF_ERR_BLKSIZE);
+		return;
+	}
+	dir = data[0];
+	offset = get_u64(data + 3 + namelen);
+
+	path = sim_local_path(sim, data + 3, namelen);
+	if (!path) {
+		sim_fail(sim, -TF_ERR_GENERR);
+		return;
+	}
+
+	if (dir == DIR_PUT) {
+		sim->fd = open(path, O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC), 0666);
+		if (sim->fd < 0) {
+			free(path);
+			sim_fail(sim, -TF_ERR_GENERR);
+			return;
+		}
+		sim->putpath = path;
+		sim->stamp = 0;
+		sim->state = SIM_PUT;
+		sim_reply(sim, TF_MSG_SUCCESS);
+		return;
+	}
+
+	sim->fd = open(path, O_RDONLY);
+	if (sim->fd < 0 || fstat(sim->fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+		free(path);
+		sim_abort(sim);
+		sim_fail(sim, -TF_ERR_GENERR);
+		return;
+	}
+	pt = strrchr(path, '/');
+	sim_fill_typefile(&typefile, pt ? pt + 1 : path, &st);
+	free(path);
+
+	sim->offset = offset;
+	sim->state = SIM_GET;
+
+	sim_reply_init(sim, TF_MSG_HDD_FILE_START);
+	sim_reply_put(sim, &typefile, sizeof(typefile));
+	sim_reply_send(sim);
+}
+
+static void sim_file_data(tf_sim *sim, const __u8 *data, size_t len)
+{
+	if (sim->state != SIM_PUT || len < 8) {
+		sim_abort(sim);
+		sim_fail(sim, -TF_ERR_BADCMD);
+		return;
+	}
+	if (pwrite(sim->fd, data + 8, len - 8, get_u64(data)) != len - 8) {
+		sim_abort(sim);
+		sim_fail(sim, -TF_ERR_NOMEM);
+		return;
+	}
+	sim_reply(sim, TF_MSG_SUCCESS);
+}
+
+static void sim_file_end(tf_sim *sim)
+{
+	if (sim->state != SIM_PUT) {
+		sim_abort(sim);
+		sim_fail(sim, -TF_ERR_BADCMD);
+		return;
+	}
+	close(sim->fd);
+	sim->fd = -1;
+	if (sim->stamp) {
+		struct utimbuf ut;
+
+		ut.actime = ut.modtime = sim->stamp;
+		utime(sim->putpath, &ut);
+	}
+	sim_abort(sim);
+	sim_reply(sim, TF_MSG_SUCCESS);
+}
+
+/**
+ * Acts on a request, which has already been checked and swapped.
+ */
+static void sim_request(tf_sim *sim, __u32 cmd, const __u8 *data, size_t len)
+{
+	char *path;
+	char *path2;
+
+	switch (cmd) {
+		case TF_MSG_SUCCESS:
+			/* This is how the host asks for the next packet */
+			if (sim->state == SIM_DIR) {
+				sim_dir_next(sim);
+			}
+			else if (sim->state == SIM_GET) {
+				sim_get_next(sim);
+			}
+			else if (sim->state == SIM_GET_END) {
+				sim->state = SIM_IDLE;
+			}
+			break;
+
+		case TF_MSG_FAIL:
+			/* Abandons whatever is in progress. No reply */
+			sim_abort(sim);
+			break;
+
+		case TF_MSG_CANCEL:
+			sim_abort(sim);
+			sim_reply(sim, TF_MSG_SUCCESS);
+			break;
+
+		case TF_MSG_READY:
+		case TF_MSG_RESET:
+			sim_reply(sim, TF_MSG_SUCCESS);
+			break;
+
+		case TF_MSG_TURBO:
+			sim->turbo = len >= 4 ? get_u32(data) : 0;
+			sim_reply(sim, TF_MSG_SUCCESS);
+			break;
+
+		case TF_MSG_HDD_SIZE:
+			sim_hdd_size(sim);
+			break;
+
+		case TF_MSG_HDD_DIR:
+			sim_abort(sim);
+			sim->dirpath = sim_local_path(sim, data, len);
+			if (!sim->dirpath || !(sim->dir = opendir(sim->dirpath))) {
+				sim_abort(sim);
+				sim_fail(sim, -TF_ERR_GENERR);
+			}
+			else {
+				sim_dir_next(sim);
+			}
+			break;
+
+		case TF_MSG_HDD_DELETE:
+			path = sim_local_path(sim, data, len);
+			if (path && (unlink(path) == 0 || rmdir(path) == 0)) {
+				sim_reply(sim, TF_MSG_SUCCESS);
+			}
+			else {
+				sim_fail(sim, -TF_ERR_GENERR);
+			}
+			free(path);
+			break;
+
+		case TF_MSG_HDD_MKDIR:
+			path = len >= 2 ? sim_local_path(sim, data + 2, len - 2) : 0;
+			if (path && mkdir(path, 0777) == 0) {
+				sim_reply(sim, TF_MSG_SUCCESS);
+			}
+			else {
+				sim_fail(sim, -TF_ERR_GENERR);
+			}
+			free(path);
+			break;
+
+		case TF_MSG_HDD_RENAME:
+			path = path2 = 0;
+			if (len >= 2 && get_u16(data) + 2 + 2 <= len) {
+				size_t len1 = get_u16(data);
+
+				path = sim_local_path(sim, data + 2, len1);
+				path2 = sim_local_path(sim, data + 2 + len1 + 2, len - len1 - 4);
+			}
+			if (path && path2 && rename(path, path2) == 0) {
+				sim_reply(sim, TF_MSG_SUCCESS);
+			}
+			else {
+				sim_fail(sim, -TF_ERR_GENERR);
+			}
+			free(path);
+			free(path2);
+			break;
+
+		case TF_MSG_HDD_FILE_SEND:
+			sim_abort(sim);
+			sim_file_send(sim, data, len);
+			break;
+
+		case TF_MSG_HDD_FILE_START:
+			if (sim->state == SIM_PUT && len >= sizeof(tf_typefile_t)) {
+				sim->stamp = tfdt_to_time(&((const tf_typefile_t *)data)->stamp);
+				sim_reply(sim, TF_MSG_SUCCESS);
+			}
+			else {
+				sim_abort(sim);
+				sim_fail(sim, -TF_ERR_BADCMD);
+			}
+			break;
+
+		case TF_MSG_HDD_FILE_DATA:
+			sim_file_data(sim, data, len);
+			break;
+
+		case TF_MSG_HDD_FILE_END:
+			sim_file_end(sim);
+			break;
+
+		default:
+			sim_fail(sim, -TF_ERR_BADCMD);
+			break;
+	}
+}
+
+static ssize_t tf_sim_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	tf_sim *sim = (tf_sim *)t;
+	__u16 plen;
+
+	if (len < PACKET_HEAD_SIZE || len > sizeof(sim->req)) {
+		return -1;
+	}
+
+	memcpy(&sim->req, buf, len);
+	byte_swap(&sim->req, len - (len % 2));
+
+	plen = get_u16(&sim->req.length);
+	if (plen < PACKET_HEAD_SIZE || plen > len ||
+		get_u16(&sim->req.crc) != crc16_ansi(0, &sim->req.cmd, plen - 4)) {
+		/* The Toppy reports a CRC error for anything it can't make sense of */
+		sim_fail(sim, -TF_ERR_CRC);
+		return len;
+	}
+
+	sim_request(sim, get_u32(&sim->req.cmd), sim->req.data, plen - PACKET_HEAD_SIZE);
+
+	return len;
+}
+
+static ssize_t tf_sim_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	tf_sim *sim = (tf_sim *)t;
+	tf_sim_reply *r = sim->head;
+	size_t len;
+
+	if (data) {
+		*data = buf;
+	}
+
+	if (!r) {
+		/* Nothing to say, so this is a timeout */
+		return 0;
+	}
+
+	sim->head = r->next;
+	if (!sim->head) {
+		sim->tail = 0;
+	}
+
+	len = r->len < size ? r->len : size;
+	memcpy(buf, r->data, len);
+	free(r);
+
+	return len;
+}
+
+static int tf_sim_cancel(tf_transport *t)
+{
+	/* Replies are only queued once they have been "sent" by the device,
+	 * so there is nothing in flight
+	 */
+	return 0;
+}
+
+static void tf_sim_close(tf_transport *t)
+{
+	tf_sim *sim = (tf_sim *)t;
+
+	sim_abort(sim);
+	while (sim->head) {
+		tf_sim_reply *r = sim->head;
+
+		sim->head = r->next;
+		free(r);
+	}
+	free(sim->root);
+	free(sim);
+}
+
+tf_transport *tf_transport_sim(const char *root)
+{
+	tf_sim *sim = calloc(1, sizeof(*sim));
+
+	if (!sim) {
+		return 0;
+	}
+	sim->t.send = tf_sim_send;
+	sim->t.recv = tf_sim_recv;
+	sim->t.cancel = tf_sim_cancel;
+	sim->t.close = tf_sim_close;
+	sim->root = strdup(root);
+	if (!sim->root) {
+		free(sim);
+		return 0;
+	}
+	sim->fd = -1;
+	sim->state = SIM_IDLE;
+
+	return &sim->t;
+}
@@ -0,0 +1,55 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_SIM_H
+#define TF_SIM_H
+
+/* A simulated Topfield device, for testing and benchmarking without hardware */
+
+#include "tf_transport.h"
+
+/**
+ * Number of directory entries the simulator sends in each DIRENT packet.
+ * This is as many as will fit in a packet.
+ */
+#define TF_SIM_DIR_BATCH 574
+
+/**
+ * Number of bytes of file data the simulator sends in each FILE_DATA packet.
+ */
+#define TF_SIM_GET_CHUNK 0xFE00
+
+/**
+ * Creates a transport which simulates a Topfield device in-process.
+ * The local directory 'root' is served as the Toppy's disk, so that
+ * /DataFiles refers to 'root'/DataFiles.
+ *
+ * The simulator speaks the same protocol as the real device, with the same
+ * framing, byte swapping and CRC, and answers as soon as a request is sent.
+ *
+ * Use with topfield_open_transport().
+ * Returns 0 if no memory is available.
+ */
+tf_transport *tf_transport_sim(const char *root);
+
+#endif
@@ -0,0 +1,271 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "tf_stream.h"
+
+typedef struct {
+	void *packet;			/* TF_PACKET_BUF_SIZE bytes */
+	tf_buffer buf;			/* The data in the packet */
+	int status;				/* Result of tf_cmd_get_next_packet() */
+} tf_stream_slot;
+
+/* Lets one side of the ring sleep until the other moves an index.
+ * Waking costs a fence and a load unless the other side is really asleep.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int waiting;			/* Set while the side is (about to be) asleep */
+} stream_waiter;
+
+/* The ring has a single producer, the reader thread, and a single consumer.
+ * Each index is only written by one side, with release stores which the
+ * other side loads with acquire, and that orders the accesses to the slots.
+ * A side only sleeps when the ring is full or empty.
+ */
+struct tf_stream {
+	tf_handle *tf;
+	pthread_t thread;
+
+	tf_stream_slot *slots;
+	int nslots;
+
+	unsigned head;			/* Reader: next slot to fill */
+	unsigned next;			/* Consumer: next slot to return */
+	unsigned tail;			/* Consumer: next slot to release */
+
+	stream_waiter filled;	/* The consumer waits here for head to move */
+	stream_waiter space;	/* The reader waits here for tail to move */
+
+	int stop;				/* Set to ask the reader to stop */
+	int status;				/* Reader: final status */
+	int result;				/* Consumer: final status, once seen */
+	int finished;			/* Consumer: set once the final status has been seen */
+};
+
+static void stream_waiter_init(stream_waiter *w)
+{
+	pthread_mutex_init(&w->lock, 0);
+	pthread_cond_init(&w->cond, 0);
+	w->waiting = 0;
+}
+
+static void stream_waiter_destroy(stream_waiter *w)
+{
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+}
+
+/**
+ * Waits while '*index' is 'value', unless '*stop' is set.
+ */
+static void stream_wait(stream_waiter *w, const unsigned *index, unsigned value, const int *stop)
+{
+	if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != value) {
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	/* Say so before looking again, so that a move now is sure to wake us */
+	__atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value && !(stop && __atomic_load_n(stop, __ATOMIC_SEQ_CST))) {
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	__atomic_store_n(&w->waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Wakes the other side if it is waiting, after an index or the stop flag moved.
+ */
+static void stream_wake(stream_waiter *w)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->waiting, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+static void *stream_reader(void *arg)
+{
+	tf_stream *s = arg;
+	int ret;
+
+	do {
+		tf_stream_slot *slot;
+
+		/* Don't ask for the next packet until there is somewhere to put it */
+		stream_wait(&s->space, &s->tail, s->head - s->nslots, &s->stop);
+
+		if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+			ret = 1;
+			break;
+		}
+
+		slot = &s->slots[s->head % s->nslots];
+		ret = slot->status = tf_cmd_get_next_packet(s->tf, slot->packet, &slot->buf);
+		__atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELEASE);
+
+		stream_wake(&s->filled);
+	} while (ret == 0);
+
+	/* The result is read after the thread is joined */
+	s->status = ret;
+
+	return 0;
+}
+
+static void stream_free(tf_stream *s)
+{
+	tf_transport *t = s->tf->transport;
+	int i;
+
+	for (i = 0; i < s->nslots; i++) {
+		if (t->free) {
+			t->free(t, s->slots[i].packet);
+		}
+		else {
+			free(s->slots[i].packet);
+		}
+	}
+	free(s->slots);
+	free(s);
+}
+
+tf_stream *tf_stream_get(tf_handle *tf, const char *path, __u64 offset, int slots, tf_dirent *dirent)
+{
+	tf_stream *s;
+	int i;
+
+	if (!tf->transport) {
+		tf->error = TF_ERR_NOCONN;
+		return 0;
+	}
+
+	if (slots <= 0) {
+		slots = TF_STREAM_DEFAULT_SLOTS;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		tf->error = TF_ERR_NOMEM;
+		return 0;
+	}
+	s->tf = tf;
+	s->slots = calloc(slots, sizeof(*s->slots));
+	s->nslots = slots;
+	if (!s->slots) {
+		free(s);
+		tf->error = TF_ERR_NOMEM;
+		return 0;
+	}
+	for (i = 0; i < slots; i++) {
+		tf_transport *t = tf->transport;
+
+		s->slots[i].packet = t->alloc ? t->alloc(t, TF_PACKET_BUF_SIZE) : malloc(TF_PACKET_BUF_SIZE);
+		if (!s->slots[i].packet) {
+			s->nslots = i;
+			stream_free(s);
+			tf->error = TF_ERR_NOMEM;
+			return 0;
+		}
+	}
+
+	if (tf_cmd_get(tf, path, offset, dirent) != 0) {
+		stream_free(s);
+		return 0;
+	}
+
+	stream_waiter_init(&s->filled);
+	stream_waiter_init(&s->space);
+
+	if (pthread_create(&s->thread, 0, stream_reader, s) != 0) {
+		tf_cmd_get_cancel(tf);
+		stream_waiter_destroy(&s->filled);
+		stream_waiter_destroy(&s->space);
+		stream_free(s);
+		tf->error = TF_ERR_NOMEM;
+		return 0;
+	}
+
+	return s;
+}
+
+int tf_stream_next(tf_stream *s, tf_buffer *buf)
+{
+	tf_stream_slot *slot;
+
+	if (s->finished) {
+		return s->result;
+	}
+
+	stream_wait(&s->filled, &s->head, s->next, 0);
+
+	slot = &s->slots[s->next % s->nslots];
+	if (slot->status != 0) {
+		/* The last slot. There is nothing to release */
+		s->finished = 1;
+		s->result = slot->status;
+		return s->result;
+	}
+	s->next++;
+
+	*buf = slot->buf;
+
+	return 0;
+}
+
+void tf_stream_release(tf_stream *s)
+{
+	if (s->tail != s->next) {
+		__atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELEASE);
+		stream_wake(&s->space);
+	}
+}
+
+int tf_stream_close(tf_stream *s)
+{
+	tf_handle *tf = s->tf;
+	int ret = 0;
+
+	__atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+
+	/* The reader may be waiting for space */
+	stream_wake(&s->space);
+	pthread_join(s->thread, 0);
+
+	if (s->status != TF_ERR_DONE) {
+		ret = tf_cmd_get_cancel(tf);
+	}
+
+	stream_waiter_destroy(&s->filled);
+	stream_waiter_destroy(&s->space);
+	stream_free(s);
+
+	return ret;
+}
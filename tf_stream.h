@@ -0,0 +1,82 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_STREAM_H
+#define TF_STREAM_H
+
+/* Streaming file gets.
+ *
+ * A reader thread receives the file into a ring of packet buffers while
+ * the caller consumes them, so that USB reads and writing the data
+ * somewhere else overlap completely.
+ *
+ * Backpressure: the reader only asks the device for the next packet when
+ * a buffer is free. If the caller falls behind, the ring fills, the reader
+ * stops asking and the device waits.
+ */
+
+#include "tf_io.h"
+
+/* Default number of packet buffers in the ring */
+#ifdef TF_LOWMEM
+#define TF_STREAM_DEFAULT_SLOTS 2
+#else
+#define TF_STREAM_DEFAULT_SLOTS 8
+#endif
+
+typedef struct tf_stream tf_stream;
+
+/**
+ * Begins a file get as tf_cmd_get() does, then starts a reader thread
+ * which fills a ring of 'slots' packet buffers (or TF_STREAM_DEFAULT_SLOTS if 0).
+ *
+ * 'tf' must not be used for anything else until tf_stream_close().
+ *
+ * Returns the stream, or 0 on error, in which case the error
+ * is in tf->error and there is nothing to cancel.
+ */
+tf_stream *tf_stream_get(tf_handle *tf, const char *path, __u64 offset, int slots, tf_dirent *dirent);
+
+/**
+ * Waits for the next buffer of data.
+ *
+ * Returns 0 if OK, TF_ERR_DONE once all data has been returned or < 0 on error.
+ * The data remains valid until it is released with tf_stream_release().
+ * The caller may hold several buffers at once, but when the ring is full
+ * the reader waits for one to be released.
+ */
+int tf_stream_next(tf_stream *s, tf_buffer *buf);
+
+/**
+ * Releases the oldest buffer returned by tf_stream_next() which
+ * has not yet been released, so it can be filled again.
+ */
+void tf_stream_release(tf_stream *s);
+
+/**
+ * Stops the reader, cancels the get if it didn't complete and frees the stream.
+ * Returns 0 if OK, or < 0 if the get could not be cancelled.
+ */
+int tf_stream_close(tf_stream *s);
+
+#endif
@@ -0,0 +1,320 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "tf_timing.h"
+#include "tf_proto.h"
+#include "tf_bytes.h"
+
+/* Most FILE_DATA packets whose acknowledgements are remembered as outstanding */
+#define TIMED_QUEUE 128
+
+typedef struct {
+	tf_transport t;
+	tf_transport *inner;
+	tf_timing timing;
+
+	__u64 base;				/* Real time when created, if realtime */
+	__u64 clock;			/* Model time, if not realtime */
+
+	int turbo;				/* Last TURBO setting sent */
+	__u64 link_free;		/* The link is busy until this time */
+	__u64 device_free;		/* The device is busy until this time */
+	__u64 ready[TIMED_QUEUE];	/* When the acknowledgement of each outstanding FILE_DATA is ready */
+	int ready_head;			/* The oldest outstanding FILE_DATA */
+	int ready_count;		/* Number of outstanding FILE_DATA packets */
+	__u64 last_disk;		/* Time of the last disk activity */
+
+	__u8 *held;				/* A reply which has arrived from 'inner' but */
+	ssize_t held_len;		/* has not yet arrived at the host */
+	__u64 held_at;
+} tf_timed;
+
+/* All times are in microseconds */
+
+static __u64 real_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static __u64 timed_now(tf_timed *td)
+{
+	if (td->timing.realtime) {
+		return real_clock() - td->base;
+	}
+	return td->clock;
+}
+
+static void timed_wait_until(tf_timed *td, __u64 when)
+{
+	if (td->timing.realtime) {
+		__u64 now;
+
+		while ((now = timed_now(td)) < when) {
+			struct timespec ts;
+
+			ts.tv_sec = (when - now) / 1000000;
+			ts.tv_nsec = (when - now) % 1000000 * 1000;
+			nanosleep(&ts, 0);
+		}
+	}
+	else if (when > td->clock) {
+		td->clock = when;
+	}
+}
+
+/**
+ * Returns the time taken for 'len' bytes to cross the link.
+ */
+static __u64 timed_xfer(tf_timed *td, size_t len)
+{
+	int bandwidth = td->turbo ? td->timing.turbo_bandwidth : td->timing.bandwidth;
+
+	if (bandwidth <= 0) {
+		return 0;
+	}
+	return (__u64)len * 1000000 / bandwidth;
+}
+
+static __u64 max3(__u64 a, __u64 b, __u64 c)
+{
+	if (b > a) {
+		a = b;
+	}
+	return c > a ? c : a;
+}
+
+/**
+ * Works out when the device will have finished with a request of 'len'
+ * bytes, allowing for the disk spinning up.
+ */
+static void timed_device(tf_timed *td, __u32 cmd, size_t len, __u64 arrived)
+{
+	__u64 begin = arrived > td->device_free ? arrived : td->device_free;
+	int spinning = !td->timing.idle || begin - td->last_disk <= (__u64)td->timing.idle * 1000;
+
+	if ((cmd & 0xFF00) == 0x1000) {
+		/* All the HDD_... commands need the disk */
+		if (!spinning) {
+			begin += (__u64)td->timing.spinup * 1000;
+		}
+		td->last_disk = begin;
+	}
+	else if (cmd == TF_MSG_SUCCESS && spinning) {
+		/* This asks for more of a transfer or listing, which keeps the disk busy */
+		td->last_disk = begin;
+	}
+
+	td->device_free = begin + td->timing.turnaround;
+	if (cmd == TF_MSG_HDD_FILE_DATA && td->timing.write_bandwidth > 0) {
+		td->device_free += (__u64)len * 1000000 / td->timing.write_bandwidth;
+		/* The disk is in use until the write is done */
+		td->last_disk = td->device_free;
+	}
+
+	/* Several FILE_DATA packets may be outstanding during a put, each
+	 * acknowledged in turn. Anything else ends the put
+	 */
+	if (cmd != TF_MSG_HDD_FILE_DATA) {
+		td->ready_count = 0;
+	}
+	else if (td->ready_count < TIMED_QUEUE) {
+		td->ready[(td->ready_head + td->ready_count++) % TIMED_QUEUE] = td->device_free;
+	}
+}
+
+/**
+ * Returns when the next reply is ready. The acknowledgement of a FILE_DATA
+ * is ready as soon as that packet is written, which may be well before
+ * the device has finished with later packets.
+ */
+static __u64 timed_reply_ready(tf_timed *td)
+{
+	__u64 ready;
+
+	if (!td->ready_count) {
+		return td->device_free;
+	}
+	ready = td->ready[td->ready_head];
+	td->ready_head = (td->ready_head + 1) % TIMED_QUEUE;
+	td->ready_count--;
+	return ready;
+}
+
+static ssize_t tf_timed_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	tf_timed *td = (tf_timed *)t;
+	const __u8 *b = buf;
+	__u64 done;
+	__u32 cmd;
+
+	/* A bulk write doesn't complete until the data has crossed the link */
+	done = timed_now(td);
+	if (td->link_free > done) {
+		done = td->link_free;
+	}
+	done += timed_xfer(td, len);
+	td->link_free = done;
+	timed_wait_until(td, done);
+
+	if (len >= PACKET_HEAD_SIZE) {
+		cmd = get_u32_raw(b + 4);
+		if (cmd == TF_MSG_TURBO && len >= PACKET_HEAD_SIZE + 4) {
+			td->turbo = get_u32_raw(b + 8) != 0;
+		}
+		timed_device(td, cmd, len, done);
+	}
+
+	return td->inner->send(td->inner, buf, len, timeout);
+}
+
+static ssize_t tf_timed_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	tf_timed *td = (tf_timed *)t;
+	__u64 now = timed_now(td);
+	__u64 deadline = now + (__u64)timeout * 1000;
+	void *p = buf;
+	ssize_t ret;
+
+	if (data) {
+		*data = buf;
+	}
+
+	if (td->held_len) {
+		ret = td->held_len;
+		if (td->held_at > deadline) {
+			timed_wait_until(td, deadline);
+			return 0;
+		}
+		timed_wait_until(td, td->held_at);
+		memcpy(buf, td->held, (size_t)ret < size ? (size_t)ret : size);
+		td->held_len = 0;
+		return (size_t)ret < size ? ret : (ssize_t)size;
+	}
+
+	ret = td->inner->recv(td->inner, buf, size, data ? &p : 0, timeout);
+	if (ret <= 0) {
+		/* Nothing is coming */
+		timed_wait_until(td, deadline);
+		return ret;
+	}
+
+	/* The reply can't start crossing the link until the device has finished
+	 * with the request and the link is free
+	 */
+	td->link_free = max3(now, timed_reply_ready(td), td->link_free) + timed_xfer(td, ret);
+
+	if (td->link_free > deadline) {
+		/* Too slow, so this is a timeout. Keep the reply for next time */
+		if (!td->held) {
+			td->held = malloc(MAXIMUM_PACKET_SIZE + 1);
+		}
+		if (td->held) {
+			memcpy(td->held, p, ret);
+			td->held_len = ret;
+			td->held_at = td->link_free;
+		}
+		timed_wait_until(td, deadline);
+		return 0;
+	}
+
+	timed_wait_until(td, td->link_free);
+	if (data) {
+		*data = p;
+	}
+	return ret;
+}
+
+static int tf_timed_cancel(tf_transport *t)
+{
+	tf_timed *td = (tf_timed *)t;
+
+	td->held_len = 0;
+	return td->inner->cancel(td->inner);
+}
+
+static int tf_timed_read_ahead(tf_transport *t, int packets)
+{
+	tf_timed *td = (tf_timed *)t;
+
+	return td->inner->read_ahead ? td->inner->read_ahead(td->inner, packets) : 0;
+}
+
+static void tf_timed_close(tf_transport *t)
+{
+	tf_timed *td = (tf_timed *)t;
+
+	td->inner->close(td->inner);
+	free(td->held);
+	free(td);
+}
+
+void tf_timing_defaults(tf_timing *timing)
+{
+	/* These are typical of a TF5000PVR */
+	timing->bandwidth = 2500000;
+	timing->turbo_bandwidth = 6000000;
+	timing->turnaround = 1000;
+	timing->write_bandwidth = 4000000;
+	timing->spinup = 8000;
+	timing->idle = 600000;
+	timing->realtime = 1;
+}
+
+tf_transport *tf_transport_timed(tf_transport *inner, const tf_timing *timing)
+{
+	tf_timed *td;
+
+	if (!inner) {
+		return 0;
+	}
+	td = calloc(1, sizeof(*td));
+	if (!td) {
+		return 0;
+	}
+	td->t.send = tf_timed_send;
+	td->t.recv = tf_timed_recv;
+	td->t.cancel = tf_timed_cancel;
+	td->t.close = tf_timed_close;
+	td->t.read_ahead = tf_timed_read_ahead;
+	td->t.max_read = inner->max_read;
+	td->t.max_write = inner->max_write;
+	td->inner = inner;
+	td->timing = *timing;
+	td->base = real_clock();
+
+	return &td->t;
+}
+
+__u64 tf_timed_clock(tf_transport *t)
+{
+	return timed_now((tf_timed *)t);
+}
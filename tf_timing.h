@@ -0,0 +1,82 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_TIMING_H
+#define TF_TIMING_H
+
+/* A timing model for simulated devices.
+ *
+ * A simulated device answers as fast as memcpy. Wrapping its transport
+ * with tf_transport_timed() makes it answer about as fast as a real Toppy,
+ * so that pipelining, timeouts and cancel latency can be measured sensibly.
+ */
+
+#include "tf_transport.h"
+#include "tf_types.h"
+
+typedef struct {
+	int bandwidth;			/* Link throughput in bytes/second with turbo off, or 0 for unlimited */
+	int turbo_bandwidth;	/* Link throughput in bytes/second with turbo on, or 0 for unlimited */
+	int turnaround;			/* Microseconds taken by the device to act on each request */
+	int write_bandwidth;	/* Bytes/second the device writes FILE_DATA to disk at, or 0 for unlimited */
+	int spinup;				/* Milliseconds taken by the disk to spin up */
+	int idle;				/* The disk spins down after this many ms without a disk command. 0 for never */
+	int realtime;			/* If set, really wait. Otherwise only the model clock advances */
+} tf_timing;
+
+/**
+ * Fills in '*timing' with values which roughly match a TF5000 on USB 2.0.
+ * Time is real.
+ */
+void tf_timing_defaults(tf_timing *timing);
+
+/**
+ * Creates a transport which passes packets to and from 'inner', but
+ * delays them according to '*timing'.
+ *
+ * - Each packet takes len/bandwidth to cross the link, one at a time.
+ *   The bandwidth depends on the last TURBO command sent.
+ * - A reply is not available until the device has acted on the
+ *   most recent request, which takes 'turnaround'. A FILE_DATA packet
+ *   also takes len/write_bandwidth to write. The device acts on one
+ *   request at a time, but while it does, later requests can be
+ *   crossing the link, so a put window hides this time.
+ * - A disk command (HDD_...) after the disk has been idle for 'idle' ms
+ *   first waits 'spinup' ms.
+ * - If a reply would not be available within the recv timeout, recv
+ *   times out and the reply is delivered by a later recv.
+ *
+ * 'inner' should deliver replies as soon as the request is sent,
+ * as tf_transport_sim() does. It is closed when this transport is closed.
+ *
+ * Returns 0 if no memory is available.
+ */
+tf_transport *tf_transport_timed(tf_transport *inner, const tf_timing *timing);
+
+/**
+ * Returns the current time in microseconds on the clock of a transport
+ * created by tf_transport_timed(). This is useful when time is not real.
+ */
+__u64 tf_timed_clock(tf_transport *t);
+
+#endif
@@ -0,0 +1,111 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "tf_transport.h"
+
+/* A transport over a file descriptor which preserves message boundaries */
+typedef struct {
+	tf_transport t;
+	int fd;
+} tf_fd_transport;
+
+static ssize_t tf_fd_send(tf_transport *t, const void *buf, size_t len, int timeout)
+{
+	tf_fd_transport *ft = (tf_fd_transport *)t;
+	struct pollfd pfd;
+
+	pfd.fd = ft->fd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, timeout > 0 ? timeout : -1) <= 0) {
+		return -1;
+	}
+	return write(ft->fd, buf, len);
+}
+
+static ssize_t tf_fd_recv(tf_transport *t, void *buf, size_t size, void **data, int timeout)
+{
+	tf_fd_transport *ft = (tf_fd_transport *)t;
+	struct pollfd pfd;
+	int ret;
+
+	if (data) {
+		*data = buf;
+	}
+
+	pfd.fd = ft->fd;
+	pfd.events = POLLIN;
+	do {
+		ret = poll(&pfd, 1, timeout > 0 ? timeout : timeout < 0 ? 0 : -1);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
+		return ret;
+	}
+	return read(ft->fd, buf, size);
+}
+
+static int tf_fd_cancel(tf_transport *t)
+{
+	/* Nothing is ever in flight */
+	return 0;
+}
+
+static int tf_fd_pollfds(tf_transport *t, struct pollfd *fds, int max)
+{
+	if (max > 0) {
+		fds[0].fd = ((tf_fd_transport *)t)->fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+	}
+	return 1;
+}
+
+static void tf_fd_close(tf_transport *t)
+{
+	tf_fd_transport *ft = (tf_fd_transport *)t;
+
+	close(ft->fd);
+	free(ft);
+}
+
+tf_transport *tf_transport_fd(int fd)
+{
+	tf_fd_transport *ft = calloc(1, sizeof(*ft));
+
+	if (!ft) {
+		return 0;
+	}
+	ft->t.send = tf_fd_send;
+	ft->t.recv = tf_fd_recv;
+	ft->t.cancel = tf_fd_cancel;
+	ft->t.close = tf_fd_close;
+	ft->t.pollfds = tf_fd_pollfds;
+	ft->fd = fd;
+
+	return &ft->t;
+}
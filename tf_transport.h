@@ -0,0 +1,110 @@
+/* $Id$ */
+
+/*
+
+  Copyright (c) 2005 Steve Bennett <msteveb at ozemail.com.au>
+
+  This file is part of libtopfield.
+
+  libtopfield is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef TF_TRANSPORT_H
+#define TF_TRANSPORT_H
+
+/* The transport carries Topfield packets to and from a device.
+ *
+ * The protocol code in tf_io.c and tf_fwio.c only talks to the device
+ * through this interface, so it can run over a real USB device or over
+ * anything else which can carry packets, such as a socketpair.
+ *
+ * A transport implementation embeds a tf_transport as its first member.
+ */
+
+#include <sys/types.h>
+#include <poll.h>
+
+typedef struct tf_transport tf_transport;
+
+struct tf_transport {
+	/**
+	 * Sends 'len' bytes as a single transfer.
+	 * Returns the number of bytes sent or < 0 on error.
+	 */
+	ssize_t (*send)(tf_transport *t, const void *buf, size_t len, int timeout);
+
+	/**
+	 * Receives a single transfer of at most 'size' bytes into 'buf'.
+	 * If 'data' is not NULL, the transport may instead leave the transfer
+	 * where it is and set '*data' to point to it (otherwise '*data' is
+	 * set to 'buf'). Such data may be modified in place and remains
+	 * valid until the next call to recv or cancel.
+	 *
+	 * A timeout of 0 waits forever. A negative timeout doesn't wait at
+	 * all, but is only used with transports which provide pollfds.
+	 *
+	 * Returns the number of bytes received, or <= 0 on error or timeout.
+	 */
+	ssize_t (*recv)(tf_transport *t, void *buf, size_t size, void **data, int timeout);
+
+	/**
+	 * Abandons any transfers in flight, discarding any data which
+	 * has been received but not yet returned by recv.
+	 * Returns 0 if OK or < 0 on error.
+	 */
+	int (*cancel)(tf_transport *t);
+
+	/**
+	 * Closes the transport and frees it.
+	 */
+	void (*close)(tf_transport *t);
+
+	/**
+	 * Optional. Starts receiving up to 'packets' packets ahead of recv.
+	 * Read-ahead continues until cancel is called.
+	 */
+	int (*read_ahead)(tf_transport *t, int packets);
+
+	/**
+	 * Optional. Allocates and frees buffers which the transport can
+	 * transfer to or from most efficiently.
+	 * If not provided, malloc() and free() are used.
+	 */
+	void *(*alloc)(tf_transport *t, size_t size);
+	void (*free)(tf_transport *t, void *buf);
+
+	/**
+	 * Optional. Fills in up to 'max' entries of 'fds' with descriptors
+	 * which become ready when there may be something for recv.
+	 * Returns the number of entries needed, which may be more than 'max',
+	 * or -1 on error.
+	 */
+	int (*pollfds)(tf_transport *t, struct pollfd *fds, int max);
+
+	int max_read;				/* Largest single read of the underlying device, or 0 */
+	int max_write;				/* Largest single write of the underlying device, or 0 */
+};
+
+/**
+ * Creates a transport which sends and receives packets over the
+ * given file descriptor. The descriptor must preserve message
+ * boundaries, for example one end of a SOCK_SEQPACKET socketpair.
+ * The descriptor is closed when the transport is closed.
+ *
+ * Returns 0 if no memory is available.
+ */
+tf_transport *tf_transport_fd(int fd);
+
+#endif
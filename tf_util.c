@@ -25,72 +25,246 @@
 #include <stdlib.h>
 
 #include "tf_util.h"
-
-int tf_stat(tf_handle *tf, const char *path, tf_dirent *dirent)
+#include "tf_cache.h"
+
+/* One of the paths given to tf_stat_many() */
+struct stat_request {
+	const char *path;
+	const char *name;	/* Last component of the path */
+	int parent_len;		/* Length of the parent directory, or 0 for the root */
+	int index;			/* Index into the caller's arrays */
+	int same;			/* Next request in this group for the same name, or -1 */
+};
+
+static int cmp_request_parent(const void *r1, const void *r2)
 {
-	char *pt;
+	const struct stat_request *req1 = r1;
+	const struct stat_request *req2 = r2;
+	int len = req1->parent_len < req2->parent_len ? req1->parent_len : req2->parent_len;
+	int rc = memcmp(req1->path, req2->path, len);
 
-	/* If this is the root directory, just fake the result */
-	if (strcmp(path, "/") == 0) {
-		dirent->type = 'd';
-		dirent->stamp = 0;
-		dirent->size = 0;
-		dirent->attrib = 0;
-		strcpy(dirent->name, "/");
+	return rc ? rc : req1->parent_len - req2->parent_len;
+}
+
+/**
+ * Looks up 'count' requests which all have the same parent directory.
+ * The parent is listed once, and the listed names are looked up in a hash
+ * table of the names wanted, until every one has been found.
+ */
+static int stat_group(tf_handle *tf, struct stat_request *req, int count, tf_dirent *dirents, int *results)
+{
+	const tf_dirent_view *view;
+	tf_dir_iter it;
+	unsigned size = 1;
+	unsigned mask;
+	int *table;
+	int remaining = 0;
+	char *parent;
+	int rc;
+	int i;
+
+	/* If the parent is cached, that is all we need */
+	rc = tf_cache_stat(tf, req[0].path, &dirents[req[0].index]);
+	if (rc >= 0) {
+		results[req[0].index] = rc;
+		for (i = 1; i < count; i++) {
+			results[req[i].index] = tf_cache_stat(tf, req[i].path, &dirents[req[i].index]);
+		}
 		return 0;
 	}
-	else {
-		int ret;
-		int rc;
-		tf_dir_entries entries;
-
-		/* Examine the parent directory */
-		char *parent;
-		pt = strrchr(path, '/');
-		if (!pt) {
-			/* Not a valid file or directory */
-			fprintf(stderr, "Directory '%s' has no parent\n", path);
-			return 1;
+
+	while (size < 2 * count) {
+		size *= 2;
+	}
+	mask = size - 1;
+	table = calloc(size, sizeof(*table));
+	parent = req[0].parent_len ? strndup(req[0].path, req[0].parent_len) : strdup("/");
+	if (!table || !parent) {
+		free(table);
+		free(parent);
+		return TF_ERR_NOMEM;
+	}
+
+	/* Index the names wanted. Each slot holds a request number + 1 */
+	for (i = 0; i < count; i++) {
+		unsigned h;
+
+		results[req[i].index] = 1;
+		req[i].same = -1;
+		for (h = tf_hash_name(req[i].name) & mask; table[h]; h = (h + 1) & mask) {
+			if (strcmp(req[table[h] - 1].name, req[i].name) == 0) {
+				break;
+			}
 		}
-		if (pt == path) {
-			/* In the root directory, like "\abc" */
-			parent = strdup("/");
+		if (table[h]) {
+			/* The same name more than once */
+			req[i].same = req[table[h] - 1].same;
+			req[table[h] - 1].same = i;
 		}
 		else {
-			parent = strdup(path);
-			parent[pt - path] = 0;
+			table[h] = i + 1;
+			remaining++;
 		}
-		path = pt + 1;
-
-		ret = tf_cmd_dir_first(tf, parent, &entries);
-
-		rc = 1;
-		if (ret != 0) {
-			/* Failed to examine parent directory */
-			fprintf(stderr, "parent dir_first failed for '%s'\n", parent);
-		} else {
-			while (ret == 0) {
-				int i;
-
-				for (i = 0; i < entries.count; i++) {
-					/*fprintf(stderr, "Comparing %s with %s\n", entries.entry[i].name, path);*/
-					if (strcmp(entries.entry[i].name, path) == 0) {
-						*dirent = entries.entry[i];
-						tf_cmd_dir_cancel(tf);
-						rc = 0;
-						break;
-					}
-				}
-				if (rc == 0) {
-					break;
+	}
+
+	rc = tf_dir_open(tf, parent, &it);
+	while (rc == 0 && remaining && (rc = tf_dir_read_view(&it, &view)) == 0) {
+		const char *name = tf_dirent_view_name(view);
+		unsigned h;
+
+		for (h = tf_hash_name(name) & mask; table[h]; h = (h + 1) & mask) {
+			int j = table[h] - 1;
+
+			if (strcmp(req[j].name, name) == 0) {
+				for (; j >= 0; j = req[j].same) {
+					tf_dirent_view_unpack(view, &dirents[req[j].index]);
+					results[req[j].index] = 0;
 				}
-				ret = tf_cmd_dir_next(tf, &entries);
+				remaining--;
+				break;
 			}
 		}
 
-		free(parent);
+		/* A listing from the device which is being cached is worth finishing */
+		if (!remaining && tf->cache && !it.cached) {
+			while ((rc = tf_dir_read_view(&it, &view)) == 0) {
+			}
+		}
+	}
+	tf_dir_close(&it);
+
+	if (rc < 0) {
+		for (i = 0; i < count; i++) {
+			if (results[req[i].index] == 1) {
+				results[req[i].index] = rc;
+			}
+		}
+	}
+
+	free(table);
+	free(parent);
+	return 0;
+}
+
+int tf_stat_many(tf_handle *tf, const char *const *paths, int count, tf_dirent *dirents, int *results)
+{
+	struct stat_request *req;
+	int n = 0;
+	int i;
+
+	if (count <= 0) {
+		return 0;
+	}
+	req = malloc(count * sizeof(*req));
+	if (!req) {
+		return TF_ERR_NOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		const char *pt = strrchr(paths[i], '/');
+
+		if (strcmp(paths[i], "/") == 0) {
+			/* This is the root directory, so just fake the result */
+			tf_dirent *dirent = &dirents[i];
+
+			dirent->type = 'd';
+			dirent->stamp = 0;
+			dirent->size = 0;
+			dirent->attrib = 0;
+			strcpy(dirent->name, "/");
+			results[i] = 0;
+		}
+		else if (!pt || !pt[1]) {
+			/* Not a valid file or directory, or nothing after the last / */
+			results[i] = 1;
+		}
+		else {
+			req[n].path = paths[i];
+			req[n].name = pt + 1;
+			req[n].parent_len = pt - paths[i];
+			req[n].index = i;
+			n++;
+		}
+	}
+
+	/* Group the paths by parent directory, so that each is listed once */
+	qsort(req, n, sizeof(*req), cmp_request_parent);
+
+	for (i = 0; i < n; ) {
+		int j = i + 1;
+
+		while (j < n && cmp_request_parent(&req[i], &req[j]) == 0) {
+			j++;
+		}
+		if (stat_group(tf, &req[i], j - i, dirents, results) != 0) {
+			free(req);
+			return TF_ERR_NOMEM;
+		}
+		i = j;
+	}
+
+	free(req);
+	return 0;
+}
+
+int tf_stat_probe(tf_handle *tf, const char *path, tf_dirent *dirent)
+{
+	const char *name = strrchr(path, '/');
+	int rc;
+
+	if (!name || !name[1]) {
+		return 1;
+	}
+
+	rc = tf_cmd_get_probe(tf, path, dirent);
+	if (rc == TF_ERR_GENERR) {
+		/* This is how the device refuses directories and missing files alike */
+		return 1;
+	}
+	if (rc != 0) {
 		return rc;
 	}
+
+	/* Name it as a listing would */
+	snprintf(dirent->name, sizeof(dirent->name), "%s", name + 1);
+	return 0;
+}
+
+int tf_stat(tf_handle *tf, const char *path, tf_dirent *dirent)
+{
+	int rc;
+
+	if (!strchr(path, '/')) {
+		/* Not a valid file or directory */
+		fprintf(stderr, "Directory '%s' has no parent\n", path);
+		return 1;
+	}
+	if (tf->fast_stat && strcmp(path, "/") != 0 && tf_cache_stat(tf, path, dirent) < 0) {
+		rc = tf_stat_probe(tf, path, dirent);
+		if (rc != 1) {
+			return rc;
+		}
+	}
+	if (tf_stat_many(tf, &path, 1, dirent, &rc) != 0) {
+		return TF_ERR_NOMEM;
+	}
+	if (rc < 0) {
+		/* Failed to examine parent directory */
+		fprintf(stderr, "parent dir_first failed for '%s'\n", path);
+		return 1;
+	}
+	return rc;
+}
+
+unsigned tf_hash_name(const char *name)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	}
+	return h;
 }
 
 char *tf_makename(const char *dir, const char *filename)
@@ -310,3 +484,313 @@ void tf_sort_dirents(tf_dir_entries *entries, int sort_type)
 
 	}
 }
+
+int tf_dir_list(tf_handle *tf, const char *path, tf_dir_listing *listing, int sort_type)
+{
+	tf_dir_iter it;
+	int ret;
+
+	listing->count = 0;
+	listing->size = 0;
+	listing->entry = 0;
+
+	ret = tf_dir_open(tf, path, &it);
+
+	while (ret == 0) {
+		if (listing->count == listing->size) {
+			int size = listing->size ? listing->size * 2 : MAX_DIR_ENTRIES;
+			tf_dirent *grown = realloc(listing->entry, size * sizeof(*grown));
+
+			if (!grown) {
+				ret = TF_ERR_NOMEM;
+				break;
+			}
+			listing->entry = grown;
+			listing->size = size;
+		}
+		ret = tf_dir_read(&it, &listing->entry[listing->count]);
+		if (ret == 0) {
+			listing->count++;
+		}
+	}
+	tf_dir_close(&it);
+
+	if (ret == TF_ERR_DONE) {
+		ret = sort_type ? tf_sort_listing(listing, sort_type) : 0;
+	}
+	return ret;
+}
+
+void tf_dir_listing_free(tf_dir_listing *listing)
+{
+	free(listing->entry);
+	listing->entry = 0;
+	listing->count = 0;
+	listing->size = 0;
+}
+
+/* Sort key for TF_SORT_SIZE and TF_SORT_TIME.
+ * 'value' is arranged so that ascending order is the order wanted.
+ */
+struct num_key {
+	__u64 value;
+	int index;
+	char type;
+};
+
+/* Sort key for TF_SORT_NAME.
+ * 'prefix' is the first 8 bytes of the folded name after whatever every
+ * name starts with, big endian and padded with zeros, so most comparisons
+ * never look at the name itself.
+ */
+struct name_key {
+	__u64 prefix;
+	const char *name;	/* Case folded copy of the name, from the prefix on */
+	int index;
+	char type;
+};
+
+static inline int num_key_less(const struct num_key *k1, const struct num_key *k2)
+{
+	/* Directories always come first */
+	if (k1->type != k2->type) {
+		return k1->type < k2->type;
+	}
+	return k1->value < k2->value;
+}
+
+static inline int name_key_less(const struct name_key *k1, const struct name_key *k2)
+{
+	if (k1->type != k2->type) {
+		return k1->type < k2->type;
+	}
+	if (k1->prefix != k2->prefix) {
+		return k1->prefix < k2->prefix;
+	}
+	if (!(k1->prefix & 0xff)) {
+		/* Both names end within the prefix, so they are the same */
+		return 0;
+	}
+	return strcmp(k1->name + 8, k2->name + 8) < 0;
+}
+
+/* Runs shorter than this are insertion sorted */
+#define SORT_RUN 16
+
+/**
+ * Defines a stable merge sort of 'n' keys of type TYPE, with LESS inlined.
+ * 'tmp' must have room for n / 2 keys.
+ */
+#define DEFINE_MERGE_SORT(NAME, TYPE, LESS) \
+static void NAME(TYPE *a, TYPE *tmp, int n) \
+{ \
+	int half = n / 2; \
+	int i; \
+	int j; \
+	int o; \
+\
+	if (n <= SORT_RUN) { \
+		for (i = 1; i < n; i++) { \
+			TYPE k = a[i]; \
+\
+			for (j = i; j > 0 && LESS(&k, &a[j - 1]); j--) { \
+				a[j] = a[j - 1]; \
+			} \
+			a[j] = k; \
+		} \
+		return; \
+	} \
+\
+	NAME(a, tmp, half); \
+	NAME(a + half, tmp, n - half); \
+	if (!LESS(&a[half], &a[half - 1])) { \
+		/* Already in order, as listings often are */ \
+		return; \
+	} \
+\
+	/* Merge the first half, moved out of the way, with the second */ \
+	memcpy(tmp, a, half * sizeof(*a)); \
+	for (i = 0, j = half, o = 0; i < half && j < n; o++) { \
+		a[o] = LESS(&a[j], &tmp[i]) ? a[j++] : tmp[i++]; \
+	} \
+	memcpy(&a[o], &tmp[i], (half - i) * sizeof(*a)); \
+}
+
+DEFINE_MERGE_SORT(sort_num_keys, struct num_key, num_key_less)
+DEFINE_MERGE_SORT(sort_name_keys, struct name_key, name_key_less)
+
+/**
+ * Puts the entries of the listing in the order of the sorted keys,
+ * in place, by following each cycle of the permutation.
+ * 'index' is the index field of the first key, and the keys are
+ * 'stride' bytes apart. The indexes are used up.
+ */
+static inline int *key_index(int *index, size_t stride, int i)
+{
+	return (int *)((char *)index + i * stride);
+}
+
+static void reorder_listing(tf_dir_listing *listing, int *index, size_t stride)
+{
+	int i;
+
+	for (i = 0; i < listing->count; i++) {
+		if (*key_index(index, stride, i) != i) {
+			tf_dirent first = listing->entry[i];
+			int j = i;
+			int k;
+
+			while ((k = *key_index(index, stride, j)) != i) {
+				listing->entry[j] = listing->entry[k];
+				*key_index(index, stride, j) = j;
+				j = k;
+			}
+			listing->entry[j] = first;
+			*key_index(index, stride, j) = j;
+		}
+	}
+}
+
+/**
+ * Sorts by name, with the names folded to lower case once up front
+ * rather than by strcasecmp() on every comparison.
+ */
+static int sort_listing_by_name(tf_dir_listing *listing, int reverse)
+{
+	int count = listing->count;
+	struct name_key *key = malloc(count * sizeof(*key));
+	struct name_key *tmp = malloc((count / 2 + 1) * sizeof(*tmp));
+	size_t len = 0;
+	char *folded;
+	char *pt;
+	int ret = TF_ERR_NOMEM;
+	int i;
+
+	/* Keep the folded names close together */
+	for (i = 0; i < count; i++) {
+		len += strlen(listing->entry[i].name) + 1;
+	}
+	pt = folded = malloc(len);
+
+	if (key && tmp && folded) {
+		size_t common = len;
+
+		for (i = 0; i < count; i++) {
+			const char *name = listing->entry[i].name;
+			size_t j;
+
+			key[i].name = pt;
+			for (j = 0; name[j]; j++) {
+				unsigned char c = name[j];
+
+				*pt++ = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+			}
+			*pt++ = 0;
+
+			/* How much every name starts with, such as "recording_" */
+			for (j = 0; j < common && key[i].name[j] && key[i].name[j] == key[0].name[j]; j++) {
+			}
+			common = j;
+		}
+
+		/* So the prefixes start where the names begin to differ */
+		for (i = 0; i < count; i++) {
+			const char *name = key[i].name + common;
+			__u64 prefix = 0;
+			int j;
+
+			for (j = 0; j < 8; j++) {
+				prefix = (prefix << 8) | (unsigned char)*name;
+				if (*name) {
+					name++;
+				}
+			}
+			key[i].prefix = prefix;
+			key[i].name += common;
+			key[i].index = i;
+			key[i].type = listing->entry[i].type;
+		}
+		sort_name_keys(key, tmp, count);
+
+		if (reverse) {
+			/* Reverse the names, but keep directories first */
+			for (i = 0; i < count; ) {
+				int j = i;
+				int k;
+
+				while (j < count && key[j].type == key[i].type) {
+					j++;
+				}
+				for (k = j - 1; i < k; i++, k--) {
+					struct name_key t = key[i];
+
+					key[i] = key[k];
+					key[k] = t;
+				}
+				i = j;
+			}
+		}
+		reorder_listing(listing, &key->index, sizeof(*key));
+		ret = 0;
+	}
+
+	free(folded);
+	free(tmp);
+	free(key);
+	return ret;
+}
+
+static int sort_listing_by_number(tf_dir_listing *listing, int sort_type)
+{
+	int count = listing->count;
+	struct num_key *key = malloc(count * sizeof(*key));
+	struct num_key *tmp = malloc((count / 2 + 1) * sizeof(*tmp));
+	int ret = TF_ERR_NOMEM;
+	int i;
+
+	if (key && tmp) {
+		for (i = 0; i < count; i++) {
+			const tf_dirent *entry = &listing->entry[i];
+			__u64 value;
+
+			if (sort_type == TF_SORT_TIME || sort_type == -TF_SORT_TIME) {
+				/* Flip the sign bit so that signed times compare as unsigned */
+				value = (__u64)(long long)entry->stamp ^ (1ULL << 63);
+			}
+			else {
+				value = entry->size;
+			}
+			/* Newest and largest first, unless reversed */
+			key[i].value = sort_type > 0 ? ~value : value;
+			key[i].index = i;
+			key[i].type = entry->type;
+		}
+		sort_num_keys(key, tmp, count);
+		reorder_listing(listing, &key->index, sizeof(*key));
+		ret = 0;
+	}
+
+	free(tmp);
+	free(key);
+	return ret;
+}
+
+int tf_sort_listing(tf_dir_listing *listing, int sort_type)
+{
+	if (listing->count < 2) {
+		return 0;
+	}
+
+	switch (sort_type) {
+		case TF_SORT_NAME:
+		case -TF_SORT_NAME:
+			return sort_listing_by_name(listing, sort_type < 0);
+
+		case TF_SORT_SIZE:
+		case -TF_SORT_SIZE:
+		case TF_SORT_TIME:
+		case -TF_SORT_TIME:
+			return sort_listing_by_number(listing, sort_type);
+	}
+	return 0;
+}
@@ -34,6 +34,38 @@
  */
 int tf_stat(tf_handle *tf, const char *path, tf_dirent *dirent);
 
+/**
+ * Examines the regular file 'path' without listing its parent directory,
+ * by starting a get and taking the details from the HDD_FILE_START reply
+ * (see tf_cmd_get_probe()). The get is cancelled before any data is sent.
+ *
+ * tf_stat() uses this first if tf->fast_stat is set, and lists the parent
+ * only if this returns 1.
+ *
+ * Returns 0 if OK, 1 if the device refused with TF_ERR_GENERR (the path
+ * is a directory or does not exist), or < 0 on any other error.
+ */
+int tf_stat_probe(tf_handle *tf, const char *path, tf_dirent *dirent);
+
+/**
+ * Examines each of the 'count' pathnames in 'paths' as tf_stat() does,
+ * but lists each parent directory only once, however many of the paths
+ * are in it, and stops listing it once every name has been found.
+ *
+ * The details of paths[i] are stored in dirents[i], and results[i]
+ * is set to 0 if it was found, 1 if not, or < 0 if its parent could
+ * not be listed.
+ *
+ * Returns 0 if OK, or < 0 if out of memory.
+ */
+int tf_stat_many(tf_handle *tf, const char *const *paths, int count, tf_dirent *dirents, int *results);
+
+/**
+ * Returns a hash of the given name (FNV-1a), for looking up names
+ * in hash tables.
+ */
+unsigned tf_hash_name(const char *name);
+
 /**
  * Takes a directory and a filename and produces an absolute pathname
  * which refers to the file.
@@ -59,9 +91,42 @@ enum {
 /**
  * Sorts the directory entries returned from tf_cmd_dir_first()/tf_cmd_dir_next()
  * according to the given sort type.
+ * This only sorts one batch. To sort a whole directory, use tf_dir_list().
  *
  * Use a negative number (e.g. -TF_SORT_NAME) to sort in reverse order.
  */
 void tf_sort_dirents(tf_dir_entries *entries, int sort_type);
 
+/**
+ * Every entry of a directory, as returned by tf_dir_list()
+ */
+typedef struct {
+	int count;			/* Number of valid entries in the entry[] array */
+	int size;			/* Number of entries there is room for */
+	tf_dirent *entry;	/* Directory entries (malloc'd) */
+} tf_dir_listing;
+
+/**
+ * Gathers every entry of the directory 'path' into '*listing',
+ * however many DIRENT batches that takes, and sorts them all
+ * with tf_sort_listing() if 'sort_type' is not 0.
+ *
+ * Returns 0 if OK or < 0 on error.
+ * tf_dir_listing_free() must be called in either case.
+ */
+int tf_dir_list(tf_handle *tf, const char *path, tf_dir_listing *listing, int sort_type);
+
+/**
+ * Sorts a whole listing in the same orders as tf_sort_dirents(),
+ * but with the keys worked out once per entry rather than per comparison.
+ *
+ * Returns 0 if OK or TF_ERR_NOMEM, in which case the listing is unchanged.
+ */
+int tf_sort_listing(tf_dir_listing *listing, int sort_type);
+
+/**
+ * Frees the entries of a listing filled in by tf_dir_list().
+ */
+void tf_dir_listing_free(tf_dir_listing *listing);
+
 #endif
@@ -32,21 +32,43 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
 #include <asm/byteorder.h>
 #include "usb_io.h"
+#include "usbutil.h"
 
-/* Linux usbdevfs has a limit of one page size per read/write.
-   4096 is the most portable maximum we can do for now.
+/* The largest single read/write is chosen by open_usb_dev()
+   according to what the running kernel supports.
 */
 
-/* REVISIT: perhaps dynamically determine if this needs to be 4096 */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,0)
-#define MAX_READ    16384
-#define MAX_WRITE   16384
-#else
-#define MAX_READ    4096
-#define MAX_WRITE   4096
-#endif
+/* State of the read-ahead queue. URBs are submitted in index order
+   and, since they are all on the same endpoint, complete in that order.
+
+   Where the kernel supports bulk continuation, the URBs are grouped into
+   slots of a whole packet each. A short URB ends the transfer and the
+   kernel cancels the rest of its slot, so every transfer starts at the
+   beginning of a slot. A slot is only ever resubmitted as a whole.
+*/
+struct usb_read_queue
+{
+    int ep;
+    int depth;
+    int per_slot;               /* URBs per slot, or 1 without bulk continuation */
+    int head;                   /* Index of the oldest outstanding URB */
+    int active;                 /* Number of URBs submitted and not yet reaped */
+    int held;                   /* First URB whose data was handed out by usb_read_queue_get(), or -1 */
+    int nheld;                  /* Number of URBs handed out from 'held' on */
+    struct usbdevfs_urb *urb;   /* 'depth' URBs */
+    int *done;                  /* Set when the corresponding URB has been reaped */
+    __u8 *buf;                  /* 'depth' buffers of urb[0].buffer_length bytes, back to back */
+    __u8 *assembly;             /* Used to reassemble transfers which wrap around 'buf' */
+    ssize_t assembly_size;
+};
+
+static ssize_t rq_bulk_read(struct usb_dev_handle *dev, __u8 * bytes, ssize_t size, int timeout);
+static int rq_wait(struct usb_dev_handle *dev, int i, int timeout);
+static int rq_reaped(struct usb_dev_handle *dev, struct usbdevfs_urb *urb);
 
 static inline unsigned short get_u16(const void *addr)
 {
@@ -55,10 +77,136 @@ static inline unsigned short get_u16(const void *addr)
     return ((b[0] << 8) & 0xff00) | ((b[1] << 0) & 0x00ff);
 }
 
+/* Returns non-zero if the buffer lies entirely within memory mapped from usbfs */
+static int is_mmapped(struct usb_dev_handle *dev, const void *bytes, size_t len)
+{
+    struct usb_mmap_region *region;
+
+    for(region = dev->mmaps; region; region = region->next)
+    {
+        const __u8 *start = region->addr;
+
+        if((const __u8 *) bytes >= start && (const __u8 *) bytes + len <= start + region->len)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Waits for a completed URB, for at most 'timeout' ms (0 means forever).
+   Returns the URB, or NULL on timeout (errno = ETIMEDOUT) or error.
+*/
+static struct usbdevfs_urb *reap_urb(struct usb_dev_handle *dev, int timeout)
+{
+    struct timeval deadline;
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_usec += (timeout % 1000) * 1000;
+
+    for(;;)
+    {
+        struct usbdevfs_urb *urb;
+        struct pollfd pfd;
+        struct timeval now;
+        int ms;
+
+        if(ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+        {
+            return urb;
+        }
+        if(errno != EAGAIN)
+        {
+            return NULL;
+        }
+
+        /* usbfs signals completed URBs as writable */
+        gettimeofday(&now, NULL);
+        ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_usec - now.tv_usec) / 1000;
+        if(timeout <= 0)
+        {
+            ms = -1;
+        }
+        else if(ms <= 0)
+        {
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+        pfd.fd = dev->fd;
+        pfd.events = POLLOUT;
+        if(poll(&pfd, 1, ms) < 0 && errno != EINTR)
+        {
+            return NULL;
+        }
+    }
+}
+
+/* Transfers a single chunk. If the buffer was mapped from usbfs, this is done
+   with a URB so that the kernel transfers directly to or from it. Otherwise
+   a plain (copying) USBDEVFS_BULK is used.
+   Returns the number of bytes transferred or < 0 on error.
+*/
+static ssize_t bulk_chunk(struct usb_dev_handle *dev, int ep, __u8 * bytes, ssize_t len, int timeout)
+{
+    struct usbdevfs_bulktransfer bulk;
+    struct usbdevfs_urb urb;
+    struct usbdevfs_urb *reaped;
+
+    if(!is_mmapped(dev, bytes, len))
+    {
+        bulk.ep = ep;
+        bulk.len = len;
+        bulk.timeout = timeout;
+        bulk.data = bytes;
+
+        return ioctl(dev->fd, USBDEVFS_BULK, &bulk);
+    }
+
+    memset(&urb, 0, sizeof(urb));
+    urb.type = USBDEVFS_URB_TYPE_BULK;
+    urb.endpoint = ep;
+    urb.buffer = bytes;
+    urb.buffer_length = len;
+
+    if(ioctl(dev->fd, USBDEVFS_SUBMITURB, &urb) < 0)
+    {
+        return -1;
+    }
+
+    /* Read-ahead URBs may complete while we wait */
+    do
+    {
+        reaped = reap_urb(dev, timeout);
+    }
+    while(reaped && reaped != &urb && rq_reaped(dev, reaped));
+
+    if(reaped != &urb)
+    {
+        /* Timed out, so take it back from the kernel */
+        ioctl(dev->fd, USBDEVFS_DISCARDURB, &urb);
+        while(reaped != &urb)
+        {
+            if(ioctl(dev->fd, USBDEVFS_REAPURB, &reaped) < 0)
+            {
+                break;
+            }
+            rq_reaped(dev, reaped);
+        }
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if(urb.status < 0)
+    {
+        errno = -urb.status;
+        return -1;
+    }
+    return urb.actual_length;
+}
+
 /* This function is adapted from libusb */
 ssize_t usb_bulk_write(struct usb_dev_handle *dev, int ep, const __u8 * bytes, ssize_t length, int timeout)
 {
-    struct usbdevfs_bulktransfer bulk;
     ssize_t ret;
     ssize_t sent = 0;
 
@@ -67,17 +215,13 @@ ssize_t usb_bulk_write(struct usb_dev_handle *dev, int ep, const __u8 * bytes, s
 
     do
     {
-        bulk.ep = ep;
-        bulk.len = length - sent;
-        if(bulk.len > MAX_WRITE)
+        ssize_t len = length - sent;
+        if(len > dev->max_write)
         {
-            bulk.len = MAX_WRITE;
+            len = dev->max_write;
         }
 
-        bulk.timeout = timeout;
-        bulk.data = (__u8 *) bytes + sent;
-
-        ret = ioctl(dev->fd, USBDEVFS_BULK, &bulk);
+        ret = bulk_chunk(dev, ep, (__u8 *) bytes + sent, len, timeout);
         if(ret < 0)
         {
 #ifdef DEBUG
@@ -104,28 +248,29 @@ ssize_t usb_bulk_write(struct usb_dev_handle *dev, int ep, const __u8 * bytes, s
 /* This function is adapted from libusb */
 ssize_t usb_bulk_read(struct usb_dev_handle *dev, int ep, __u8 * bytes, ssize_t size, int timeout)
 {
-    struct usbdevfs_bulktransfer bulk;
     ssize_t ret;
     ssize_t retrieved = 0;
     ssize_t requested;
 
-    memset(bytes, 0, size);
-
     /* Ensure the endpoint address is correct */
     ep |= USB_ENDPOINT_DIR_MASK;
 
+    if(dev->rq && dev->rq->ep == ep)
+    {
+        return rq_bulk_read(dev, bytes, size, timeout);
+    }
+
+    /* Note that there is no need to clear the buffer first.
+       The caller only looks at what was actually retrieved.
+    */
     do
     {
-        bulk.ep = ep;
         requested = size - retrieved;
-        if (requested > MAX_READ) {
-            requested = MAX_READ;
+        if (requested > dev->max_read) {
+            requested = dev->max_read;
         }
-        bulk.len = requested;
-        bulk.timeout = timeout;
-        bulk.data = (unsigned char *) bytes + retrieved;
 
-        ret = ioctl(dev->fd, USBDEVFS_BULK, &bulk);
+        ret = bulk_chunk(dev, ep, bytes + retrieved, requested, timeout);
         if(ret < 0)
         {
 #ifdef DEBUG
@@ -143,3 +288,382 @@ ssize_t usb_bulk_read(struct usb_dev_handle *dev, int ep, __u8 * bytes, ssize_t
     return retrieved;
 }
 
+static int rq_submit(struct usb_dev_handle *dev, int i)
+{
+    struct usb_read_queue *rq = dev->rq;
+    struct usbdevfs_urb *urb = &rq->urb[i];
+
+    urb->status = 0;
+    urb->actual_length = 0;
+    rq->done[i] = 0;
+
+    if(ioctl(dev->fd, USBDEVFS_SUBMITURB, urb) < 0)
+    {
+#ifdef DEBUG
+        fprintf(stderr, "error submitting urb to bulk endpoint 0x%x: %s\n",
+                rq->ep, strerror(errno));
+#endif
+        return -1;
+    }
+    rq->active++;
+    return 0;
+}
+
+/* Accounts for a URB which was reaped outside the queue.
+   Returns 1 if it belonged to the queue.
+*/
+static int rq_reaped(struct usb_dev_handle *dev, struct usbdevfs_urb *urb)
+{
+    struct usb_read_queue *rq = dev->rq;
+
+    if(rq && urb >= rq->urb && urb < rq->urb + rq->depth)
+    {
+        rq->done[urb - rq->urb] = 1;
+        rq->active--;
+        return 1;
+    }
+    return 0;
+}
+
+/* Gives back the URBs previously handed out by usb_read_queue_get() */
+static void rq_release(struct usb_dev_handle *dev)
+{
+    struct usb_read_queue *rq = dev->rq;
+
+    if(rq->held >= 0)
+    {
+        int i;
+
+        for(i = 0; i < rq->nheld; i++)
+        {
+            /* The rest of a slot ended by a short URB has been cancelled
+               by the kernel, but a slot ended otherwise may still have
+               URBs waiting for data.
+            */
+            if(!rq->done[rq->held + i])
+            {
+                ioctl(dev->fd, USBDEVFS_DISCARDURB, &rq->urb[rq->held + i]);
+                rq_wait(dev, rq->held + i, 0);
+            }
+        }
+        for(i = 0; i < rq->nheld; i++)
+        {
+            rq_submit(dev, rq->held + i);
+        }
+        rq->held = -1;
+        rq->nheld = 0;
+    }
+}
+
+/* Reaps completed URBs until URB 'i' has completed.
+   Returns 1 if it has completed, 0 on timeout or -1 on error.
+   As for USBDEVFS_BULK, a timeout of 0 means wait forever.
+*/
+static int rq_wait(struct usb_dev_handle *dev, int i, int timeout)
+{
+    struct usb_read_queue *rq = dev->rq;
+
+    while(!rq->done[i])
+    {
+        struct usbdevfs_urb *urb;
+
+        if(rq->active == 0)
+        {
+            /* Nothing in flight, so nothing will ever complete */
+            return -1;
+        }
+
+        urb = reap_urb(dev, timeout);
+        if(!urb)
+        {
+            return errno == ETIMEDOUT ? 0 : -1;
+        }
+        rq_reaped(dev, urb);
+    }
+    return 1;
+}
+
+/* Takes the next transfer from the queue in place, holding its URBs until
+   the next read. Returns its length (0 on timeout or error), or -1 if it
+   wraps around the end of the queue (or failed) and must be reassembled.
+*/
+static ssize_t rq_get(struct usb_dev_handle *dev, __u8 **bytes, ssize_t size, int timeout)
+{
+    struct usb_read_queue *rq = dev->rq;
+    /* The URB buffers are back to back, so unless the transfer wraps
+       around the end of the queue, it has landed in one piece.
+       With slots, it never runs past the end of its slot.
+    */
+    int end = rq->per_slot > 1 ? rq->head + rq->per_slot : rq->depth;
+    ssize_t len = 0;
+    int in_place = 0;
+    int n = 0;
+
+    while(!in_place && rq->head + n < end)
+    {
+        struct usbdevfs_urb *urb = &rq->urb[rq->head + n];
+
+        if(rq_wait(dev, rq->head + n, timeout) <= 0)
+        {
+            if(n == 0)
+            {
+                return 0;
+            }
+            /* As for rq_bulk_read(), return what has arrived */
+            in_place = 1;
+        }
+        else if(urb->status < 0 && !(urb->status == -EREMOTEIO && (urb->flags & USBDEVFS_URB_SHORT_NOT_OK)))
+        {
+            break;
+        }
+        else
+        {
+            len += urb->actual_length;
+            n++;
+            /* A short URB marks the end of the transfer */
+            in_place = urb->actual_length < urb->buffer_length || len >= size;
+        }
+    }
+
+    if(!in_place && rq->per_slot == 1)
+    {
+        return -1;
+    }
+
+    /* The URBs are resubmitted on the next read */
+    rq->held = rq->head;
+    rq->nheld = rq->per_slot > 1 ? rq->per_slot : n;
+    rq->head = (rq->head + rq->nheld) % rq->depth;
+    *bytes = rq->urb[rq->held].buffer;
+
+    return len < size ? len : size;
+}
+
+/* Satisfies a read from the read-ahead queue. Each URB is resubmitted as soon
+   as its data has been copied out so that the queue stays full.
+*/
+static ssize_t rq_bulk_read(struct usb_dev_handle *dev, __u8 * bytes, ssize_t size, int timeout)
+{
+    struct usb_read_queue *rq = dev->rq;
+    ssize_t retrieved = 0;
+
+    rq_release(dev);
+
+    if(rq->per_slot > 1)
+    {
+        /* Slots go back whole, so take it in place and copy it out */
+        __u8 *data;
+
+        retrieved = rq_get(dev, &data, size, timeout);
+        if(retrieved > 0)
+        {
+            memcpy(bytes, data, retrieved);
+        }
+        rq_release(dev);
+
+        return retrieved;
+    }
+
+    while(retrieved < size)
+    {
+        struct usbdevfs_urb *urb;
+        int i = rq->head;
+        int ret = rq_wait(dev, i, timeout);
+        ssize_t len;
+
+        if(ret <= 0)
+        {
+#ifdef DEBUG
+            fprintf(stderr, "%s reading from bulk endpoint 0x%x\n",
+                    ret == 0 ? "timeout" : "error", rq->ep);
+#endif
+            break;
+        }
+
+        urb = &rq->urb[i];
+        rq->head = (i + 1) % rq->depth;
+
+        if(urb->status < 0)
+        {
+#ifdef DEBUG
+            fprintf(stderr, "error %d reading from bulk endpoint 0x%x\n",
+                    urb->status, rq->ep);
+#endif
+            rq_submit(dev, i);
+            break;
+        }
+
+        len = urb->actual_length;
+        if(len > size - retrieved)
+        {
+            len = size - retrieved;
+        }
+        memcpy(bytes + retrieved, urb->buffer, len);
+        retrieved += len;
+
+        /* A short URB marks the end of the transfer */
+        len = urb->actual_length;
+        rq_submit(dev, i);
+        if(len < urb->buffer_length)
+        {
+            break;
+        }
+    }
+
+    return retrieved;
+}
+
+ssize_t usb_read_queue_get(struct usb_dev_handle *dev, int ep, __u8 **bytes, ssize_t size, int timeout)
+{
+    struct usb_read_queue *rq = dev->rq;
+    ssize_t len;
+
+    if(!rq || rq->ep != (ep | USB_ENDPOINT_DIR_MASK))
+    {
+        return -1;
+    }
+
+    rq_release(dev);
+
+    len = rq_get(dev, bytes, size, timeout);
+    if(len >= 0)
+    {
+        return len;
+    }
+
+    /* Wraps around the queue (or failed), so reassemble it */
+    if(rq->assembly_size < size)
+    {
+        free(rq->assembly);
+        rq->assembly = malloc(size);
+        rq->assembly_size = rq->assembly ? size : 0;
+        if(!rq->assembly)
+        {
+            return 0;
+        }
+    }
+    *bytes = rq->assembly;
+
+    return rq_bulk_read(dev, rq->assembly, size, timeout);
+}
+
+int usb_read_queue_start(struct usb_dev_handle *dev, int ep, int depth, size_t size)
+{
+    struct usb_read_queue *rq;
+    int per_slot = 1;
+    int i;
+
+    usb_read_queue_stop(dev);
+
+    if(depth < 1)
+    {
+        return -1;
+    }
+    if(size == 0 || size > dev->max_read)
+    {
+        size = dev->max_read;
+    }
+    if(dev->caps & USBDEVFS_CAP_BULK_CONTINUATION)
+    {
+        /* Whole slots only, so that none wraps around the queue */
+        per_slot = (USB_MAX_TRANSFER + size - 1) / size;
+        depth = (depth + per_slot - 1) / per_slot * per_slot;
+    }
+
+    rq = calloc(1, sizeof(*rq));
+    if(!rq)
+    {
+        return -1;
+    }
+    rq->ep = ep | USB_ENDPOINT_DIR_MASK;
+    rq->depth = depth;
+    rq->per_slot = per_slot;
+    rq->held = -1;
+    rq->urb = calloc(depth, sizeof(*rq->urb));
+    rq->done = calloc(depth, sizeof(*rq->done));
+    /* DMA-able memory if possible, so the kernel need not copy */
+    rq->buf = usb_alloc_buffer(dev, depth * size);
+    if(!rq->urb || !rq->done || !rq->buf)
+    {
+        free(rq->urb);
+        free(rq->done);
+        if(rq->buf)
+        {
+            usb_free_buffer(dev, rq->buf);
+        }
+        free(rq);
+        return -1;
+    }
+
+    dev->rq = rq;
+
+    for(i = 0; i < depth; i++)
+    {
+        struct usbdevfs_urb *urb = &rq->urb[i];
+
+        urb->type = USBDEVFS_URB_TYPE_BULK;
+        urb->endpoint = rq->ep;
+        urb->buffer = rq->buf + i * size;
+        urb->buffer_length = size;
+        urb->usercontext = rq;
+        if(per_slot > 1)
+        {
+            /* Only the first URB of a slot starts a transfer, and only
+               the last may end short without cancelling the rest.
+            */
+            if(i % per_slot != 0)
+            {
+                urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+            }
+            if(i % per_slot != per_slot - 1)
+            {
+                urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+            }
+        }
+
+        if(rq_submit(dev, i) < 0)
+        {
+            usb_read_queue_stop(dev);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void usb_read_queue_stop(struct usb_dev_handle *dev)
+{
+    struct usb_read_queue *rq = dev->rq;
+    int i;
+
+    if(!rq)
+    {
+        return;
+    }
+
+    /* Discard everything in flight and wait for the kernel to give it back */
+    for(i = 0; i < rq->depth; i++)
+    {
+        if(!rq->done[i])
+        {
+            ioctl(dev->fd, USBDEVFS_DISCARDURB, &rq->urb[i]);
+        }
+    }
+    while(rq->active > 0)
+    {
+        struct usbdevfs_urb *urb;
+
+        if(ioctl(dev->fd, USBDEVFS_REAPURB, &urb) < 0)
+        {
+            break;
+        }
+        rq->active--;
+    }
+
+    dev->rq = NULL;
+    free(rq->urb);
+    free(rq->done);
+    usb_free_buffer(dev, rq->buf);
+    free(rq->assembly);
+    free(rq);
+}
@@ -26,31 +26,143 @@
 #ifndef _USB_IO_H
 #define _USB_IO_H 1
 
+#include <sys/types.h>
+
+/* The largest single transfer we ever need. This holds a whole Topfield packet */
+#define USB_MAX_TRANSFER 0x10000
+
+/* A region of DMA-able memory obtained from the kernel */
+struct usb_mmap_region {
+	void *addr;
+	size_t len;
+	struct usb_mmap_region *next;
+};
+
+struct usb_read_queue;
+
 #ifdef USE_LIBUSB
-#include <usb.h>
+#include <poll.h>
+#include <libusb.h>
+
+#include "tf_types.h"
+
+#define USB_ENDPOINT_DIR_MASK LIBUSB_ENDPOINT_DIR_MASK
+
+/* Default number of write transfers kept in flight */
+#define USB_DEFAULT_WRITE_DEPTH 4
+
+struct usb_dev_handle {
+	libusb_device_handle *h;
+	int max_read;				/* Size of each read transfer */
+	int max_write;				/* Size of each write transfer */
+	int write_depth;			/* Number of write transfers in flight */
+	struct usb_mmap_region *mmaps;	/* Buffers allocated by usb_alloc_buffer() */
+	struct usb_read_queue *rq;	/* Active read-ahead queue, or NULL */
+};
+
+/**
+ * Sets the number of transfers kept in flight when writing.
+ * Each write is split into up to this many pieces (of whole packets,
+ * and no more than dev->max_write) which are submitted together.
+ */
+void usb_set_write_depth(struct usb_dev_handle *dev, int depth);
+
+/**
+ * All devices share a single libusb context so that one poll() loop
+ * can drive any number of devices.
+ *
+ * Fills in up to 'max' entries of 'fds' with the file descriptors
+ * and events which should be polled on behalf of the library.
+ * Returns the number of entries needed, which may be more than 'max'.
+ * Returns -1 if no device is open.
+ *
+ * When they are ready, usb_bulk_read() and usb_read_queue_get() with a
+ * negative timeout handle the pending events without waiting, and
+ * return 0 if the transfer is still to come.
+ */
+int usb_get_pollfds(struct pollfd *fds, int max);
+
 #else
 
-#include <sys/types.h>
 #include <linux/types.h>
 #include <linux/version.h>
 
-/* linux/usb_ch9.h wasn't separated out until 2.4.23 */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,4,23)
+/* linux/usb_ch9.h wasn't separated out until 2.4.23, and moved in 2.6.22 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+#include <linux/usb/ch9.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,4,23)
 #include <linux/usb_ch9.h>
 #else
 #include <linux/usb.h>
 #endif
 #include <linux/usbdevice_fs.h>
 
+/* These may not be in the headers we were built against,
+ * but the running kernel may still support them.
+ */
+#ifndef USBDEVFS_GET_CAPABILITIES
+#define USBDEVFS_GET_CAPABILITIES  _IOR('U', 26, __u32)
+#endif
+#ifndef USBDEVFS_CAP_BULK_CONTINUATION
+#define USBDEVFS_CAP_BULK_CONTINUATION 0x02
+#endif
+#ifndef USBDEVFS_URB_BULK_CONTINUATION
+#define USBDEVFS_URB_BULK_CONTINUATION 0x04
+#endif
+#ifndef USBDEVFS_CAP_NO_PACKET_SIZE_LIM
+#define USBDEVFS_CAP_NO_PACKET_SIZE_LIM 0x04
+#endif
+#ifndef USBDEVFS_CAP_MMAP
+#define USBDEVFS_CAP_MMAP          0x20
+#endif
+
 struct usb_dev_handle {
 	int fd;
+	__u32 caps;					/* USBDEVFS_CAP_... reported by the kernel, or 0 */
+	int max_read;				/* Largest single read the kernel will accept */
+	int max_write;				/* Largest single write the kernel will accept */
+	struct usb_mmap_region *mmaps;	/* Buffers allocated by usb_alloc_buffer() */
+	struct usb_read_queue *rq;	/* Active read-ahead queue, or NULL */
 };
 
+#endif
+
 typedef struct usb_dev_handle usb_dev_handle;
 
 ssize_t usb_bulk_write(struct usb_dev_handle *dev, int ep, const __u8 * bytes, ssize_t length, int timeout);
 ssize_t usb_bulk_read(struct usb_dev_handle *dev, int ep, __u8 * bytes, ssize_t size, int timeout);
 
-#endif
+/**
+ * Starts a read-ahead queue of 'depth' URBs (libusb transfers), each of
+ * 'size' bytes (or dev->max_read if 0), on the given IN endpoint.
+ * All of them are kept in flight so that the bus never sits idle.
+ *
+ * While the queue is active, usb_bulk_read() on that endpoint is satisfied
+ * from the queue. A transfer is complete when a URB completes short,
+ * exactly as for a synchronous read.
+ *
+ * Returns 0 if OK or -1 on error (in which case reads remain synchronous).
+ */
+int usb_read_queue_start(struct usb_dev_handle *dev, int ep, int depth, size_t size);
+
+/**
+ * Reads the next transfer from the read-ahead queue without copying it.
+ * On success, '*bytes' points to the data, which remains valid until the
+ * next read or until the queue is stopped. The data may be modified in place.
+ *
+ * A transfer which spans several URBs is normally handed out in place too,
+ * since the URB buffers are back to back. Only if it wraps around the end
+ * of the queue is it reassembled into a buffer owned by the queue, so the
+ * caller need not care.
+ *
+ * Returns the number of bytes read, or -1 if no queue is active on 'ep'.
+ */
+ssize_t usb_read_queue_get(struct usb_dev_handle *dev, int ep, __u8 **bytes, ssize_t size, int timeout);
+
+/**
+ * Stops any active read-ahead queue. Any data which has been
+ * received but not yet read is discarded.
+ */
+void usb_read_queue_stop(struct usb_dev_handle *dev);
 
 #endif /* _USB_IO_H */
@@ -28,11 +28,50 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
 
 #include "usbutil.h"
 
 #define MAX_DEVICES_LINE_SIZE 128
 
+/**
+ * Chooses the largest transfers the running kernel can cope with.
+ * If there is no packet size limit, a whole Topfield packet can go in
+ * a single submission. Otherwise usbdevfs has a limit of 16KiB per
+ * read/write, or one page before 2.6.
+ *
+ * A packet then spans several URBs. Where the kernel also reports
+ * USBDEVFS_CAP_BULK_CONTINUATION, the read queue submits each packet's
+ * URBs as one continued transfer (see usb_read_queue_start()). Writes
+ * don't need it, since every piece but the last is a whole number of
+ * max-size packets.
+ */
+static void probe_transfer_limits(struct usb_dev_handle *dev)
+{
+	if (dev->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM) {
+		dev->max_read = USB_MAX_TRANSFER;
+		dev->max_write = USB_MAX_TRANSFER;
+	}
+	else {
+		struct utsname u;
+		int major = 0;
+		int minor = 0;
+
+		if (uname(&u) == 0) {
+			sscanf(u.release, "%d.%d", &major, &minor);
+		}
+		if (major > 2 || (major == 2 && minor >= 6)) {
+			dev->max_read = 16384;
+			dev->max_write = 16384;
+		}
+		else {
+			dev->max_read = 4096;
+			dev->max_write = 4096;
+		}
+	}
+}
+
 struct usb_dev_handle *open_usb_dev(int vendor_id, int product_id, int index)
 {
 	int fd;
@@ -117,12 +156,22 @@ struct usb_dev_handle *open_usb_dev(int vendor_id, int product_id, int index)
 
 	dev = malloc(sizeof(*dev));
 	dev->fd = fd;
+	dev->mmaps = NULL;
+	dev->rq = NULL;
+
+	/* Older kernels don't know about capabilities, so assume none */
+	if (ioctl(fd, USBDEVFS_GET_CAPABILITIES, &dev->caps) < 0) {
+		dev->caps = 0;
+	}
+	probe_transfer_limits(dev);
 
 	return dev;
 }
 
 void close_usb_dev(struct usb_dev_handle *dev)
 {
+	usb_read_queue_stop(dev);
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,0) && LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,10)
 	/* On Linux 2.6 before 2.6.11, using usb_reset() here significantly speeds
 	 * up reconnection.
@@ -136,3 +185,60 @@ void close_usb_dev(struct usb_dev_handle *dev)
 	close(dev->fd);
 	free(dev);
 }
+
+void usb_get_limits(struct usb_dev_handle *dev, int *max_read, int *max_write)
+{
+	*max_read = dev->max_read;
+	*max_write = dev->max_write;
+}
+
+/**
+ * Page aligned heap memory, for when DMA-able memory can't be had,
+ * so that callers still get the alignment usb_alloc_buffer() promises.
+ */
+static void *usb_heap_buffer(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, size) != 0) {
+		return NULL;
+	}
+	return buf;
+}
+
+void *usb_alloc_buffer(struct usb_dev_handle *dev, size_t size)
+{
+	if (dev->caps & USBDEVFS_CAP_MMAP) {
+		struct usb_mmap_region *region = malloc(sizeof(*region));
+
+		if (region) {
+			region->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+			if (region->addr != MAP_FAILED) {
+				region->len = size;
+				region->next = dev->mmaps;
+				dev->mmaps = region;
+				return region->addr;
+			}
+			free(region);
+		}
+		/* Probably hit usbfs_memory_mb, so fall back to the heap */
+	}
+	return usb_heap_buffer(size);
+}
+
+void usb_free_buffer(struct usb_dev_handle *dev, void *buf)
+{
+	struct usb_mmap_region **pt;
+
+	for (pt = &dev->mmaps; *pt; pt = &(*pt)->next) {
+		struct usb_mmap_region *region = *pt;
+
+		if (region->addr == buf) {
+			*pt = region->next;
+			munmap(region->addr, region->len);
+			free(region);
+			return;
+		}
+	}
+	free(buf);
+}
@@ -22,97 +22,617 @@
 
 */
 
-#ifdef __linux
-#include <linux/version.h>
-#endif
+/* USB access via libusb-1.0, for platforms without usbfs.
+ *
+ * Transfers are submitted asynchronously so that several can be
+ * in flight at once on each endpoint. The synchronous usb_bulk_...()
+ * interface is built on top of this by running the libusb event loop
+ * until the transfers we are interested in have completed.
+ *
+ * Reads with a negative timeout only handle the events which are already
+ * pending, so that a caller with its own poll() loop (on the descriptors
+ * from usb_get_pollfds()) never blocks waiting for a packet. Writes are
+ * always waited for.
+ */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "usbutil.h"
 
-struct usb_dev_handle *open_usb_dev(int vendor_id, int product_id, int index)
+/* One context is shared by all devices so that they can be driven from a single event loop.
+ * Devices may be opened and closed from any thread, so the reference count is locked.
+ */
+static libusb_context *usb_ctx;
+static int usb_ctx_users;
+static pthread_mutex_t usb_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Max packet size of a high speed bulk endpoint. Only the last piece
+ * of a write may be short of a multiple of this, or the device would
+ * take the short packet as the end of the transfer.
+ */
+#define USB_BULK_PACKET 0x200
+
+/* A transfer together with its completion flag */
+struct usb_slot {
+	struct libusb_transfer *xfer;
+	int done;
+};
+
+struct usb_read_queue {
+	int ep;
+	int depth;
+	int head;					/* Index of the oldest outstanding transfer */
+	int held;					/* Transfer handed out by usb_read_queue_get(), or -1 */
+	struct usb_slot *slot;		/* 'depth' transfers */
+	__u8 *buf;					/* 'depth' buffers of 'size' bytes */
+	__u8 *assembly;				/* Used to reassemble transfers which span several */
+	ssize_t assembly_size;
+};
+
+/**
+ * Takes a reference to the shared context, creating it if need be.
+ * Returns 0 if OK or a libusb error.
+ */
+static int usb_ctx_get(void)
 {
 	int err = 0;
-	int found = 0;
-	int count = 0;
-	struct usb_dev_handle *devh = NULL;
-	struct usb_device *usb_dev = NULL;
-	struct usb_bus *bus = NULL;
 
-	usb_init();
-	usb_find_busses();
-	usb_find_devices();
+	pthread_mutex_lock(&usb_ctx_lock);
+	if (usb_ctx_users == 0) {
+		err = libusb_init(&usb_ctx);
+	}
+	if (err == 0) {
+		usb_ctx_users++;
+	}
+	pthread_mutex_unlock(&usb_ctx_lock);
 
-	/* Loop through busses and devices to find the nth device with
-	 * a matching vendor and product id
-	 */
-	for (bus = usb_busses; bus; bus = bus->next) {
-		for (usb_dev = bus->devices; usb_dev; usb_dev = usb_dev->next) {
-			if ((usb_dev->descriptor.idVendor == vendor_id) &&
-				(usb_dev->descriptor.idProduct == product_id)) {
-				if (count++ == index) {
-					found = 1;
-					break;
-				}
+	return err;
+}
+
+/**
+ * Drops a reference to the shared context, destroying it with the last.
+ */
+static void usb_ctx_put(void)
+{
+	pthread_mutex_lock(&usb_ctx_lock);
+	if (--usb_ctx_users == 0) {
+		libusb_exit(usb_ctx);
+		usb_ctx = NULL;
+	}
+	pthread_mutex_unlock(&usb_ctx_lock);
+}
+
+static void LIBUSB_CALL usb_slot_done(struct libusb_transfer *xfer)
+{
+	struct usb_slot *slot = xfer->user_data;
+
+	slot->done = 1;
+}
+
+/**
+ * Runs the event loop until the slot completes or the timeout (in ms) expires.
+ * A timeout of 0 means wait forever, and a negative timeout means only
+ * handle whatever events are already pending.
+ * Returns 1 if completed, 0 on timeout or -1 on error.
+ */
+static int usb_slot_wait(struct usb_slot *slot, int timeout)
+{
+	struct timeval deadline;
+
+	if (timeout < 0) {
+		struct timeval tv = { 0, 0 };
+
+		if (!slot->done && libusb_handle_events_timeout_completed(usb_ctx, &tv, &slot->done) < 0) {
+			return -1;
+		}
+		return slot->done;
+	}
+
+	gettimeofday(&deadline, NULL);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_usec += (timeout % 1000) * 1000;
+	if (deadline.tv_usec >= 1000000) {
+		deadline.tv_sec++;
+		deadline.tv_usec -= 1000000;
+	}
+
+	while (!slot->done) {
+		struct timeval now;
+		struct timeval tv = { 1, 0 };
+
+		if (timeout > 0) {
+			gettimeofday(&now, NULL);
+			if (!timercmp(&now, &deadline, <)) {
+				return 0;
 			}
+			timersub(&deadline, &now, &tv);
 		}
-		if (found) {
-			break;
+		if (libusb_handle_events_timeout_completed(usb_ctx, &tv, &slot->done) < 0) {
+			return -1;
 		}
 	}
+	return 1;
+}
 
-	if (!found) {
-		return 0;
+/**
+ * Cancels the slot's transfer if it is still in flight and
+ * waits for libusb to give it back.
+ */
+static void usb_slot_cancel(struct usb_slot *slot)
+{
+	if (!slot->done) {
+		libusb_cancel_transfer(slot->xfer);
+		while (!slot->done) {
+			if (libusb_handle_events_completed(usb_ctx, &slot->done) < 0) {
+				break;
+			}
+		}
 	}
+}
 
-	devh = usb_open(usb_dev);
+struct usb_dev_handle *open_usb_dev(int vendor_id, int product_id, int index)
+{
+	int err = 0;
+	int count = 0;
+	ssize_t num;
+	ssize_t i;
+	libusb_device **list;
+	libusb_device_handle *h = NULL;
+	struct usb_dev_handle *devh;
 
-	if (!devh) {
-		fprintf(stderr, "usb_open returned failure\n");
+	if ((err = usb_ctx_get())) {
+		fprintf(stderr, "libusb_init returned an error (%d)\n", err);
 		return 0;
 	}
 
-	if((err = usb_claim_interface(devh, 0))) {
-		fprintf(stderr, "usb_claim_interface returned an error (%d)\n", err);
-		usb_close(devh);
-		return 0;
+	/* Loop through the devices to find the nth device with
+	 * a matching vendor and product id
+	 */
+	num = libusb_get_device_list(usb_ctx, &list);
+	for (i = 0; i < num; i++) {
+		struct libusb_device_descriptor desc;
+
+		if (libusb_get_device_descriptor(list[i], &desc) == 0 &&
+			desc.idVendor == vendor_id && desc.idProduct == product_id) {
+			if (count++ == index) {
+				if ((err = libusb_open(list[i], &h))) {
+					fprintf(stderr, "libusb_open returned an error (%d)\n", err);
+				}
+				break;
+			}
+		}
+	}
+	if (num >= 0) {
+		libusb_free_device_list(list, 1);
 	}
 
-#if 0
-	/* It's not clear that these are needed */
-	if((err = usb_set_configuration(devh, 1))) {
-		fprintf(stderr, "usb_set_configuration returned an error (%d)\n", err);
-		close_usb_dev(devh);
-		return 0;
+	if (!h) {
+		goto fail;
 	}
 
-	if((err = usb_set_altinterface(devh, 0))) {
-		fprintf(stderr, "usb_set_altinterface returned an error (%d)\n", err);
-		close_usb_dev(devh);
-		return 0;
+	if ((err = libusb_claim_interface(h, 0))) {
+		fprintf(stderr, "libusb_claim_interface returned an error (%d)\n", err);
+		libusb_close(h);
+		goto fail;
 	}
-#endif
+
+	devh = calloc(1, sizeof(*devh));
+	devh->h = h;
+	/* libusb copes with transfers of any size */
+	devh->max_read = USB_MAX_TRANSFER;
+	devh->max_write = USB_MAX_TRANSFER;
+	devh->write_depth = USB_DEFAULT_WRITE_DEPTH;
+
 	return devh;
+
+fail:
+	usb_ctx_put();
+	return 0;
 }
 
 void close_usb_dev(struct usb_dev_handle *devh)
 {
-#if defined(__linux)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,0) && LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,10)
-#define DO_USB_RESET
+	usb_read_queue_stop(devh);
+
+	if (libusb_release_interface(devh->h, 0)) {
+		fprintf(stderr, "libusb_release_interface returned an error!\n");
+	}
+	libusb_close(devh->h);
+	free(devh);
+
+	usb_ctx_put();
+}
+
+void usb_set_write_depth(struct usb_dev_handle *dev, int depth)
+{
+	dev->write_depth = depth > 0 ? depth : 1;
+}
+
+void usb_get_limits(struct usb_dev_handle *devh, int *max_read, int *max_write)
+{
+	*max_read = devh->max_read;
+	*max_write = devh->max_write;
+}
+
+/**
+ * Heap memory for when libusb can't provide DMA-able memory.
+ */
+static void *usb_heap_buffer(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, size) != 0) {
+		return NULL;
+	}
+	return buf;
+}
+
+void *usb_alloc_buffer(struct usb_dev_handle *devh, size_t size)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	/* Where the platform supports it, get DMA-able memory */
+	struct usb_mmap_region *region = malloc(sizeof(*region));
+
+	if (region) {
+		region->addr = libusb_dev_mem_alloc(devh->h, size);
+		if (region->addr) {
+			region->len = size;
+			region->next = devh->mmaps;
+			devh->mmaps = region;
+			return region->addr;
+		}
+		free(region);
+	}
 #endif
+	return usb_heap_buffer(size);
+}
+
+void usb_free_buffer(struct usb_dev_handle *devh, void *buf)
+{
+	struct usb_mmap_region **pt;
+
+	for (pt = &devh->mmaps; *pt; pt = &(*pt)->next) {
+		struct usb_mmap_region *region = *pt;
+
+		if (region->addr == buf) {
+			*pt = region->next;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+			libusb_dev_mem_free(devh->h, region->addr, region->len);
 #endif
+			free(region);
+			return;
+		}
+	}
+	free(buf);
+}
 
-#ifdef DO_USB_RESET
-	/* On Linux 2.6 before 2.6.11, using usb_reset() here significantly speeds
-	 * up reconnection.
-	 */
-	usb_reset(devh);
+int usb_get_pollfds(struct pollfd *fds, int max)
+{
+	const struct libusb_pollfd **pollfds;
+	int i;
+
+	if (!usb_ctx || !(pollfds = libusb_get_pollfds(usb_ctx))) {
+		return -1;
+	}
+	for (i = 0; pollfds[i]; i++) {
+		if (i < max) {
+			fds[i].fd = pollfds[i]->fd;
+			fds[i].events = pollfds[i]->events;
+			fds[i].revents = 0;
+		}
+	}
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000104
+	libusb_free_pollfds(pollfds);
 #else
-	if (usb_release_interface(devh, 0)) {
-		fprintf(stderr, "usb_release_interface returned an error!\n");
+	free(pollfds);
+#endif
+	return i;
+}
+
+/**
+ * Returns the size of each piece of a write of 'length', so that the
+ * write is spread over write_depth transfers in flight together.
+ */
+static ssize_t usb_write_piece(struct usb_dev_handle *dev, ssize_t length)
+{
+	ssize_t piece = (length + dev->write_depth - 1) / dev->write_depth;
+
+	piece = (piece + USB_BULK_PACKET - 1) / USB_BULK_PACKET * USB_BULK_PACKET;
+
+	return piece < dev->max_write ? piece : dev->max_write;
+}
+
+ssize_t usb_bulk_write(struct usb_dev_handle *dev, int ep, const __u8 * bytes, ssize_t length, int timeout)
+{
+	struct usb_slot slot[dev->write_depth];
+	ssize_t piece = usb_write_piece(dev, length);
+	ssize_t sent = 0;
+	int failed = 0;
+
+	ep &= ~USB_ENDPOINT_DIR_MASK;
+
+	/* Submit up to write_depth pieces at once, then wait for them all */
+	while (sent < length && !failed) {
+		ssize_t offset = sent;
+		int n;
+		int i;
+
+		for (n = 0; n < dev->write_depth && offset < length; n++) {
+			ssize_t len = length - offset;
+
+			if (len > piece) {
+				len = piece;
+			}
+			slot[n].done = 0;
+			slot[n].xfer = libusb_alloc_transfer(0);
+			if (!slot[n].xfer) {
+				break;
+			}
+			libusb_fill_bulk_transfer(slot[n].xfer, dev->h, ep, (unsigned char *)bytes + offset, len,
+				usb_slot_done, &slot[n], timeout);
+			if (libusb_submit_transfer(slot[n].xfer) < 0) {
+				libusb_free_transfer(slot[n].xfer);
+				break;
+			}
+			offset += len;
+		}
+		if (n == 0) {
+			failed = 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!failed && usb_slot_wait(&slot[i], timeout) > 0 &&
+				slot[i].xfer->status == LIBUSB_TRANSFER_COMPLETED &&
+				slot[i].xfer->actual_length == slot[i].xfer->length) {
+				sent += slot[i].xfer->actual_length;
+			}
+			else {
+				/* Once anything fails, the rest is meaningless */
+				failed = 1;
+				usb_slot_cancel(&slot[i]);
+			}
+			libusb_free_transfer(slot[i].xfer);
+		}
+	}
+
+	if ((length % 0x200) == 0) {
+		fprintf(stderr,
+				"WARNING: USB I/O is modulo 0x200 - this can trigger a bug in Topfield firmware.\n");
 	}
 
-	usb_close(devh);
+	return sent;
+}
+
+static ssize_t rq_bulk_read(struct usb_dev_handle *dev, __u8 * bytes, ssize_t size, int timeout);
+
+ssize_t usb_bulk_read(struct usb_dev_handle *dev, int ep, __u8 * bytes, ssize_t size, int timeout)
+{
+	int retrieved = 0;
+	int ret;
+
+	ep |= USB_ENDPOINT_DIR_MASK;
+
+	if (timeout < 0 && !dev->rq) {
+		/* A read has to be in flight to be able to not wait for it */
+		if (usb_read_queue_start(dev, ep, 1, 0) != 0) {
+			return -1;
+		}
+	}
+	if (dev->rq && dev->rq->ep == ep) {
+		return rq_bulk_read(dev, bytes, size, timeout);
+	}
+
+	ret = libusb_bulk_transfer(dev->h, ep, bytes, size, &retrieved, timeout);
+	if (ret < 0 && ret != LIBUSB_ERROR_TIMEOUT) {
+#ifdef DEBUG
+		fprintf(stderr, "error %d reading from bulk endpoint 0x%x\n", ret, ep);
 #endif
+	}
+	return retrieved;
+}
+
+static int rq_submit(struct usb_read_queue *rq, int i)
+{
+	rq->slot[i].done = 0;
+
+	if (libusb_submit_transfer(rq->slot[i].xfer) < 0) {
+		/* Treat it as failed so nobody waits for it */
+		rq->slot[i].xfer->status = LIBUSB_TRANSFER_ERROR;
+		rq->slot[i].xfer->actual_length = 0;
+		rq->slot[i].done = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static void rq_release(struct usb_read_queue *rq)
+{
+	if (rq->held >= 0) {
+		rq_submit(rq, rq->held);
+		rq->held = -1;
+	}
+}
+
+/* Satisfies a read from the read-ahead queue. Each transfer is resubmitted as soon
+ * as its data has been copied out so that the queue stays full.
+ */
+static ssize_t rq_bulk_read(struct usb_dev_handle *dev, __u8 * bytes, ssize_t size, int timeout)
+{
+	struct usb_read_queue *rq = dev->rq;
+	ssize_t retrieved = 0;
+
+	rq_release(rq);
+
+	while (retrieved < size) {
+		int i = rq->head;
+		struct libusb_transfer *xfer = rq->slot[i].xfer;
+		ssize_t len;
+
+		if (usb_slot_wait(&rq->slot[i], timeout) <= 0) {
+			break;
+		}
+		rq->head = (i + 1) % rq->depth;
+
+		if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+#ifdef DEBUG
+			fprintf(stderr, "error %d reading from bulk endpoint 0x%x\n", xfer->status, rq->ep);
+#endif
+			rq_submit(rq, i);
+			break;
+		}
+
+		len = xfer->actual_length;
+		if (len > size - retrieved) {
+			len = size - retrieved;
+		}
+		memcpy(bytes + retrieved, xfer->buffer, len);
+		retrieved += len;
+
+		/* A short transfer marks the end */
+		len = xfer->actual_length;
+		rq_submit(rq, i);
+		if (len < xfer->length) {
+			break;
+		}
+	}
+
+	return retrieved;
+}
+
+ssize_t usb_read_queue_get(struct usb_dev_handle *dev, int ep, __u8 **bytes, ssize_t size, int timeout)
+{
+	struct usb_read_queue *rq = dev->rq;
+	struct libusb_transfer *xfer;
+
+	if (!rq || rq->ep != (ep | USB_ENDPOINT_DIR_MASK)) {
+		return -1;
+	}
+
+	rq_release(rq);
+
+	if (usb_slot_wait(&rq->slot[rq->head], timeout) <= 0) {
+		return 0;
+	}
+
+	xfer = rq->slot[rq->head].xfer;
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED && xfer->actual_length < xfer->length) {
+		/* The whole transfer is in this one, so hand it out in place.
+		 * It is resubmitted on the next read.
+		 */
+		rq->held = rq->head;
+		rq->head = (rq->head + 1) % rq->depth;
+		*bytes = xfer->buffer;
+
+		return xfer->actual_length < size ? xfer->actual_length : size;
+	}
+
+	/* Spans several transfers (or failed), so reassemble it */
+	if (rq->assembly_size < size) {
+		free(rq->assembly);
+		rq->assembly = malloc(size);
+		rq->assembly_size = rq->assembly ? size : 0;
+		if (!rq->assembly) {
+			return 0;
+		}
+	}
+	*bytes = rq->assembly;
+
+	return rq_bulk_read(dev, rq->assembly, size, timeout);
+}
+
+int usb_read_queue_start(struct usb_dev_handle *dev, int ep, int depth, size_t size)
+{
+	struct usb_read_queue *rq;
+	int i;
+
+	usb_read_queue_stop(dev);
+
+	if (depth < 1) {
+		return -1;
+	}
+	if (size == 0 || size > dev->max_read) {
+		size = dev->max_read;
+	}
+
+	rq = calloc(1, sizeof(*rq));
+	if (!rq) {
+		return -1;
+	}
+	rq->ep = ep | USB_ENDPOINT_DIR_MASK;
+	rq->depth = depth;
+	rq->held = -1;
+	rq->slot = calloc(depth, sizeof(*rq->slot));
+	rq->buf = usb_alloc_buffer(dev, depth * size);
+	if (!rq->slot || !rq->buf) {
+		goto fail;
+	}
+
+	for (i = 0; i < depth; i++) {
+		rq->slot[i].done = 1;
+		rq->slot[i].xfer = libusb_alloc_transfer(0);
+		if (!rq->slot[i].xfer) {
+			goto fail;
+		}
+		/* The timeout is applied when waiting, not here */
+		libusb_fill_bulk_transfer(rq->slot[i].xfer, dev->h, rq->ep, rq->buf + i * size, size,
+			usb_slot_done, &rq->slot[i], 0);
+	}
+
+	dev->rq = rq;
+
+	for (i = 0; i < depth; i++) {
+		if (rq_submit(rq, i) < 0) {
+			usb_read_queue_stop(dev);
+			return -1;
+		}
+	}
+
+	return 0;
+
+fail:
+	if (rq->slot) {
+		for (i = 0; i < depth; i++) {
+			if (rq->slot[i].xfer) {
+				libusb_free_transfer(rq->slot[i].xfer);
+			}
+		}
+		free(rq->slot);
+	}
+	if (rq->buf) {
+		usb_free_buffer(dev, rq->buf);
+	}
+	free(rq);
+	return -1;
+}
+
+void usb_read_queue_stop(struct usb_dev_handle *dev)
+{
+	struct usb_read_queue *rq = dev->rq;
+	int i;
+
+	if (!rq) {
+		return;
+	}
+
+	/* Cancel everything in flight and wait for libusb to give it back */
+	for (i = 0; i < rq->depth; i++) {
+		if (!rq->slot[i].done) {
+			libusb_cancel_transfer(rq->slot[i].xfer);
+		}
+	}
+	for (i = 0; i < rq->depth; i++) {
+		usb_slot_cancel(&rq->slot[i]);
+		libusb_free_transfer(rq->slot[i].xfer);
+	}
+
+	dev->rq = NULL;
+	free(rq->slot);
+	usb_free_buffer(dev, rq->buf);
+	free(rq->assembly);
+	free(rq);
 }
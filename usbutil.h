@@ -36,7 +36,30 @@ struct usb_dev_handle *open_usb_dev(int vendor_id, int product_id, int index);
 
 /**
  * Close a previously opened usb device.
+ * Any buffers allocated with usb_alloc_buffer() must be freed first.
  */
 void close_usb_dev(struct usb_dev_handle *devh);
 
+/**
+ * Returns the largest single read and write transfers, in bytes,
+ * which will be used for the device.
+ * These are chosen at runtime according to what the kernel supports.
+ */
+void usb_get_limits(struct usb_dev_handle *devh, int *max_read, int *max_write);
+
+/**
+ * Allocates a transfer buffer of 'size' bytes for the device.
+ * Where the kernel supports it, this is DMA-able memory mapped from usbfs
+ * so that transfers to and from it need not be copied by the kernel.
+ * Otherwise it is ordinary heap memory. Either way it is page aligned.
+ *
+ * Returns 0 if no memory is available.
+ */
+void *usb_alloc_buffer(struct usb_dev_handle *devh, size_t size);
+
+/**
+ * Frees a buffer allocated with usb_alloc_buffer().
+ */
+void usb_free_buffer(struct usb_dev_handle *devh, void *buf);
+
 #endif